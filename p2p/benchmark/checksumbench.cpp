@@ -0,0 +1,153 @@
+#include <iostream>
+#include <iomanip>
+#include "../node/P2PPeerNode.cpp"
+using namespace std;
+
+/**
+ * Checksum benchmark
+ * - Times each checksum version, and each SHA-256 block function, over
+ *   payloads from a short message up to the largest chunk, and checks the
+ *   vectorized versions agree with the scalar ones.
+ */
+
+typedef uint32_t (*ChecksumFunction)(const char *, unsigned int);
+
+typedef struct {
+	string name;
+	ChecksumFunction function;
+	ChecksumFunction reference;
+	bool b_supported;
+} ChecksumVersion;
+
+// SHA-256 through one block function - whole blocks only, folded down to a word to compare
+uint32_t sha256Blocks(void (*compress)(uint32_t *, const unsigned char *, size_t), const char * data, unsigned int size)
+{
+	uint32_t state[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	compress(state, (const unsigned char *) data, size / 64);
+
+	uint32_t result = 0;
+	for (unsigned int i = 0; i < 8; i++)
+	{
+		result = (result << 5 | result >> 27) ^ state[i];
+	}
+
+	return result;
+}
+
+uint32_t sha256Scalar(const char * data, unsigned int size)
+{
+	return sha256Blocks(&P2PSha256::compressScalar, data, size);
+}
+
+uint32_t sha256ShaNi(const char * data, unsigned int size)
+{
+	return sha256Blocks(&P2PSha256::compressShaNi, data, size);
+}
+
+double timeChecksum(ChecksumFunction function, const char * data, unsigned int size, unsigned int & result)
+{
+	// Repeat until we've covered enough bytes for a stable reading
+	unsigned long long total_bytes = 256ULL * 1024 * 1024;
+	unsigned int iterations = max((unsigned long long) 1, total_bytes / size);
+
+	timeval start_time, end_time;
+	gettimeofday(&start_time, NULL);
+
+	uint32_t sink = 0;
+	for (unsigned int i = 0; i < iterations; i++)
+	{
+		sink ^= function(data, size);
+	}
+
+	gettimeofday(&end_time, NULL);
+	result = function(data, size);
+
+	// Keep the loop from being optimized away
+	if (sink == 0x12345678) cout << "";
+
+	double seconds = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_usec - start_time.tv_usec) / 1000000.0;
+	return ((double) iterations * size) / (1024.0 * 1024.0 * 1024.0) / seconds;
+}
+
+int main()
+{
+	// Pseudo-random data, offset by one byte so nothing gets aligned loads for free
+	unsigned int max_size = P2PFileTransfer::MAX_CHUNK_SIZE;
+	vector<char> buffer(max_size + 1);
+	unsigned int seed = 1;
+	for (unsigned int i = 0; i < buffer.size(); i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		buffer[i] = (char) (seed >> 16);
+	}
+	const char * data = &buffer[1];
+
+	ChecksumVersion versions[] = {
+		{ "sum scalar", &P2PChecksum::onesComplementScalar, &P2PChecksum::onesComplementScalar, true },
+		{ "sum sse4.2", &P2PChecksum::onesComplementSse42, &P2PChecksum::onesComplementScalar, P2PChecksum::hasSse42() },
+		{ "sum avx2", &P2PChecksum::onesComplementAvx2, &P2PChecksum::onesComplementScalar, P2PChecksum::hasAvx2() },
+		{ "crc32c sw", &P2PChecksum::crc32cSoftware, &P2PChecksum::crc32cSoftware, true },
+		{ "crc32c hw", &P2PChecksum::crc32cHardware, &P2PChecksum::crc32cSoftware, P2PChecksum::hasSse42() },
+		{ "sha256", &sha256Scalar, &sha256Scalar, true },
+		{ "sha256 ni", &sha256ShaNi, &sha256Scalar, P2PSha256::hasShaNi() }
+	};
+	unsigned int num_versions = sizeof(versions) / sizeof(versions[0]);
+
+	// From an odd-sized message up to the largest chunk
+	vector<unsigned int> sizes;
+	sizes.push_back(449);
+	for (unsigned int size = 1024; size <= max_size; size <<= 2)
+	{
+		sizes.push_back(size);
+	}
+
+	cout << "Checksum throughput in GiB/s (" << P2PChecksum::describeImplementations() << ", sha256 "
+		<< P2PSha256::describeImplementation() << " in use)" << endl << endl;
+	cout << setw(10) << "size";
+	for (unsigned int v = 0; v < num_versions; v++)
+	{
+		cout << setw(12) << versions[v].name;
+	}
+	cout << endl;
+
+	bool b_all_match = true;
+	for (unsigned int s = 0; s < sizes.size(); s++)
+	{
+		cout << setw(10) << sizes[s];
+		for (unsigned int v = 0; v < num_versions; v++)
+		{
+			if (!versions[v].b_supported)
+			{
+				cout << setw(12) << "-";
+				continue;
+			}
+
+			unsigned int result;
+			double throughput = timeChecksum(versions[v].function, data, sizes[s], result);
+			cout << setw(12) << fixed << setprecision(2) << throughput;
+
+			if (result != versions[v].reference(data, sizes[s]))
+			{
+				b_all_match = false;
+			}
+		}
+		cout << endl;
+	}
+
+	// Check the odd lengths too - every tail length for each version
+	for (unsigned int size = 0; size < 200; size++)
+	{
+		for (unsigned int v = 0; v < num_versions; v++)
+		{
+			if (versions[v].b_supported && versions[v].function(data, size) != versions[v].reference(data, size))
+			{
+				b_all_match = false;
+			}
+		}
+	}
+
+	cout << endl << (b_all_match ? "All versions agree." : "Error: checksum versions disagree!") << endl;
+	return b_all_match ? 0 : 1;
+}
@@ -0,0 +1,190 @@
+#include <iostream>
+#include <iomanip>
+#include "../node/P2PPeerNode.cpp"
+using namespace std;
+
+/**
+ * Chunk size benchmark
+ * - Streams a file over a loopback TCP connection with startTransferFile,
+ *   reassembling and checksumming the frames on the other end, once per chunk size.
+ */
+
+typedef struct {
+	int listen_socket;
+	unsigned long long bytes_received;
+	unsigned int chunks_received;
+	unsigned int bad_chunks;
+} ReceiverState;
+
+void * receiveFrames(void * arg)
+{
+	ReceiverState * state = (ReceiverState *) arg;
+	int socket_id = accept(state->listen_socket, NULL, NULL);
+
+	char * buffer = new char[65536];
+	string pending;
+
+	int bytes_read;
+	while ((bytes_read = read(socket_id, buffer, 65536)) > 0)
+	{
+		pending.append(buffer, bytes_read);
+
+		// Same reassembly as P2PPeerNode::handleIncomingData
+		size_t offset = 0;
+		P2PFrameHeader header;
+		while (pending.length() - offset >= P2PFrame::HEADER_SIZE
+			&& P2PFrame::unpackHeader(&pending[offset], header)
+			&& pending.length() - offset - P2PFrame::HEADER_SIZE >= header.length)
+		{
+			char * payload = &pending[offset + P2PFrame::HEADER_SIZE];
+			unsigned char algorithm = header.flags & P2PFrame::FLAG_CHECKSUM_MASK;
+			if (P2PChecksum::compute(algorithm, payload, header.length) != header.checksum)
+			{
+				state->bad_chunks++;
+			}
+
+			state->bytes_received += header.length;
+			state->chunks_received++;
+			offset += P2PFrame::HEADER_SIZE + header.length;
+		}
+
+		pending.erase(0, offset);
+	}
+
+	delete[] buffer;
+	close(socket_id);
+	pthread_exit(NULL);
+}
+
+int openListener(int & port)
+{
+	int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+
+	::bind(listen_socket, (struct sockaddr *) &address, sizeof(address));
+	listen(listen_socket, 1);
+
+	// Find out which port we were given
+	socklen_t address_length = sizeof(address);
+	getsockname(listen_socket, (struct sockaddr *) &address, &address_length);
+	port = ntohs(address.sin_port);
+
+	return listen_socket;
+}
+
+int connectTo(int port)
+{
+	int socket_id = socket(AF_INET, SOCK_STREAM, 0);
+
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+
+	if (connect(socket_id, (struct sockaddr *) &address, sizeof(address)) < 0)
+	{
+		perror("Error: could not connect to the receiver");
+		exit(1);
+	}
+
+	return socket_id;
+}
+
+double runTransfer(FileItem file_item, ReceiverState & state)
+{
+	int port;
+	state.listen_socket = openListener(port);
+	state.bytes_received = 0;
+	state.chunks_received = 0;
+	state.bad_chunks = 0;
+
+	pthread_t receiver;
+	pthread_create(&receiver, NULL, &receiveFrames, (void *) &state);
+
+	timeval start_time, end_time;
+	gettimeofday(&start_time, NULL);
+
+	// Send the whole file as one request
+	// The socket blocks, so every chunk is written as soon as it's queued and the transfer never has to wait
+	int socket_id = connectTo(port);
+	P2PSendQueue * queue = new P2PSendQueue(socket_id);
+	P2PFileTransfer file_transfer;
+	file_transfer.setBounds(1, 0);
+	if (file_transfer.startTransferFile(file_item))
+	{
+		file_transfer.continueTransferFile(queue, NULL, NULL);
+	}
+	queue->release();
+	close(socket_id);
+
+	pthread_join(receiver, NULL);
+	gettimeofday(&end_time, NULL);
+	close(state.listen_socket);
+
+	return (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_usec - start_time.tv_usec) / 1000000.0;
+}
+
+int main(int argc, const char* argv[])
+{
+	// File size in MiB
+	unsigned int file_size_mb = (argc > 1) ? atoi(argv[1]) : 64;
+	unsigned int file_size = file_size_mb * 1024 * 1024;
+
+	// Write a file of pseudo-random data to send
+	char path[] = "/tmp/p2pchunkbenchXXXXXX";
+	int file_descriptor = mkstemp(path);
+	if (file_descriptor < 0)
+	{
+		perror("Error: could not create the test file");
+		exit(1);
+	}
+
+	vector<char> data(1024 * 1024);
+	unsigned int seed = 1;
+	for (unsigned int i = 0; i < data.size(); i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		data[i] = (char) (seed >> 16);
+	}
+
+	for (unsigned int i = 0; i < file_size_mb; i++)
+	{
+		write(file_descriptor, &data[0], data.size());
+	}
+	close(file_descriptor);
+
+	FileItem file_item;
+	file_item.file_id = 1;
+	file_item.name = "chunkbench";
+	file_item.path = path;
+	file_item.size = file_size;
+
+	cout << "Streaming " << file_size_mb << " MiB over loopback TCP" << endl << endl;
+	cout << setw(12) << "chunk size" << setw(12) << "chunks" << setw(12) << "seconds" << setw(12) << "MiB/s" << endl;
+
+	for (unsigned int chunk_size = P2PFileTransfer::MIN_CHUNK_SIZE; chunk_size <= P2PFileTransfer::MAX_CHUNK_SIZE; chunk_size <<= 1)
+	{
+		file_item.chunk_size = chunk_size;
+
+		ReceiverState state;
+		double seconds = runTransfer(file_item, state);
+
+		if (state.bytes_received != file_size || state.bad_chunks > 0)
+		{
+			cout << "Error: transfer with " << chunk_size << " byte chunks was incomplete or corrupt" << endl;
+		}
+
+		cout << setw(12) << chunk_size << setw(12) << state.chunks_received
+			<< setw(12) << fixed << setprecision(3) << seconds
+			<< setw(12) << setprecision(1) << (file_size_mb / seconds) << endl;
+	}
+
+	remove(path);
+	return 0;
+}
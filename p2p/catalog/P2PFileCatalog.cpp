@@ -0,0 +1,820 @@
+/**
+ * Peer-to-peer file catalog class
+ */
+
+#include "P2PFileCatalog.hpp"
+
+const string P2PFileCatalog::SNAPSHOT_FILE = "catalog.snapshot";
+
+P2PFileCatalog::P2PFileCatalog()
+{
+	max_file_id = 0;
+	last_file_id = 0xFFFFFFFF;
+	version = 0;
+	log_start_version = 0;
+	b_journaling = false;
+	b_restoring = false;
+	journal_sequence = 0;
+	b_lookups_built = true;
+	lookup_cursor = 0;
+	search_cursor = 0;
+	pthread_rwlock_init(&lock, NULL);
+}
+
+P2PFileCatalog::~P2PFileCatalog()
+{
+	pthread_rwlock_destroy(&lock);
+}
+
+void P2PFileCatalog::setFileIdRange(unsigned int first_file_id, unsigned int last_id)
+{
+	// IDs count up from here - before any file is added - and never reach into anyone else's
+	max_file_id = first_file_id;
+	last_file_id = last_id;
+}
+
+void P2PFileCatalog::lockForReading()
+{
+	pthread_rwlock_rdlock(&lock);
+}
+
+void P2PFileCatalog::lockForWriting()
+{
+	pthread_rwlock_wrlock(&lock);
+}
+
+void P2PFileCatalog::unlock()
+{
+	pthread_rwlock_unlock(&lock);
+}
+
+FileItem * P2PFileCatalog::addFile(const FileItem & shared_file)
+{
+	this->finishLookups();
+
+	// Files are the same if they share their content
+	string key = P2PCommon::getContentKey(shared_file);
+	unordered_map<string, FileItem *>::iterator iter = files_by_content.find(key);
+	if (iter != files_by_content.end())
+	{
+		// Remember any new name it goes by
+		FileItem * file_item = iter->second;
+		if (file_item->name != shared_file.name
+			&& find(file_item->aliases.begin(), file_item->aliases.end(), shared_file.name) == file_item->aliases.end())
+		{
+			addName(file_item, shared_file.name);
+		}
+
+		return file_item;
+	}
+
+	// Otherwise it's new - give it the next ID, unless they've run out.
+	// IDs aren't reused, since clients may still hold the old ones.
+	if (max_file_id >= last_file_id)
+	{
+		return NULL;
+	}
+
+	FileItem * file_item = insertFile(++max_file_id, shared_file, key);
+
+	string record;
+	P2PJournal::putNumber(record, RECORD_ADD_FILE);
+	P2PJournal::putNumber(record, file_item->file_id);
+	P2PJournal::putNumber(record, file_item->size);
+	P2PJournal::putString(record, file_item->name);
+	P2PJournal::putString(record, file_item->hash);
+	P2PJournal::putString(record, file_item->piece_hashes);
+	logRecord(record);
+
+	return file_item;
+}
+
+FileItem * P2PFileCatalog::insertFile(unsigned int file_id, const FileItem & shared_file, const string & key)
+{
+	// IDs only grow, so the new item always goes on the end
+	FileItem & file_item = files.emplace_hint(files.end(), piecewise_construct, forward_as_tuple(file_id), forward_as_tuple())->second;
+	file_item.file_id = file_id;
+	file_item.name = shared_file.name;
+	file_item.size = shared_file.size;
+	file_item.hash = shared_file.hash;
+	file_item.piece_hashes = shared_file.piece_hashes;
+	file_item.chunk_size = 0;
+	file_item.completed = true;
+
+	files_by_id[file_item.file_id] = &file_item;
+	files_by_content[key] = &file_item;
+	markChanged(file_item.file_id);
+
+	// Restored files are indexed afterwards, a batch at a time
+	if (!b_restoring)
+	{
+		search_index.addName(file_item.file_id, file_item.name);
+	}
+
+	return &file_item;
+}
+
+void P2PFileCatalog::addName(FileItem * file_item, const string & name)
+{
+	file_item->aliases.push_back(name);
+	markChanged(file_item->file_id);
+
+	if (!b_restoring)
+	{
+		search_index.addName(file_item->file_id, name);
+	}
+
+	string record;
+	P2PJournal::putNumber(record, RECORD_ADD_NAME);
+	P2PJournal::putNumber(record, file_item->file_id);
+	P2PJournal::putString(record, name);
+	logRecord(record);
+}
+
+bool P2PFileCatalog::addAddress(FileItem * file_item, const FileAddress & file_address)
+{
+	this->finishLookups();
+
+	vector<FileAddress>::iterator iter;
+	for (iter = file_item->addresses.begin(); iter < file_item->addresses.end(); iter++)
+	{
+		if ((*iter).public_address == file_address.public_address &&
+			(*iter).public_port == file_address.public_port)
+		{
+			// Already known - but the peer may have reconnected on a new socket
+			if ((*iter).socket_id == file_address.socket_id)
+			{
+				return false;
+			}
+
+			(*iter).socket_id = file_address.socket_id;
+			files_by_socket[file_address.socket_id].push_back(file_item->file_id);
+			return false;
+		}
+	}
+
+	file_item->addresses.push_back(file_address);
+	files_by_socket[file_address.socket_id].push_back(file_item->file_id);
+	markChanged(file_item->file_id);
+
+	// The socket isn't kept - a restarted tracker waits for the peer to come back on a new one
+	string record;
+	P2PJournal::putNumber(record, RECORD_ADD_ADDRESS);
+	P2PJournal::putNumber(record, file_item->file_id);
+	P2PJournal::putString(record, file_address.public_address);
+	P2PJournal::putNumber(record, file_address.public_port);
+	P2PJournal::putString(record, file_address.remote_path);
+	logRecord(record);
+
+	return true;
+}
+
+void P2PFileCatalog::removeSocket(int socket_id)
+{
+	this->finishLookups();
+
+	unordered_map<int, vector<unsigned int> >::iterator socket_iter = files_by_socket.find(socket_id);
+	if (socket_iter == files_by_socket.end())
+	{
+		return;
+	}
+
+	// Detach the socket from each of its files
+	vector<unsigned int>::iterator id_iter;
+	for (id_iter = socket_iter->second.begin(); id_iter < socket_iter->second.end(); id_iter++)
+	{
+		FileItem * file_item = getFile(*id_iter);
+		if (file_item == NULL)
+		{
+			continue;
+		}
+
+		vector<FileAddress>::iterator addr_iter;
+		for (addr_iter = file_item->addresses.begin(); addr_iter < file_item->addresses.end(); )
+		{
+			if ((*addr_iter).socket_id == (unsigned int) socket_id)
+			{
+				string record;
+				P2PJournal::putNumber(record, RECORD_REMOVE_ADDRESS);
+				P2PJournal::putNumber(record, file_item->file_id);
+				P2PJournal::putString(record, (*addr_iter).public_address);
+				P2PJournal::putNumber(record, (*addr_iter).public_port);
+				logRecord(record);
+
+				addr_iter = file_item->addresses.erase(addr_iter);
+			}
+			else
+				addr_iter++;
+		}
+		markChanged(file_item->file_id);
+
+		// If a file has no more addresses attached to it, then remove it
+		if (file_item->addresses.size() == 0)
+		{
+			removeFile(file_item);
+		}
+	}
+
+	files_by_socket.erase(socket_iter);
+}
+
+FileItem * P2PFileCatalog::getFile(unsigned int file_id)
+{
+	// Until the lookups are built after a restore, fall back to the files themselves
+	if (!b_lookups_built)
+	{
+		map<unsigned int, FileItem>::iterator file_iter = files.find(file_id);
+		return (file_iter == files.end()) ? NULL : &file_iter->second;
+	}
+
+	unordered_map<unsigned int, FileItem *>::iterator iter = files_by_id.find(file_id);
+	return (iter == files_by_id.end()) ? NULL : iter->second;
+}
+
+const map<unsigned int, FileItem> & P2PFileCatalog::getFiles()
+{
+	return files;
+}
+
+vector<FileItem *> P2PFileCatalog::listFiles(unsigned int after_id, unsigned int limit, const FileFilter & filter, unsigned int & next_id)
+{
+	vector<FileItem *> page;
+
+	// Pick up after the last file the caller saw - IDs only grow, so nothing is skipped or seen twice
+	map<unsigned int, FileItem>::iterator iter = files.upper_bound(after_id);
+	unsigned int num_scanned = 0;
+	while (iter != files.end() && page.size() < limit && num_scanned < MAX_LIST_SCAN)
+	{
+		if (matchesFilter(iter->second, filter))
+		{
+			page.push_back(&iter->second);
+		}
+
+		next_id = iter->first;
+		num_scanned++;
+		iter++;
+	}
+
+	// Nothing left to look at
+	if (iter == files.end())
+	{
+		next_id = 0;
+	}
+
+	return page;
+}
+
+vector<FileItem *> P2PFileCatalog::searchFiles(const string & query, unsigned int limit)
+{
+	vector<SearchMatch> matches = search_index.search(query);
+
+	// Best matches first, then the files held by the most peers
+	vector<pair<FileItem *, unsigned int> > ranked;
+	vector<SearchMatch>::iterator match_iter;
+	for (match_iter = matches.begin(); match_iter != matches.end(); ++match_iter)
+	{
+		FileItem * file_item = getFile((*match_iter).file_id);
+		if (file_item != NULL)
+		{
+			ranked.push_back(make_pair(file_item, (*match_iter).score));
+		}
+	}
+
+	unsigned int num_results = min(limit, (unsigned int) ranked.size());
+	partial_sort(ranked.begin(), ranked.begin() + num_results, ranked.end(), &P2PFileCatalog::ranksBefore);
+
+	vector<FileItem *> results;
+	for (unsigned int i = 0; i < num_results; i++)
+	{
+		results.push_back(ranked[i].first);
+	}
+
+	return results;
+}
+
+bool P2PFileCatalog::matchesFilter(const FileItem & file_item, const FileFilter & filter)
+{
+	if (file_item.size < filter.min_size || (filter.max_size > 0 && file_item.size > filter.max_size))
+	{
+		return false;
+	}
+
+	if (filter.name_prefix.length() == 0 || file_item.name.compare(0, filter.name_prefix.length(), filter.name_prefix) == 0)
+	{
+		return true;
+	}
+
+	// Any of the names it's shared under will do
+	vector<string>::const_iterator iter;
+	for (iter = file_item.aliases.begin(); iter != file_item.aliases.end(); ++iter)
+	{
+		if ((*iter).compare(0, filter.name_prefix.length(), filter.name_prefix) == 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+unsigned int P2PFileCatalog::getVersion()
+{
+	return version;
+}
+
+bool P2PFileCatalog::getChangedFiles(unsigned int since_version, vector<unsigned int> & file_ids)
+{
+	// Versions the log no longer reaches, or never reached, can't be caught up from
+	if (since_version < log_start_version || since_version > version)
+	{
+		return false;
+	}
+
+	// The log is in version order - each file once, however often it changed
+	CatalogChange since;
+	since.version = since_version;
+	deque<CatalogChange>::iterator iter = upper_bound(changes.begin(), changes.end(), since, &P2PFileCatalog::isEarlierChange);
+	for (; iter != changes.end(); iter++)
+	{
+		file_ids.push_back((*iter).file_id);
+	}
+
+	sort(file_ids.begin(), file_ids.end());
+	file_ids.erase(unique(file_ids.begin(), file_ids.end()), file_ids.end());
+
+	return true;
+}
+
+vector<int> P2PFileCatalog::getSockets()
+{
+	vector<int> sockets;
+	unordered_map<int, vector<unsigned int> >::iterator iter;
+	for (iter = files_by_socket.begin(); iter != files_by_socket.end(); iter++)
+	{
+		sockets.push_back(iter->first);
+	}
+
+	return sockets;
+}
+
+unsigned int P2PFileCatalog::countFiles()
+{
+	return files.size();
+}
+
+void P2PFileCatalog::removeFile(FileItem * file_item)
+{
+	// Drop the indexes first, the item goes with the last line
+	unsigned int file_id = file_item->file_id;
+	files_by_content.erase(P2PCommon::getContentKey(*file_item));
+	search_index.removeFile(file_id);
+	files_by_id.erase(file_id);
+	files.erase(file_id);
+
+	string record;
+	P2PJournal::putNumber(record, RECORD_REMOVE_FILE);
+	P2PJournal::putNumber(record, file_id);
+	logRecord(record);
+}
+
+void P2PFileCatalog::markChanged(unsigned int file_id)
+{
+	// Clients catch up from scratch after a restart, so there's no point remembering what was restored
+	if (b_restoring)
+	{
+		version++;
+		return;
+	}
+
+	CatalogChange change;
+	change.version = ++version;
+	change.file_id = file_id;
+	changes.push_back(change);
+
+	// Forget the oldest - clients from before it have to start over
+	if (changes.size() > MAX_LOGGED_CHANGES)
+	{
+		log_start_version = changes.front().version;
+		changes.pop_front();
+	}
+}
+
+bool P2PFileCatalog::ranksBefore(const pair<FileItem *, unsigned int> & a, const pair<FileItem *, unsigned int> & b)
+{
+	if (a.second != b.second)
+	{
+		return a.second > b.second;
+	}
+
+	if (a.first->addresses.size() != b.first->addresses.size())
+	{
+		return a.first->addresses.size() > b.first->addresses.size();
+	}
+
+	return a.first->file_id < b.first->file_id;
+}
+
+bool P2PFileCatalog::isEarlierChange(const CatalogChange & a, const CatalogChange & b)
+{
+	return a.version < b.version;
+}
+
+bool P2PFileCatalog::restore(const string & directory, unsigned long long & replayed_log_bytes)
+{
+	// Nothing else is running yet, so no locking - and nothing is journaled or indexed until the end
+	state_directory = directory;
+	replayed_log_bytes = 0;
+	b_restoring = true;
+
+	// The snapshot says which log picks up after it
+	unsigned int generation = 0;
+	string snapshot_path = state_directory + "/" + SNAPSHOT_FILE;
+	if (!this->loadSnapshot(snapshot_path, generation))
+	{
+		cout << "Error: the catalog snapshot is damaged - setting it aside and starting over." << endl;
+		rename(snapshot_path.c_str(), (snapshot_path + ".damaged").c_str());
+		this->setAsideLogs(0);
+		generation = 0;
+	}
+
+	// Then every log since, in order
+	while (access(P2PJournal::getLogPath(state_directory, generation).c_str(), F_OK) == 0)
+	{
+		replayed_log_bytes += this->replayLog(P2PJournal::getLogPath(state_directory, generation));
+		generation++;
+	}
+
+	b_restoring = false;
+
+	// Logs past a gap don't follow on from what was replayed - keep them out of the way of later rotations
+	this->setAsideLogs(generation);
+
+	// Versions handed out before the restart may not have survived it - everyone syncs from scratch
+	changes.clear();
+	log_start_version = version + 1;
+
+	// New changes go in a fresh log, so nothing is appended after a torn record
+	b_journaling = journal.open(state_directory, generation);
+	return b_journaling;
+}
+
+void P2PFileCatalog::setAsideLogs(unsigned int first_generation)
+{
+	vector<unsigned int> log_generations;
+	P2PJournal::findLogs(state_directory, log_generations);
+	for (unsigned int i = 0; i < log_generations.size(); i++)
+	{
+		if (log_generations[i] < first_generation)
+		{
+			continue;
+		}
+
+		string log_path = P2PJournal::getLogPath(state_directory, log_generations[i]);
+		cout << "Setting aside " << log_path << ", which no longer follows the snapshot." << endl;
+		rename(log_path.c_str(), (log_path + ".damaged").c_str());
+	}
+}
+
+bool P2PFileCatalog::loadSnapshot(const string & path, unsigned int & generation)
+{
+	// No snapshot yet is fine - there's just nothing to load
+	unsigned int first_file_id = max_file_id;
+	size_t length = 0;
+	const char * data = P2PJournal::mapFile(path, length);
+	if (data == NULL)
+	{
+		return true;
+	}
+
+	// Check the whole thing against the checksum at the end before trusting any of it
+	bool b_valid = false;
+	if (length >= 4)
+	{
+		RecordReader trailer = P2PJournal::makeReader(data + length - 4, 4);
+		b_valid = (P2PChecksum::compute(P2PChecksum::CRC32C, data, length - 4) == P2PJournal::readNumber(trailer));
+	}
+
+	RecordReader reader = P2PJournal::makeReader(data, b_valid ? length - 4 : 0);
+	if (b_valid && P2PJournal::readNumber(reader) == SNAPSHOT_MAGIC)
+	{
+		generation = P2PJournal::readNumber(reader);
+		unsigned int snapshot_version = P2PJournal::readNumber(reader);
+		max_file_id = P2PJournal::readNumber(reader);
+		unsigned int num_files = P2PJournal::readNumber(reader);
+
+		vector<unsigned int> & restored_files = files_by_socket[(int) RESTORED_SOCKET];
+		restored_files.reserve(num_files);
+
+		// Files are in ID order, so each goes on the end - read straight into place rather than through addFile.
+		// Only the files themselves, so getFile works right away - the lookups by ID and content come after.
+		for (unsigned int i = 0; i < num_files && reader.b_valid; i++)
+		{
+			unsigned int file_id = P2PJournal::readNumber(reader);
+			FileItem * file_item = &files.emplace_hint(files.end(), piecewise_construct, forward_as_tuple(file_id), forward_as_tuple())->second;
+			file_item->file_id = file_id;
+			file_item->size = P2PJournal::readNumber(reader);
+			file_item->name = P2PJournal::readString(reader);
+			file_item->hash = P2PJournal::readString(reader);
+			file_item->piece_hashes = P2PJournal::readString(reader);
+			file_item->chunk_size = 0;
+			file_item->completed = true;
+
+			unsigned int num_aliases = P2PJournal::readNumber(reader);
+			for (unsigned int j = 0; j < num_aliases && reader.b_valid; j++)
+			{
+				file_item->aliases.push_back(P2PJournal::readString(reader));
+			}
+
+			// Peers are held for whoever shared the file until they come back
+			unsigned int num_addresses = P2PJournal::readNumber(reader);
+			for (unsigned int j = 0; j < num_addresses && reader.b_valid; j++)
+			{
+				FileAddress file_address;
+				file_address.socket_id = RESTORED_SOCKET;
+				file_address.public_address = P2PJournal::readString(reader);
+				file_address.public_port = P2PJournal::readNumber(reader);
+				file_address.remote_path = P2PJournal::readString(reader);
+				file_item->addresses.push_back(file_address);
+			}
+			restored_files.push_back(file_id);
+		}
+
+		version = snapshot_version;
+		b_lookups_built = files.empty();
+		b_valid = reader.b_valid;
+	}
+	else
+	{
+		b_valid = false;
+	}
+
+	P2PJournal::unmapFile(data, length);
+
+	// Don't keep half a snapshot
+	if (!b_valid)
+	{
+		files.clear();
+		files_by_id.clear();
+		files_by_content.clear();
+		files_by_socket.clear();
+		max_file_id = first_file_id;
+		version = 0;
+	}
+
+	return b_valid;
+}
+
+unsigned long long P2PFileCatalog::replayLog(const string & path)
+{
+	size_t length = 0;
+	const char * data = P2PJournal::mapFile(path, length);
+
+	// A record cut short by a crash ends the log - nothing after it was ever acknowledged
+	RecordReader log = P2PJournal::makeReader(data, length);
+	RecordReader record;
+	while (P2PJournal::nextRecord(log, record))
+	{
+		this->applyRecord(record);
+	}
+
+	P2PJournal::unmapFile(data, length);
+	return log.position;
+}
+
+void P2PFileCatalog::applyRecord(RecordReader & record)
+{
+	unsigned int type = P2PJournal::readNumber(record);
+	unsigned int file_id = P2PJournal::readNumber(record);
+	FileItem * file_item = getFile(file_id);
+
+	if (type == RECORD_ADD_FILE && file_item == NULL)
+	{
+		FileItem shared_file;
+		shared_file.size = P2PJournal::readNumber(record);
+		shared_file.name = P2PJournal::readString(record);
+		shared_file.hash = P2PJournal::readString(record);
+		shared_file.piece_hashes = P2PJournal::readString(record);
+
+		if (record.b_valid)
+		{
+			this->insertFile(file_id, shared_file, P2PCommon::getContentKey(shared_file));
+			max_file_id = max(max_file_id, file_id);
+		}
+	}
+	else if (type == RECORD_ADD_NAME && file_item != NULL)
+	{
+		string name = P2PJournal::readString(record);
+		if (record.b_valid)
+		{
+			this->addName(file_item, name);
+		}
+	}
+	else if (type == RECORD_ADD_ADDRESS && file_item != NULL)
+	{
+		FileAddress file_address;
+		file_address.socket_id = RESTORED_SOCKET;
+		file_address.public_address = P2PJournal::readString(record);
+		file_address.public_port = P2PJournal::readNumber(record);
+		file_address.remote_path = P2PJournal::readString(record);
+
+		if (record.b_valid)
+		{
+			this->addAddress(file_item, file_address);
+		}
+	}
+	else if (type == RECORD_REMOVE_ADDRESS && file_item != NULL)
+	{
+		string public_address = P2PJournal::readString(record);
+		unsigned int public_port = P2PJournal::readNumber(record);
+
+		vector<FileAddress>::iterator iter;
+		for (iter = file_item->addresses.begin(); iter != file_item->addresses.end(); )
+		{
+			if ((*iter).public_address == public_address && (*iter).public_port == public_port)
+				iter = file_item->addresses.erase(iter);
+			else
+				iter++;
+		}
+		markChanged(file_id);
+	}
+	else if (type == RECORD_REMOVE_FILE && file_item != NULL)
+	{
+		this->removeFile(file_item);
+	}
+}
+
+bool P2PFileCatalog::indexFiles(unsigned int limit)
+{
+	// Lookups first - changes wait on those - then search
+	if (!b_lookups_built)
+	{
+		this->buildLookups(limit);
+		return false;
+	}
+
+	// Restored files, a batch at a time after the last one indexed - names already there are skipped
+	map<unsigned int, FileItem>::iterator iter = files.upper_bound(search_cursor);
+	for (unsigned int i = 0; i < limit && iter != files.end(); i++, iter++)
+	{
+		search_index.addName(iter->first, iter->second.name);
+		for (unsigned int j = 0; j < iter->second.aliases.size(); j++)
+		{
+			search_index.addName(iter->first, iter->second.aliases[j]);
+		}
+
+		search_cursor = iter->first;
+	}
+
+	return (iter == files.end());
+}
+
+void P2PFileCatalog::buildLookups(unsigned int limit)
+{
+	if (lookup_cursor == 0)
+	{
+		files_by_id.reserve(files.size());
+		files_by_content.reserve(files.size());
+	}
+
+	map<unsigned int, FileItem>::iterator iter = files.upper_bound(lookup_cursor);
+	for (unsigned int i = 0; i < limit && iter != files.end(); i++, iter++)
+	{
+		files_by_id[iter->first] = &iter->second;
+		files_by_content[P2PCommon::getContentKey(iter->second)] = &iter->second;
+		lookup_cursor = iter->first;
+	}
+
+	b_lookups_built = (iter == files.end());
+}
+
+void P2PFileCatalog::finishLookups()
+{
+	// Changes need every file findable by content - finish the lot now rather than wait for the batches.
+	// Replay doesn't - it finds files by ID, which getFile does without the lookups, and insertFile keeps them up.
+	if (!b_lookups_built && !b_restoring)
+	{
+		this->buildLookups(files.size());
+	}
+}
+
+string P2PFileCatalog::encodeSnapshot(unsigned int & generation)
+{
+	// Nothing changes while the caller holds the lock, so the snapshot matches the end of the current log exactly
+	if (!b_journaling || !journal.rotate())
+	{
+		return "";
+	}
+
+	generation = journal.getGeneration();
+
+	string data;
+	data.reserve(files.size() * 128);
+	P2PJournal::putNumber(data, SNAPSHOT_MAGIC);
+	P2PJournal::putNumber(data, generation);
+	P2PJournal::putNumber(data, version);
+	P2PJournal::putNumber(data, max_file_id);
+	P2PJournal::putNumber(data, files.size());
+
+	map<unsigned int, FileItem>::iterator iter;
+	for (iter = files.begin(); iter != files.end(); iter++)
+	{
+		const FileItem & file_item = iter->second;
+		P2PJournal::putNumber(data, file_item.file_id);
+		P2PJournal::putNumber(data, file_item.size);
+		P2PJournal::putString(data, file_item.name);
+		P2PJournal::putString(data, file_item.hash);
+		P2PJournal::putString(data, file_item.piece_hashes);
+
+		P2PJournal::putNumber(data, file_item.aliases.size());
+		for (unsigned int i = 0; i < file_item.aliases.size(); i++)
+		{
+			P2PJournal::putString(data, file_item.aliases[i]);
+		}
+
+		P2PJournal::putNumber(data, file_item.addresses.size());
+		for (unsigned int i = 0; i < file_item.addresses.size(); i++)
+		{
+			P2PJournal::putString(data, file_item.addresses[i].public_address);
+			P2PJournal::putNumber(data, file_item.addresses[i].public_port);
+			P2PJournal::putString(data, file_item.addresses[i].remote_path);
+		}
+	}
+
+	P2PJournal::putNumber(data, P2PChecksum::compute(P2PChecksum::CRC32C, data.data(), data.length()));
+	return data;
+}
+
+bool P2PFileCatalog::saveSnapshot(const string & data, unsigned int generation)
+{
+	// Write it alongside, then swap it in - a crash part way leaves the old snapshot and its logs as they were
+	string snapshot_path = state_directory + "/" + SNAPSHOT_FILE;
+	string temporary_path = snapshot_path + ".tmp";
+	int descriptor = open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (descriptor < 0)
+	{
+		perror("Error: could not write the catalog snapshot");
+		return false;
+	}
+
+	size_t written = 0;
+	while (written < data.length())
+	{
+		ssize_t result = write(descriptor, data.data() + written, data.length() - written);
+		if (result < 0 && errno != EINTR)
+		{
+			break;
+		}
+		written += max((ssize_t) 0, result);
+	}
+
+	bool b_saved = (written == data.length() && fsync(descriptor) == 0);
+	close(descriptor);
+
+	if (!b_saved || rename(temporary_path.c_str(), snapshot_path.c_str()) != 0)
+	{
+		perror("Error: could not write the catalog snapshot");
+		unlink(temporary_path.c_str());
+		return false;
+	}
+
+	int directory_descriptor = open(state_directory.c_str(), O_RDONLY | O_DIRECTORY);
+	if (directory_descriptor >= 0)
+	{
+		fsync(directory_descriptor);
+		close(directory_descriptor);
+	}
+
+	// The logs it covers aren't needed any more
+	for (unsigned int old_generation = generation; old_generation > 0; old_generation--)
+	{
+		if (unlink(P2PJournal::getLogPath(state_directory, old_generation - 1).c_str()) != 0)
+		{
+			break;
+		}
+	}
+
+	return true;
+}
+
+unsigned long long P2PFileCatalog::getJournalSequence()
+{
+	return journal_sequence;
+}
+
+bool P2PFileCatalog::waitForJournal(unsigned long long sequence)
+{
+	return !b_journaling || journal.waitUntilDurable(sequence);
+}
+
+unsigned long long P2PFileCatalog::getJournalBytes()
+{
+	return b_journaling ? journal.getLogBytes() : 0;
+}
+
+void P2PFileCatalog::logRecord(const string & record)
+{
+	if (b_journaling && !b_restoring)
+	{
+		journal_sequence = journal.append(record);
+	}
+}
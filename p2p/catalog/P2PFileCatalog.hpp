@@ -0,0 +1,147 @@
+#ifndef P2PFILECATALOG_H
+#define P2PFILECATALOG_H
+
+using namespace std;
+
+typedef struct {
+	string name_prefix;
+	unsigned int min_size;
+	unsigned int max_size;
+} FileFilter;
+
+typedef struct {
+	unsigned int version;
+	unsigned int file_id;
+} CatalogChange;
+
+/**
+ * The server's record of shared files and the peers holding them.
+ * Files are identified by their content hash, so every peer with the same
+ * bytes joins one entry whatever they called it - other names are kept as
+ * aliases. Files shared without a hash fall back to their name and size.
+ * Files are found by ID or by content in constant time, and each socket
+ * knows the files it shares, so a peer leaving only touches its own.
+ * Listings are read a page at a time, picking up after the last file ID
+ * seen, so a page costs the same however big the catalog grows.
+ * Every name and alias goes into a search index as it arrives.
+ * Each change to a file - added, renamed, a peer joining or leaving it,
+ * removed - bumps the catalog's version and is logged, so a client that
+ * holds a copy only needs the files changed since its version. The log is
+ * bounded; a client further behind than it reaches starts over.
+ * Changes are also journaled to disk, and now and then the whole catalog
+ * is written out as a snapshot, so a restarted tracker loads the snapshot
+ * and replays the journal since. Peers restored that way have no socket
+ * yet - they're held under RESTORED_SOCKET until they share again, and
+ * getFile can hand them out meanwhile. A restore only loads the files
+ * themselves - the lookups by ID and content, then the search index, are
+ * built afterwards a batch at a time, and the first change finishes the
+ * lookups before it goes ahead.
+ * Callers hold the read lock while they use anything the catalog hands
+ * out, and the write lock to change it - readers never block each other.
+ */
+class P2PFileCatalog
+{
+	private:
+		// Owns the items, in ID order for listing
+		map<unsigned int, FileItem> files;
+
+		// Indexes into the items above
+		unordered_map<unsigned int, FileItem *> files_by_id;
+		unordered_map<string, FileItem *> files_by_content;
+		unordered_map<int, vector<unsigned int> > files_by_socket;
+		P2PSearchIndex search_index;
+
+		unsigned int max_file_id;
+		unsigned int last_file_id;
+		pthread_rwlock_t lock;
+
+		// The current version, the changes that led to it, and the oldest version they reach back to
+		unsigned int version;
+		deque<CatalogChange> changes;
+		unsigned int log_start_version;
+		void markChanged(unsigned int);
+
+		// Changes journaled to disk, and the sequence number of the last one
+		P2PJournal journal;
+		bool b_journaling;
+		bool b_restoring;
+		string state_directory;
+		unsigned long long journal_sequence;
+		void logRecord(const string &);
+
+		// Restoring from the snapshot and journal
+		bool loadSnapshot(const string &, unsigned int &);
+		unsigned long long replayLog(const string &);
+		void setAsideLogs(unsigned int);
+		void applyRecord(RecordReader &);
+
+		// After a restore, how far the lookups and search index have been built
+		bool b_lookups_built;
+		unsigned int lookup_cursor;
+		unsigned int search_cursor;
+		void buildLookups(unsigned int);
+		void finishLookups();
+
+		FileItem * insertFile(unsigned int, const FileItem &, const string &);
+		void addName(FileItem *, const string &);
+
+		static bool isEarlierChange(const CatalogChange &, const CatalogChange &);
+		static bool ranksBefore(const pair<FileItem *, unsigned int> &, const pair<FileItem *, unsigned int> &);
+		void removeFile(FileItem *);
+
+	public:
+		P2PFileCatalog();
+		~P2PFileCatalog();
+
+		void setFileIdRange(unsigned int, unsigned int);
+
+		void lockForReading();
+		void lockForWriting();
+		void unlock();
+
+		FileItem * addFile(const FileItem &);
+		bool addAddress(FileItem *, const FileAddress &);
+		void removeSocket(int);
+
+		FileItem * getFile(unsigned int);
+		const map<unsigned int, FileItem> & getFiles();
+		vector<FileItem *> listFiles(unsigned int, unsigned int, const FileFilter &, unsigned int &);
+		vector<FileItem *> searchFiles(const string &, unsigned int);
+		unsigned int getVersion();
+		bool getChangedFiles(unsigned int, vector<unsigned int> &);
+		vector<int> getSockets();
+		unsigned int countFiles();
+
+		// Persistence - callers hold the write lock to index, and the read lock to encode a snapshot
+		bool restore(const string &, unsigned long long &);
+		bool indexFiles(unsigned int);
+		string encodeSnapshot(unsigned int &);
+		bool saveSnapshot(const string &, unsigned int);
+		unsigned long long getJournalSequence();
+		bool waitForJournal(unsigned long long);
+		unsigned long long getJournalBytes();
+
+		static bool matchesFilter(const FileItem &, const FileFilter &);
+
+		// Files looked at for one page, at most - a filter few files match can't hold the lock for long
+		static const unsigned int MAX_LIST_SCAN = 10000;
+
+		// Changes kept in the log
+		static const unsigned int MAX_LOGGED_CHANGES = 100000;
+
+		// Where restored peers are kept until they come back
+		static const int RESTORED_SOCKET = -1;
+
+		// Journal records
+		static const unsigned int RECORD_ADD_FILE = 1;
+		static const unsigned int RECORD_ADD_NAME = 2;
+		static const unsigned int RECORD_ADD_ADDRESS = 3;
+		static const unsigned int RECORD_REMOVE_ADDRESS = 4;
+		static const unsigned int RECORD_REMOVE_FILE = 5;
+
+		// The snapshot, in the state folder, and the number it starts with
+		static const string SNAPSHOT_FILE;
+		static const unsigned int SNAPSHOT_MAGIC = 0x31435032;
+};
+
+#endif
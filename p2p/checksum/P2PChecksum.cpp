@@ -0,0 +1,228 @@
+/**
+ * Peer-to-peer checksum class
+ */
+
+#include "P2PChecksum.hpp"
+
+pthread_once_t P2PChecksum::init_once = PTHREAD_ONCE_INIT;
+uint32_t (*P2PChecksum::ones_complement_impl)(const char *, unsigned int) = NULL;
+uint32_t (*P2PChecksum::crc32c_impl)(const char *, unsigned int) = NULL;
+uint32_t P2PChecksum::crc32c_table[256];
+
+uint32_t P2PChecksum::compute(unsigned char algorithm, const char * data, unsigned int size)
+{
+	pthread_once(&init_once, &P2PChecksum::initialize);
+
+	if (algorithm == CRC32C)
+	{
+		return crc32c_impl(data, size);
+	}
+
+	return ones_complement_impl(data, size);
+}
+
+bool P2PChecksum::isKnownAlgorithm(unsigned char algorithm)
+{
+	return algorithm == ONES_COMPLEMENT || algorithm == CRC32C;
+}
+
+string P2PChecksum::describeImplementations()
+{
+	pthread_once(&init_once, &P2PChecksum::initialize);
+
+	string ones_complement = (ones_complement_impl == &P2PChecksum::onesComplementAvx2) ? "avx2"
+		: (ones_complement_impl == &P2PChecksum::onesComplementSse42) ? "sse4.2" : "scalar";
+	string crc32c = (crc32c_impl == &P2PChecksum::crc32cHardware) ? "sse4.2" : "software";
+
+	return "one's complement: " + ones_complement + ", crc32c: " + crc32c;
+}
+
+void P2PChecksum::initialize()
+{
+	// Build the table for the software CRC32C (reflected Castagnoli polynomial)
+	for (uint32_t i = 0; i < 256; i++)
+	{
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : (crc >> 1);
+		}
+
+		crc32c_table[i] = crc;
+	}
+
+	// Pick the fastest versions this CPU can run
+	ones_complement_impl = hasAvx2() ? &P2PChecksum::onesComplementAvx2
+		: hasSse42() ? &P2PChecksum::onesComplementSse42 : &P2PChecksum::onesComplementScalar;
+	crc32c_impl = hasSse42() ? &P2PChecksum::crc32cHardware : &P2PChecksum::crc32cSoftware;
+}
+
+bool P2PChecksum::hasSse42()
+{
+#ifdef P2P_HAVE_X86_SIMD
+	return __builtin_cpu_supports("sse4.2");
+#else
+	return false;
+#endif
+}
+
+bool P2PChecksum::hasAvx2()
+{
+#ifdef P2P_HAVE_X86_SIMD
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
+
+uint32_t P2PChecksum::finishOnesComplement(uint64_t sum, const char * data, unsigned int size)
+{
+	// Add the remaining whole words
+	unsigned int i = 0;
+	for (; i + 4 <= size; i += 4)
+	{
+		uint32_t word;
+		memcpy(&word, &data[i], 4);
+		sum += ntohl(word);
+	}
+
+	// Then whatever is left over, right-aligned
+	uint32_t value = 0;
+	for (; i < size; i++)
+	{
+		value = (value << 8) | (unsigned char) data[i];
+	}
+	sum += value;
+
+	// Fold the carries back in - the end-around carry of a one's complement sum
+	while (sum >> 32)
+	{
+		sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	}
+
+	return (uint32_t) sum;
+}
+
+uint32_t P2PChecksum::onesComplementScalar(const char * data, unsigned int size)
+{
+	return finishOnesComplement(0, data, size);
+}
+
+#ifdef P2P_HAVE_X86_SIMD
+
+__attribute__((target("sse4.2")))
+uint32_t P2PChecksum::onesComplementSse42(const char * data, unsigned int size)
+{
+	// Byte swap each 32-bit word to big-endian, then widen to 64 bits so the sums can't overflow
+	const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sum_a = zero, sum_b = zero, sum_c = zero, sum_d = zero;
+
+	unsigned int i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		__m128i words_a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) &data[i]), swap);
+		__m128i words_b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) &data[i + 16]), swap);
+		sum_a = _mm_add_epi64(sum_a, _mm_unpacklo_epi32(words_a, zero));
+		sum_b = _mm_add_epi64(sum_b, _mm_unpackhi_epi32(words_a, zero));
+		sum_c = _mm_add_epi64(sum_c, _mm_unpacklo_epi32(words_b, zero));
+		sum_d = _mm_add_epi64(sum_d, _mm_unpackhi_epi32(words_b, zero));
+	}
+
+	__m128i total = _mm_add_epi64(_mm_add_epi64(sum_a, sum_b), _mm_add_epi64(sum_c, sum_d));
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i *) lanes, total);
+
+	return finishOnesComplement(lanes[0] + lanes[1], &data[i], size - i);
+}
+
+__attribute__((target("avx2")))
+uint32_t P2PChecksum::onesComplementAvx2(const char * data, unsigned int size)
+{
+	// Same as the SSE4.2 version, 64 bytes at a time
+	const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i sum_a = zero, sum_b = zero, sum_c = zero, sum_d = zero;
+
+	unsigned int i = 0;
+	for (; i + 64 <= size; i += 64)
+	{
+		__m256i words_a = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) &data[i]), swap);
+		__m256i words_b = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) &data[i + 32]), swap);
+		sum_a = _mm256_add_epi64(sum_a, _mm256_unpacklo_epi32(words_a, zero));
+		sum_b = _mm256_add_epi64(sum_b, _mm256_unpackhi_epi32(words_a, zero));
+		sum_c = _mm256_add_epi64(sum_c, _mm256_unpacklo_epi32(words_b, zero));
+		sum_d = _mm256_add_epi64(sum_d, _mm256_unpackhi_epi32(words_b, zero));
+	}
+
+	__m256i total = _mm256_add_epi64(_mm256_add_epi64(sum_a, sum_b), _mm256_add_epi64(sum_c, sum_d));
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i *) lanes, total);
+
+	return finishOnesComplement(lanes[0] + lanes[1] + lanes[2] + lanes[3], &data[i], size - i);
+}
+
+__attribute__((target("sse4.2")))
+uint32_t P2PChecksum::crc32cHardware(const char * data, unsigned int size)
+{
+	unsigned int i = 0;
+#ifdef __x86_64__
+	uint64_t crc64 = 0xFFFFFFFF;
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, &data[i], 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	uint32_t crc = (uint32_t) crc64;
+#else
+	uint32_t crc = 0xFFFFFFFF;
+#endif
+
+	for (; i + 4 <= size; i += 4)
+	{
+		uint32_t word;
+		memcpy(&word, &data[i], 4);
+		crc = _mm_crc32_u32(crc, word);
+	}
+
+	for (; i < size; i++)
+	{
+		crc = _mm_crc32_u8(crc, (unsigned char) data[i]);
+	}
+
+	return ~crc;
+}
+
+#else
+
+uint32_t P2PChecksum::onesComplementSse42(const char * data, unsigned int size)
+{
+	return onesComplementScalar(data, size);
+}
+
+uint32_t P2PChecksum::onesComplementAvx2(const char * data, unsigned int size)
+{
+	return onesComplementScalar(data, size);
+}
+
+uint32_t P2PChecksum::crc32cHardware(const char * data, unsigned int size)
+{
+	return crc32cSoftware(data, size);
+}
+
+#endif
+
+uint32_t P2PChecksum::crc32cSoftware(const char * data, unsigned int size)
+{
+	pthread_once(&init_once, &P2PChecksum::initialize);
+
+	uint32_t crc = 0xFFFFFFFF;
+	for (unsigned int i = 0; i < size; i++)
+	{
+		crc = crc32c_table[(crc ^ (unsigned char) data[i]) & 0xFF] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
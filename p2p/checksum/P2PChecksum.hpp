@@ -0,0 +1,47 @@
+#ifndef P2PCHECKSUM_H
+#define P2PCHECKSUM_H
+
+#include <stdint.h>
+
+using namespace std;
+
+/**
+ * Chunk checksums. The algorithm travels in the frame flags, so the
+ * receiver always checks with whatever the sender used.
+ *   - One's complement sum of big-endian 32-bit words, with the last
+ *     partial word right-aligned. Scalar, SSE4.2 and AVX2 versions.
+ *   - CRC32C, using the SSE4.2 crc32 instruction when the CPU has it.
+ * The fastest version the CPU supports is picked on first use.
+ */
+class P2PChecksum
+{
+	private:
+		static pthread_once_t init_once;
+		static uint32_t (*ones_complement_impl)(const char *, unsigned int);
+		static uint32_t (*crc32c_impl)(const char *, unsigned int);
+		static uint32_t crc32c_table[256];
+
+		static void initialize();
+		static uint32_t finishOnesComplement(uint64_t, const char *, unsigned int);
+
+	public:
+		static uint32_t compute(unsigned char, const char *, unsigned int);
+		static bool isKnownAlgorithm(unsigned char);
+		static string describeImplementations();
+
+		// Each version, for comparison by the benchmark
+		static uint32_t onesComplementScalar(const char *, unsigned int);
+		static uint32_t onesComplementSse42(const char *, unsigned int);
+		static uint32_t onesComplementAvx2(const char *, unsigned int);
+		static uint32_t crc32cSoftware(const char *, unsigned int);
+		static uint32_t crc32cHardware(const char *, unsigned int);
+		static bool hasSse42();
+		static bool hasAvx2();
+
+		// Algorithms, as carried in the frame flags
+		static const unsigned char ONES_COMPLEMENT = 0;
+		static const unsigned char CRC32C = 1;
+		static const unsigned char DEFAULT_ALGORITHM = CRC32C;
+};
+
+#endif
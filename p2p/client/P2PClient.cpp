@@ -12,10 +12,13 @@ using namespace std;
 
 P2PClient::P2PClient()
 {
-	b_awaiting_response = false;
+	num_awaited_responses = 0;
+	cache_cursor = 0;
+	num_files_shown = 0;
+	b_browsing_cache = false;
 }
 
-void P2PClient::start(string address, int port)
+void P2PClient::start(vector<string> trackers)
 {
 	// Clear the screen to boot
 	P2PCommon::clearScreen();
@@ -24,29 +27,37 @@ void P2PClient::start(string address, int port)
 	node = P2PPeerNode(27891, 512);
 	node.setBindMaxOffset(100);
 	node.start();
-	server_socket = node.makeConnection("central_server", address, port);
 
-	// Validate that we're connected to the server
-	if (server_socket < 0)
+	// Connect to every tracker - each one's place in the list is the shard it serves
+	if (trackers.size() > P2PShardRing::MAX_SHARDS)
 	{
-		cout << "Fatal Error: can not connect to central server." << endl;
-		cout << "Please check your connectivity and the server's address." << endl;
+		cout << "Fatal Error: a tracker cluster can have at most " << P2PShardRing::MAX_SHARDS << " servers." << endl;
 		exit(1);
 	}
 
-	// Once we're connected, we'll want to bind the server listener
-	// Perform this as a separate thread
-	pthread_t node_thread;
-	if (pthread_create(&node_thread, NULL, &P2PClient::startActivityListenerThread, (void *)&node) != 0)
+	for (unsigned int shard = 0; shard < trackers.size(); shard++)
 	{
-		perror("Error: could not spawn peer listeners");
-		exit(1);
+		vector<string> address = P2PCommon::parseAddress(trackers[shard]);
+		int tracker_socket = (address.size() == 2) ? node.connectToTracker(shard, address[0], atoi(address[1].c_str())) : -1;
+
+		// Validate that we're connected to the server
+		if (tracker_socket < 0)
+		{
+			cout << "Fatal Error: can not connect to central server " << trackers[shard] << "." << endl;
+			cout << "Please check your connectivity and the server's address." << endl;
+			exit(1);
+		}
+
+		tracker_sockets.push_back(tracker_socket);
+		list_cursors.push_back(0);
+		catalog_versions.push_back(0);
+		pending_changes.push_back(vector<string>());
 	}
 
-	// Keep track of downloads, see if anything is halted
+	// Once we're connected, we'll want to bind the server listener
 	// Perform this as a separate thread
-	pthread_t transfer_thread;
-	if (pthread_create(&transfer_thread, NULL, &P2PClient::startTransferThread, (void *)&node) != 0)
+	pthread_t node_thread;
+	if (pthread_create(&node_thread, NULL, &P2PClient::startActivityListenerThread, (void *)&node) != 0)
 	{
 		perror("Error: could not spawn peer listeners");
 		exit(1);
@@ -64,39 +75,27 @@ void * P2PClient::startActivityListenerThread(void * arg)
 	pthread_exit(NULL);
 }
 
-void * P2PClient::startTransferThread(void * arg)
-{
-	P2PPeerNode * node;
-	node = (P2PPeerNode *) arg;
-	node->monitorTransfers();
-	pthread_exit(NULL);
-}
-
 void P2PClient::runProgram()
 {
 	bool b_program_active = true;
 	while (b_program_active)
 	{
-		if (node.countQueueMessages() > 0)
-		{
-			// Get the oldest message
-			P2PMessage message = node.popQueueMessage();
-
-			// Show response
-			cout << message.message << endl;
+		// While responses are due, sleep until they arrive. Otherwise just show whatever arrived unprompted.
+		int timeout_ms = (num_awaited_responses > 0) ? RESPONSE_TIMEOUT_MS : 0;
 
-			// If we think we've got everything, wait to be certain
-			if (node.countQueueMessages() == 0 && b_awaiting_response)
+		P2PMessage message;
+		if (node.waitForQueueMessage(message, timeout_ms))
+		{
+			// Listings say when they're done - anything else is the whole response
+			if (showResponse(message.message, message.socket_id) && num_awaited_responses > 0)
 			{
-				usleep(50000);
+				num_awaited_responses--;
 			}
-
-			// Determine if we've gotten the full response
-			b_awaiting_response = (node.countQueueMessages() > 0);
 		}
-		else if (b_awaiting_response)
+		else if (num_awaited_responses > 0)
 		{
-			usleep(5000);
+			cout << "The server didn't respond, please try again." << endl;
+			num_awaited_responses = 0;
 		}
 		else
 		{
@@ -115,6 +114,18 @@ bool P2PClient::runUI()
 			P2PCommon::clearScreen();
 			viewFiles();
 			break;
+		case 'f':
+			findFiles();
+			P2PCommon::clearScreen();
+			break;
+		case 'n':
+			P2PCommon::clearScreen();
+			viewMoreFiles();
+			break;
+		case 's':
+			searchFiles();
+			P2PCommon::clearScreen();
+			break;
 		case 'a':
 			selectFiles();
 			break;
@@ -142,6 +153,9 @@ char P2PClient::showMenu()
 	cout << "Welcome to the P2P Network. What would you like to do?" << endl;
 	cout << "Please select an item below by entering the corresponding character." << endl << endl;
 	cout << "\t (v) View Files on the Server" << endl;
+	cout << "\t (f) Find Files on the Server" << endl;
+	cout << "\t (n) Next Page of Files" << endl;
+	cout << "\t (s) Search Files by Name" << endl;
 	cout << "\t (a) Add Files to the Server" << endl;
 	cout << "\t (d) Download a File" << endl;
 	cout << "\t (p) View Download Progress" << endl;
@@ -157,8 +171,277 @@ char P2PClient::showMenu()
 
 void P2PClient::viewFiles()
 {
-	b_awaiting_response = true;
-	node.sendMessageToSocket("list", server_socket);
+	// Catch the cached catalog up with each tracker - only what changed since the last look comes back
+	for (unsigned int shard = 0; shard < tracker_sockets.size(); shard++)
+	{
+		node.sendMessageToSocket("changes\r\n" + to_string(catalog_versions[shard]), tracker_sockets[shard]);
+		num_awaited_responses++;
+	}
+}
+
+void P2PClient::applyChanges(unsigned int shard, bool b_full_sync)
+{
+	// A full sync replaces everything the shard sent before - its files are the ones with its IDs
+	if (b_full_sync)
+	{
+		map<unsigned int, string>::iterator first = cached_files.lower_bound(P2PShardRing::getFirstFileId(shard));
+		map<unsigned int, string>::iterator last = cached_files.lower_bound(P2PShardRing::getFirstFileId(shard + 1));
+		cached_files.erase(first, last);
+	}
+
+	vector<string>::iterator iter;
+	for (iter = pending_changes[shard].begin(); iter != pending_changes[shard].end(); iter++)
+	{
+		string change = P2PCommon::trimWhitespace(*iter);
+		if (change.length() < 2)
+		{
+			continue;
+		}
+
+		unsigned int file_id = strtoul(change.c_str() + 1, NULL, 10);
+		if (change[0] == '+')
+		{
+			cached_files[file_id] = change.substr(1);
+		}
+		else if (change[0] == '-')
+		{
+			cached_files.erase(file_id);
+		}
+	}
+
+	pending_changes[shard].clear();
+}
+
+void P2PClient::showCachedFiles(unsigned int after_id)
+{
+	b_browsing_cache = true;
+	list_filter = "";
+
+	if (cached_files.empty())
+	{
+		cout << endl << "There are currently no files stored on the server." << endl;
+		cache_cursor = 0;
+		return;
+	}
+
+	// A page of the cached catalog, picking up after the last file shown
+	cout << endl << "File Listing:" << endl;
+	map<unsigned int, string>::iterator iter = cached_files.upper_bound(after_id);
+	for (unsigned int i = 0; i < LIST_PAGE_SIZE && iter != cached_files.end(); i++, iter++)
+	{
+		showFile(iter->second);
+		cache_cursor = iter->first;
+	}
+
+	if (iter == cached_files.end())
+	{
+		cache_cursor = 0;
+	}
+	else
+	{
+		cout << endl << "There are more files - choose (n) to see the next page." << endl;
+	}
+}
+
+void P2PClient::showFile(string description)
+{
+	// ID, name, size, peers sharing it, then any other names it's shared under
+	vector<string> fields = P2PCommon::splitString(P2PCommon::trimWhitespace(description), '\t');
+	if (fields.size() < 4)
+	{
+		return;
+	}
+
+	cout << "\t" << fields[0] << ") " << fields[1] << " - (" << fields[2] << " B, " << fields[3] << " peers)";
+	for (unsigned int i = 4; i < fields.size(); i++)
+	{
+		cout << ((i == 4) ? " - also shared as " : ", ") << fields[i];
+	}
+	cout << endl;
+}
+
+void P2PClient::findFiles()
+{
+	cout << endl << "Enter the start of the file name, or leave it blank for any name: ";
+	string name_prefix;
+	getline(cin, name_prefix, '\n');
+
+	cout << "Enter the smallest size in bytes, or leave it blank: ";
+	string min_size;
+	getline(cin, min_size, '\n');
+
+	cout << "Enter the largest size in bytes, or leave it blank: ";
+	string max_size;
+	getline(cin, max_size, '\n');
+
+	// Kept for the pages that follow
+	list_filter = P2PCommon::trimWhitespace(name_prefix) + "\r\n" + P2PCommon::trimWhitespace(min_size)
+		+ "\r\n" + P2PCommon::trimWhitespace(max_size);
+	requestFileList(false);
+}
+
+void P2PClient::searchFiles()
+{
+	cout << endl << "Enter the words to search for: ";
+	string query;
+	getline(cin, query, '\n');
+
+	query = P2PCommon::trimWhitespace(query);
+	if (query.length() == 0)
+	{
+		return;
+	}
+
+	// Results come back as a single page from each tracker - the query stands in as the filter,
+	// so an empty one says nothing matched
+	list_filter = query;
+	b_browsing_cache = false;
+	num_files_shown = 0;
+	for (unsigned int shard = 0; shard < tracker_sockets.size(); shard++)
+	{
+		node.sendMessageToSocket("search\r\n" + query, tracker_sockets[shard]);
+		num_awaited_responses++;
+	}
+}
+
+void P2PClient::viewMoreFiles()
+{
+	if (!hasMoreFiles())
+	{
+		cout << "There are no more files to show." << endl;
+		return;
+	}
+
+	// Pages of the cached catalog are already here
+	if (b_browsing_cache)
+	{
+		showCachedFiles(cache_cursor);
+		return;
+	}
+
+	requestFileList(true);
+}
+
+void P2PClient::requestFileList(bool b_next_page)
+{
+	b_browsing_cache = false;
+	num_files_shown = 0;
+
+	// Each tracker pages through its own files - a next page only asks the ones with more to give
+	for (unsigned int shard = 0; shard < tracker_sockets.size(); shard++)
+	{
+		if (b_next_page && list_cursors[shard] == 0)
+		{
+			continue;
+		}
+
+		unsigned int cursor = b_next_page ? list_cursors[shard] : 0;
+		node.sendMessageToSocket("list\r\n" + to_string(cursor) + "\r\n" + to_string(LIST_PAGE_SIZE) + "\r\n" + list_filter, tracker_sockets[shard]);
+		num_awaited_responses++;
+	}
+}
+
+bool P2PClient::hasMoreFiles()
+{
+	if (b_browsing_cache)
+	{
+		return (cache_cursor != 0);
+	}
+
+	for (unsigned int shard = 0; shard < list_cursors.size(); shard++)
+	{
+		if (list_cursors[shard] != 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int P2PClient::getShardOfSocket(int socket)
+{
+	for (unsigned int shard = 0; shard < tracker_sockets.size(); shard++)
+	{
+		if (tracker_sockets[shard] == socket)
+		{
+			return shard;
+		}
+	}
+
+	return -1;
+}
+
+bool P2PClient::showResponse(string response, int socket)
+{
+	// Replies to several trackers at once are put together once the last one is in
+	int shard = getShardOfSocket(socket);
+	bool b_last_response = (num_awaited_responses <= 1);
+
+	vector<string> response_parsed = P2PCommon::parseRequest(response);
+	string command = (response_parsed.size() > 0) ? P2PCommon::trimWhitespace(response_parsed[0]) : "";
+
+	if (command == "fileList")
+	{
+		if (num_files_shown == 0)
+		{
+			cout << endl << "File Listing:" << endl;
+		}
+
+		// One file per line
+		vector<string>::iterator iter;
+		for (iter = response_parsed.begin() + 1; iter < response_parsed.end(); iter++)
+		{
+			showFile(*iter);
+			num_files_shown++;
+		}
+
+		// More of the page is on its way
+		return false;
+	}
+	else if (command == "catalogChanges" && shard >= 0)
+	{
+		// Held until the sync is complete - a full one replaces the shard's part of the cache
+		pending_changes[shard].insert(pending_changes[shard].end(), response_parsed.begin() + 1, response_parsed.end());
+		return false;
+	}
+	else if (command == "catalogVersion" && shard >= 0)
+	{
+		bool b_full_sync = (response_parsed.size() > 2 && P2PCommon::trimWhitespace(response_parsed[2]) == "1");
+		applyChanges(shard, b_full_sync);
+		catalog_versions[shard] = (response_parsed.size() > 1) ? strtoul(P2PCommon::trimWhitespace(response_parsed[1]).c_str(), NULL, 10) : 0;
+
+		if (b_last_response)
+		{
+			showCachedFiles(0);
+		}
+		return true;
+	}
+	else if (command == "fileListEnd" && shard >= 0)
+	{
+		// Remember where to pick up for the next page
+		list_cursors[shard] = (response_parsed.size() > 1) ? strtoul(P2PCommon::trimWhitespace(response_parsed[1]).c_str(), NULL, 10) : 0;
+
+		if (!b_last_response)
+		{
+			return true;
+		}
+
+		if (num_files_shown == 0 && !hasMoreFiles())
+		{
+			cout << endl << (list_filter.length() > 0 ? "No files on the server match." : "There are currently no files stored on the server.") << endl;
+		}
+		else if (hasMoreFiles())
+		{
+			cout << endl << "There are more files - choose (n) to see the next page." << endl;
+		}
+
+		return true;
+	}
+
+	// Show response
+	cout << response << endl;
+	return true;
 }
 
 bool isLineBreak(char c) { return isspace(c) && !isblank(c); }
@@ -195,6 +478,10 @@ void P2PClient::selectFiles()
 		return;
 	}
 
+	// Hash the files, so downloaders can check every piece they get
+	cout << "Hashing " << file_list.size() << " files..." << endl;
+	node.hashFileItems(file_list);
+
 	// Save the files locally
 	saveFileList(file_list);
 
@@ -290,18 +577,29 @@ void P2PClient::sendFiles(vector<FileItem> files)
 	primary_address = node.getPrimaryAddress();
 	string address = inet_ntoa(primary_address.sin_addr);
 
-	// Prepare the request
-	b_awaiting_response = true;
-	string add_files_message = "addFiles\r\n" + address + ":" + to_string(node.getPublicPort()) + "\r\n";
+	// Prepare a request for each tracker, holding the files whose keys it owns
+	map<unsigned int, string> add_files_messages;
 
 	// Separate each file with newlines
 	vector<FileItem>::iterator iter;
 	for (iter = files.begin(); iter < files.end(); iter++)
 	{
-		add_files_message += (*iter).name + '\t' + to_string((*iter).size) + '\t' + (*iter).path + "\r\n";
+		string & add_files_message = add_files_messages[node.getTrackerForFile(*iter)];
+		if (add_files_message.length() == 0)
+		{
+			add_files_message = "addFiles\r\n" + address + ":" + to_string(node.getPublicPort()) + "\r\n";
+		}
+
+		add_files_message += (*iter).name + '\t' + to_string((*iter).size) + '\t' + (*iter).path
+			+ '\t' + (*iter).hash + '\t' + P2PCommon::toHex((*iter).piece_hashes) + "\r\n";
 	}
 
-	node.sendMessageToSocket(add_files_message, server_socket);
+	map<unsigned int, string>::iterator message_iter;
+	for (message_iter = add_files_messages.begin(); message_iter != add_files_messages.end(); message_iter++)
+	{
+		node.sendMessageToSocket(message_iter->second, tracker_sockets[message_iter->first]);
+		num_awaited_responses++;
+	}
 }
 
 void P2PClient::getFile()
@@ -321,8 +619,16 @@ void P2PClient::getFile()
 	// Cleanse the input
 	int i_option = stoi(option);
 
+	// The ID says which tracker has the file
+	unsigned int shard = P2PShardRing::getShardOfFileId(i_option);
+	if (i_option <= 0 || shard >= tracker_sockets.size())
+	{
+		cout << "That file isn't on the server." << endl;
+		return;
+	}
+
 	// Submit the request
-	node.sendMessageToSocket("getFile\r\n" + to_string(i_option), server_socket);
+	node.sendMessageToSocket("getFile\r\n" + to_string(i_option), tracker_sockets[shard]);
 }
 
 void P2PClient::showProgress()
@@ -15,26 +15,50 @@ class P2PClient
 		bool runUI();
 		char showMenu();
 		void viewFiles();
+		void findFiles();
+		void viewMoreFiles();
+		void searchFiles();
+		void requestFileList(bool);
+		bool hasMoreFiles();
+		bool showResponse(string, int);
+		void showFile(string);
+		void applyChanges(unsigned int, bool);
+		void showCachedFiles(unsigned int);
 		void selectFiles();
 		vector<FileItem> collectFiles(vector<string>);
 		void sendFiles(vector<FileItem>);
 		void getFile();
 		void showProgress();
 
-		// UI Management
-		bool b_awaiting_response;
+		// UI Management - responses still due from the trackers
+		unsigned int num_awaited_responses;
+
+		// How long to wait for a response
+		static const int RESPONSE_TIMEOUT_MS = 5000;
+
+		// File listings - where each tracker's next page starts, the filter they use, and what's shown of this page
+		vector<unsigned int> list_cursors;
+		string list_filter;
+		unsigned int num_files_shown;
+		static const unsigned int LIST_PAGE_SIZE = 100;
+
+		// The trackers' catalogs as of the version last synced from each, by file ID, and changes still arriving.
+		// Pages of it are shown from here, picking up after the cursor.
+		map<unsigned int, string> cached_files;
+		vector<unsigned int> catalog_versions;
+		vector<vector<string> > pending_changes;
+		unsigned int cache_cursor;
+		bool b_browsing_cache;
 
 		// Thread worker functions
 		static void * startActivityListenerThread(void *);
-		static void * startTransferThread(void *);
 
 		// Keep track of the peer node
 		P2PPeerNode node;
-		int server_socket;
 
-		// File transfer
-		static const unsigned int FILE_CHUNK_SIZE = 224;
-		static const unsigned int HEADER_SIZE = 63;
+		// One tracker per shard of the catalog, in shard order
+		vector<int> tracker_sockets;
+		int getShardOfSocket(int);
 
 		// File List
 		vector<FileItem> local_file_list;
@@ -44,7 +68,7 @@ class P2PClient
 
 	public:
 		P2PClient();
-		void start(string, int);
+		void start(vector<string>);
 };
 
 #endif
\ No newline at end of file
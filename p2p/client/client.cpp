@@ -7,23 +7,29 @@ int main(int argc, const char* argv[])
 	// Program welcome message
 	cout << "P2P Client - startup requested" << endl;
 
-	// Get any custom arguments
-	string address;
-	int port;
-	if (argc == 3)
+	// Get any custom arguments - an address and port, or the host:port of each tracker in a cluster.
+	// A cluster's trackers are listed in shard order, and new ones are added at the end.
+	vector<string> trackers;
+	if (argc == 3 && string(argv[1]).find(':') == string::npos)
 	{
-		address = argv[1];
-		port = atoi(argv[2]);
+		trackers.push_back(string(argv[1]) + ":" + argv[2]);
 	}
 	else
 	{
-		address = "localhost";
-		port = 27890;
+		for (int i = 1; i < argc; i++)
+		{
+			trackers.push_back(argv[i]);
+		}
+	}
+
+	if (trackers.empty())
+	{
+		trackers.push_back("localhost:27890");
 	}
 
 	// Start up the client server
 	P2PClient client;
-	client.start(address, port);
+	client.start(trackers);
 
 	return 0;
 }
@@ -0,0 +1,119 @@
+/**
+ * Peer-to-peer tracker shard ring class
+ */
+
+#include "P2PShardRing.hpp"
+
+P2PShardRing::P2PShardRing()
+{
+	pthread_mutex_init(&mutex, NULL);
+}
+
+P2PShardRing::~P2PShardRing()
+{
+	pthread_mutex_destroy(&mutex);
+}
+
+bool P2PShardRing::addShard(unsigned int shard)
+{
+	if (shard >= MAX_SHARDS)
+	{
+		return false;
+	}
+
+	pthread_mutex_lock(&mutex);
+
+	// Already on the ring
+	vector<pair<unsigned int, unsigned int> >::iterator iter;
+	for (iter = points.begin(); iter != points.end(); ++iter)
+	{
+		if (iter->second == shard)
+		{
+			pthread_mutex_unlock(&mutex);
+			return false;
+		}
+	}
+
+	// The points only depend on the shard's number, so every client builds the same ring
+	for (unsigned int i = 0; i < POINTS_PER_SHARD; i++)
+	{
+		points.push_back(make_pair(hashKey("shard-" + to_string(shard) + "-" + to_string(i)), shard));
+	}
+	sort(points.begin(), points.end());
+
+	pthread_mutex_unlock(&mutex);
+	return true;
+}
+
+unsigned int P2PShardRing::countShards()
+{
+	pthread_mutex_lock(&mutex);
+	unsigned int num_shards = points.size() / POINTS_PER_SHARD;
+	pthread_mutex_unlock(&mutex);
+
+	return num_shards;
+}
+
+unsigned int P2PShardRing::getShardForKey(const string & key)
+{
+	pthread_mutex_lock(&mutex);
+
+	// With nothing on the ring, everything goes to the first shard
+	if (points.empty())
+	{
+		pthread_mutex_unlock(&mutex);
+		return 0;
+	}
+
+	// The first point at or after the key's, wrapping around past the last
+	vector<pair<unsigned int, unsigned int> >::iterator iter = lower_bound(points.begin(), points.end(), make_pair(hashKey(key), 0U));
+	if (iter == points.end())
+	{
+		iter = points.begin();
+	}
+
+	unsigned int shard = iter->second;
+	pthread_mutex_unlock(&mutex);
+
+	return shard;
+}
+
+unsigned int P2PShardRing::getShardForFile(const FileItem & file_item)
+{
+	return getShardForKey(P2PCommon::getContentKey(file_item));
+}
+
+unsigned int P2PShardRing::getShardOfFileId(unsigned int file_id)
+{
+	return file_id >> SHARD_ID_BITS;
+}
+
+unsigned int P2PShardRing::getFirstFileId(unsigned int shard)
+{
+	return shard << SHARD_ID_BITS;
+}
+
+unsigned int P2PShardRing::getLastFileId(unsigned int shard)
+{
+	// One short of where the next shard's IDs start
+	return ((shard + 1) << SHARD_ID_BITS) - 1;
+}
+
+unsigned int P2PShardRing::hashKey(const string & key)
+{
+	// FNV-1a, then mixed so that keys differing in one character land far apart
+	unsigned long long hash = 14695981039346656037ULL;
+	for (unsigned int i = 0; i < key.length(); i++)
+	{
+		hash ^= (unsigned char) key[i];
+		hash *= 1099511628211ULL;
+	}
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb93fe53a87c3ULL;
+	hash ^= hash >> 33;
+
+	return (unsigned int) hash;
+}
@@ -0,0 +1,46 @@
+#ifndef P2PSHARDRING_H
+#define P2PSHARDRING_H
+
+using namespace std;
+
+/**
+ * Splits the tracker's catalog between several servers. Each shard is
+ * hashed to a number of points around a ring, and a file belongs to the
+ * first point after its content key's hash - so adding a shard only takes
+ * over the keys just before its own points, and every other file stays
+ * where it was.
+ * Shards are numbered from 0, and a shard hands out file IDs with its
+ * number in the top bits, so a file ID alone says which server to ask.
+ * Guarded by its own mutex.
+ */
+class P2PShardRing
+{
+	private:
+		// Points around the ring, in order, and the shard each belongs to
+		vector<pair<unsigned int, unsigned int> > points;
+		pthread_mutex_t mutex;
+
+		static unsigned int hashKey(const string &);
+
+	public:
+		P2PShardRing();
+		~P2PShardRing();
+
+		bool addShard(unsigned int);
+		unsigned int countShards();
+		unsigned int getShardForKey(const string &);
+		unsigned int getShardForFile(const FileItem &);
+
+		static unsigned int getShardOfFileId(unsigned int);
+		static unsigned int getFirstFileId(unsigned int);
+		static unsigned int getLastFileId(unsigned int);
+
+		// Points each shard gets - more even out the share each one owns
+		static const unsigned int POINTS_PER_SHARD = 128;
+
+		// File IDs keep the low bits for the shard's own count, and stay clear of the sign bit
+		static const unsigned int SHARD_ID_BITS = 24;
+		static const unsigned int MAX_SHARDS = 128;
+};
+
+#endif
@@ -52,6 +52,25 @@ string P2PCommon::trimWhitespace(string line)
 	return line;
 }
 
+bool P2PCommon::parseNumber(string field, unsigned int & number)
+{
+	// Only plain digits, and nothing too big to hold
+	field = P2PCommon::trimWhitespace(field);
+	if (field.length() == 0 || field.length() > 10 || field.find_first_not_of("0123456789") != string::npos)
+	{
+		return false;
+	}
+
+	unsigned long long value = strtoull(field.c_str(), NULL, 10);
+	if (value > 0xFFFFFFFFULL)
+	{
+		return false;
+	}
+
+	number = (unsigned int) value;
+	return true;
+}
+
 string P2PCommon::renameDuplicateFile(string filename, string directory)
 {
 	// Break the filename into pieces
@@ -104,3 +123,61 @@ void P2PCommon::clearScreen()
 {
 	cout << string(80, '\n');
 }
+
+string P2PCommon::toHex(const string & data)
+{
+	static const char digits[] = "0123456789abcdef";
+
+	string hex(data.length() * 2, '0');
+	for (unsigned int i = 0; i < data.length(); i++)
+	{
+		hex[i * 2] = digits[(unsigned char) data[i] >> 4];
+		hex[i * 2 + 1] = digits[(unsigned char) data[i] & 0x0F];
+	}
+
+	return hex;
+}
+
+string P2PCommon::fromHex(const string & hex)
+{
+	// Anything that isn't hex comes back empty
+	if (hex.length() % 2 != 0)
+	{
+		return "";
+	}
+
+	string data(hex.length() / 2, '\0');
+	for (unsigned int i = 0; i < data.length(); i++)
+	{
+		int value = 0;
+		for (int j = 0; j < 2; j++)
+		{
+			char c = hex[i * 2 + j];
+			int digit = (c >= '0' && c <= '9') ? c - '0'
+				: (c >= 'a' && c <= 'f') ? c - 'a' + 10
+				: (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+			if (digit < 0)
+			{
+				return "";
+			}
+
+			value = (value << 4) | digit;
+		}
+
+		data[i] = (char) value;
+	}
+
+	return data;
+}
+
+string P2PCommon::getContentKey(const FileItem & file_item)
+{
+	// The hash is hex, so it can't collide with a name key - names can't contain tabs,
+	// they separate the fields of addFiles
+	if (file_item.hash.length() > 0)
+	{
+		return file_item.hash;
+	}
+
+	return to_string(file_item.size) + '\t' + file_item.name;
+}
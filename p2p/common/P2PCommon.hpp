@@ -5,32 +5,57 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <unistd.h>
 #include <errno.h>
 #include <vector>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <deque>
 #include <algorithm>
 #include <fstream>
 #include <sstream>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 
 // Directory Management
 #include <dirent.h>
 
 // Network Includes
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
+// Event Notification
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
 // Multithreading
 #include <pthread.h>
 
+// SIMD intrinsics - the kernels that use them are compiled per function, and chosen at runtime
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define P2P_HAVE_X86_SIMD
+#endif
+
 using namespace std;
 
+class P2PDownloadTarget;
+class P2PFileTransfer;
+class P2PPeerNode;
+class P2PSendQueue;
+
 typedef struct {
 	unsigned int socket_id;
 	string type;
@@ -52,15 +77,21 @@ typedef struct {
 typedef struct {
 	unsigned int file_id;
 	unsigned int size;
+	unsigned int chunk_size;
 	vector<FileAddress> addresses;
 	string name;
 	string path;
 	string hash;
+	string piece_hashes;
+	vector<string> aliases;
 	bool completed;
 	vector<unsigned int> missing_pieces;
 } FileItem;
 
 typedef struct {
+	P2PPeerNode * node;
+	P2PSendQueue * queue;
+	P2PFileTransfer * transfer;
 	FileItem file_item;
 	int socket_id;
 	unsigned int start;
@@ -68,10 +99,36 @@ typedef struct {
 } FileDataRequest;
 
 typedef struct {
-	FileItem file_item;
-	char * packet;
+	unsigned short magic;
+	unsigned char type;
+	unsigned char flags;
+	unsigned int length;
+	unsigned int file_id;
+	unsigned int chunk;
+	unsigned int checksum;
+} P2PFrameHeader;
+
+typedef struct {
+	char * data;
+	unsigned int capacity;
+	int references;
+	pthread_mutex_t mutex;
+} ReceiveBlock;
+
+typedef struct {
+	P2PPeerNode * node;
+	int socket_id;
+	P2PDownloadTarget * target;
+	P2PFrameHeader header;
+	const char * payload;
+	ReceiveBlock * block;
 } FileDataPacket;
 
+typedef struct {
+	void (*function)(void *);
+	void * arg;
+} P2PTask;
+
 class P2PCommon
 {
 	public:
@@ -80,8 +137,12 @@ class P2PCommon
 		static vector<string> parseAddress(string);
 		static vector<string> splitString(string, char);
 		static string trimWhitespace(string);
+		static bool parseNumber(string, unsigned int &);
 		static string renameDuplicateFile(string, string);
 		static void clearScreen();
+		static string toHex(const string &);
+		static string fromHex(const string &);
+		static string getContentKey(const FileItem &);
 
 		// Some variables used throughout the program
 		static const unsigned int MAX_FILENAME_LENGTH = 255;
@@ -0,0 +1,146 @@
+/**
+ * Peer-to-peer chunk bitfield class
+ */
+
+#include "P2PBitfield.hpp"
+
+P2PBitfield::P2PBitfield()
+{
+	num_bits = 0;
+	num_set = 0;
+}
+
+P2PBitfield::P2PBitfield(unsigned int bits)
+{
+	num_bits = bits;
+	num_set = 0;
+	words.assign((bits + 63) / 64, 0);
+}
+
+bool P2PBitfield::set(unsigned int bit)
+{
+	// Report whether the bit is newly set, so callers can count bytes once
+	uint64_t mask = (uint64_t) 1 << (bit % 64);
+	if (bit >= num_bits || (words[bit / 64] & mask))
+	{
+		return false;
+	}
+
+	words[bit / 64] |= mask;
+	num_set++;
+	return true;
+}
+
+bool P2PBitfield::clear(unsigned int bit)
+{
+	// Report whether the bit was set
+	uint64_t mask = (uint64_t) 1 << (bit % 64);
+	if (bit >= num_bits || !(words[bit / 64] & mask))
+	{
+		return false;
+	}
+
+	words[bit / 64] &= ~mask;
+	num_set--;
+	return true;
+}
+
+bool P2PBitfield::test(unsigned int bit)
+{
+	return bit < num_bits && (words[bit / 64] & ((uint64_t) 1 << (bit % 64)));
+}
+
+void P2PBitfield::fill()
+{
+	words.assign(words.size(), ~(uint64_t) 0);
+	this->recount();
+}
+
+unsigned int P2PBitfield::count()
+{
+	return num_set;
+}
+
+unsigned int P2PBitfield::size()
+{
+	return num_bits;
+}
+
+bool P2PBitfield::isFull()
+{
+	return num_set == num_bits;
+}
+
+void P2PBitfield::getMissingRanges(vector<unsigned int> & missing_pieces)
+{
+	// Report each run of clear bits as a start, count pair of chunk numbers
+	unsigned int start = 0;
+	bool b_in_range = false;
+
+	unsigned int bit = 0;
+	while (bit < num_bits)
+	{
+		uint64_t word = words[bit / 64];
+
+		// Whole words that don't end or start a range can be skipped at once
+		if (bit % 64 == 0 && bit + 64 <= num_bits)
+		{
+			if ((word == ~(uint64_t) 0 && !b_in_range) || (word == 0 && b_in_range))
+			{
+				bit += 64;
+				continue;
+			}
+		}
+
+		bool b_set = (word >> (bit % 64)) & 1;
+		if (!b_set && !b_in_range)
+		{
+			start = bit;
+			b_in_range = true;
+		}
+		else if (b_set && b_in_range)
+		{
+			missing_pieces.push_back(start + 1);
+			missing_pieces.push_back(bit - start);
+			b_in_range = false;
+		}
+
+		bit++;
+	}
+
+	if (b_in_range)
+	{
+		missing_pieces.push_back(start + 1);
+		missing_pieces.push_back(num_bits - start);
+	}
+}
+
+unsigned int P2PBitfield::getNumWords()
+{
+	return words.size();
+}
+
+unsigned int P2PBitfield::getWordIndex(unsigned int bit)
+{
+	return bit / 64;
+}
+
+uint64_t * P2PBitfield::getWords()
+{
+	return words.empty() ? NULL : &words[0];
+}
+
+void P2PBitfield::recount()
+{
+	// Clear anything past the end, in case the words came from disk
+	if (num_bits % 64 != 0)
+	{
+		words.back() &= ((uint64_t) 1 << (num_bits % 64)) - 1;
+	}
+
+	num_set = 0;
+	for (unsigned int i = 0; i < words.size(); i++)
+	{
+		num_set += __builtin_popcountll(words[i]);
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef P2PBITFIELD_H
+#define P2PBITFIELD_H
+
+#include <stdint.h>
+
+using namespace std;
+
+/**
+ * One bit per chunk, packed into 64-bit words. Bit i stands for chunk i+1.
+ * Not thread-safe - the owner guards it.
+ */
+class P2PBitfield
+{
+	private:
+		vector<uint64_t> words;
+		unsigned int num_bits;
+		unsigned int num_set;
+
+	public:
+		P2PBitfield();
+		P2PBitfield(unsigned int);
+
+		bool set(unsigned int);
+		bool clear(unsigned int);
+		bool test(unsigned int);
+		void fill();
+		unsigned int count();
+		unsigned int size();
+		bool isFull();
+		void getMissingRanges(vector<unsigned int> &);
+
+		// Raw access, for persisting the bitfield
+		unsigned int getNumWords();
+		unsigned int getWordIndex(unsigned int);
+		uint64_t * getWords();
+		void recount();
+};
+
+#endif
@@ -0,0 +1,367 @@
+/**
+ * Peer-to-peer download target class
+ */
+
+#include "P2PDownloadTarget.hpp"
+
+const string P2PDownloadTarget::PARTIAL_EXTENSION = ".p2pdl";
+const string P2PDownloadTarget::BITFIELD_EXTENSION = ".bits";
+
+P2PDownloadTarget::P2PDownloadTarget(FileItem file_item)
+{
+	file_id = file_item.file_id;
+	size = file_item.size;
+	chunk_size = file_item.chunk_size;
+	num_chunks = P2PFileTransfer::countChunks(size, chunk_size);
+	name = file_item.name;
+	hash = file_item.hash;
+	piece_hashes = file_item.piece_hashes;
+
+	// Download into a placeholder, it gets its real name once it's complete
+	path = P2PFileTransfer::DATA_FOLDER + "/" + to_string(file_id) + PARTIAL_EXTENSION;
+	file_descriptor = -1;
+	bitfield_path = path + BITFIELD_EXTENSION;
+	bitfield_descriptor = -1;
+
+	chunks_received = P2PBitfield(num_chunks);
+	bytes_received = 0;
+	scheduler = new P2PPieceScheduler(num_chunks, chunk_size);
+
+	// The creator holds the first reference
+	pthread_mutex_init(&mutex, NULL);
+	references = 1;
+	b_completion_claimed = false;
+}
+
+P2PDownloadTarget::~P2PDownloadTarget()
+{
+	if (file_descriptor >= 0)
+	{
+		close(file_descriptor);
+	}
+
+	if (bitfield_descriptor >= 0)
+	{
+		close(bitfield_descriptor);
+	}
+
+	delete scheduler;
+	pthread_mutex_destroy(&mutex);
+}
+
+bool P2PDownloadTarget::allocate()
+{
+	// Ensure we have the data storage folder to work with
+	struct stat s;
+	int file_status = stat(P2PFileTransfer::DATA_FOLDER.c_str(), &s);
+	if (!(file_status == 0 && (s.st_mode & S_IFDIR)))
+	{
+		if (mkdir(P2PFileTransfer::DATA_FOLDER.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0)
+		{
+			string message = "Error: could not create folder to save data. Create folder called " + P2PFileTransfer::DATA_FOLDER;
+			perror(message.c_str());
+			return false;
+		}
+	}
+
+	// Pick up an interrupted download of the same file, if there is one
+	if (this->resume())
+	{
+		return true;
+	}
+
+	file_descriptor = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (file_descriptor < 0)
+	{
+		perror("Error: could not open file to write");
+		return false;
+	}
+
+	// Reserve the space now, so the chunks don't fragment the file or run out of disk halfway
+	if (size > 0 && fallocate(file_descriptor, 0, 0, size) != 0)
+	{
+		// Not every filesystem can - a sparse file of the right length still works
+		if (ftruncate(file_descriptor, size) != 0)
+		{
+			perror("Error: could not allocate space for the download");
+			return false;
+		}
+	}
+
+	// Start a fresh record of the chunks received
+	this->createBitfieldFile();
+
+	return true;
+}
+
+bool P2PDownloadTarget::resume()
+{
+	bitfield_descriptor = ::open(bitfield_path.c_str(), O_RDWR);
+	if (bitfield_descriptor < 0)
+	{
+		return false;
+	}
+
+	// The sidecar only counts if it describes this exact file and chunking
+	uint32_t header[BITFIELD_HEADER_SIZE / 4];
+	unsigned int words_length = chunks_received.getNumWords() * sizeof(uint64_t);
+	struct stat s;
+	if (pread(bitfield_descriptor, header, BITFIELD_HEADER_SIZE, 0) != BITFIELD_HEADER_SIZE
+		|| header[0] != BITFIELD_MAGIC || header[1] != size || header[2] != chunk_size || header[3] != num_chunks
+		|| pread(bitfield_descriptor, chunks_received.getWords(), words_length, BITFIELD_HEADER_SIZE) != (ssize_t) words_length
+		|| stat(path.c_str(), &s) != 0 || s.st_size != (off_t) size)
+	{
+		close(bitfield_descriptor);
+		bitfield_descriptor = -1;
+		chunks_received = P2PBitfield(num_chunks);
+		return false;
+	}
+
+	file_descriptor = ::open(path.c_str(), O_RDWR);
+	if (file_descriptor < 0)
+	{
+		close(bitfield_descriptor);
+		bitfield_descriptor = -1;
+		chunks_received = P2PBitfield(num_chunks);
+		return false;
+	}
+
+	// Every chunk is full length, except possibly the last
+	chunks_received.recount();
+	bytes_received = chunks_received.count() * chunk_size;
+	if (chunks_received.test(num_chunks - 1))
+	{
+		bytes_received -= chunk_size - getChunkLength(num_chunks);
+	}
+
+	// Nobody needs to be asked for what we already have
+	scheduler->setReceived(chunks_received);
+
+	cout << "Resuming \"" << name << "\" with " << chunks_received.count() << " of " << num_chunks << " chunks." << endl;
+	return true;
+}
+
+void P2PDownloadTarget::createBitfieldFile()
+{
+	bitfield_descriptor = ::open(bitfield_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (bitfield_descriptor < 0)
+	{
+		// Not fatal, the download just can't be resumed
+		perror("Error: could not create the download's bitfield file");
+		return;
+	}
+
+	uint32_t header[BITFIELD_HEADER_SIZE / 4] = { BITFIELD_MAGIC, size, chunk_size, num_chunks };
+	unsigned int words_length = chunks_received.getNumWords() * sizeof(uint64_t);
+	if (pwrite(bitfield_descriptor, header, BITFIELD_HEADER_SIZE, 0) != BITFIELD_HEADER_SIZE
+		|| pwrite(bitfield_descriptor, chunks_received.getWords(), words_length, BITFIELD_HEADER_SIZE) != (ssize_t) words_length)
+	{
+		perror("Error: could not write the download's bitfield file");
+		this->removeBitfieldFile();
+	}
+}
+
+void P2PDownloadTarget::removeBitfieldFile()
+{
+	if (bitfield_descriptor >= 0)
+	{
+		close(bitfield_descriptor);
+		bitfield_descriptor = -1;
+	}
+
+	remove(bitfield_path.c_str());
+}
+
+bool P2PDownloadTarget::writeChunk(unsigned int chunk, const char * data, unsigned int length)
+{
+	if (chunk < 1 || chunk > num_chunks || length != getChunkLength(chunk))
+	{
+		return false;
+	}
+
+	// Chunks don't overlap, so they can be written in parallel without the lock
+	off_t offset = (off_t) (chunk - 1) * chunk_size;
+	unsigned int bytes_written = 0;
+	while (bytes_written < length)
+	{
+		ssize_t result = pwrite(file_descriptor, &data[bytes_written], length - bytes_written, offset + bytes_written);
+		if (result < 0 && errno == EINTR) continue;
+		if (result <= 0)
+		{
+			perror("Error: could not write chunk to file");
+			return false;
+		}
+
+		bytes_written += result;
+	}
+
+	// Only count each chunk once, in case it was sent twice
+	pthread_mutex_lock(&mutex);
+	if (chunks_received.set(chunk - 1))
+	{
+		bytes_received += length;
+
+		// Record it in the sidecar after the data, so a resume never trusts a chunk that wasn't written
+		if (bitfield_descriptor >= 0)
+		{
+			unsigned int word_index = chunks_received.getWordIndex(chunk - 1);
+			pwrite(bitfield_descriptor, &chunks_received.getWords()[word_index], sizeof(uint64_t),
+				BITFIELD_HEADER_SIZE + word_index * sizeof(uint64_t));
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return true;
+}
+
+bool P2PDownloadTarget::verifyChunk(unsigned int chunk, const char * data, unsigned int length)
+{
+	// Files shared without hashes can only be checked against the sender's checksum
+	if (!isVerified())
+	{
+		return true;
+	}
+
+	return P2PMerkleTree::verifyPiece(piece_hashes, chunk, data, length);
+}
+
+bool P2PDownloadTarget::isVerified()
+{
+	return piece_hashes.length() > 0;
+}
+
+bool P2PDownloadTarget::isComplete()
+{
+	pthread_mutex_lock(&mutex);
+	bool b_complete = chunks_received.isFull();
+	pthread_mutex_unlock(&mutex);
+
+	return b_complete;
+}
+
+bool P2PDownloadTarget::claimCompletion()
+{
+	// Only one caller gets to finish the download, however many see the last chunk land
+	pthread_mutex_lock(&mutex);
+	bool b_claimed = chunks_received.isFull() && !b_completion_claimed;
+	if (b_claimed)
+	{
+		b_completion_claimed = true;
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return b_claimed;
+}
+
+void P2PDownloadTarget::getMissingRanges(vector<unsigned int> & missing_pieces)
+{
+	// Report each run of missing chunks as a start, count pair
+	pthread_mutex_lock(&mutex);
+	chunks_received.getMissingRanges(missing_pieces);
+	pthread_mutex_unlock(&mutex);
+}
+
+unsigned int P2PDownloadTarget::getBytesReceived()
+{
+	pthread_mutex_lock(&mutex);
+	unsigned int bytes = bytes_received;
+	pthread_mutex_unlock(&mutex);
+
+	return bytes;
+}
+
+unsigned int P2PDownloadTarget::getNumChunksReceived()
+{
+	pthread_mutex_lock(&mutex);
+	unsigned int chunks = chunks_received.count();
+	pthread_mutex_unlock(&mutex);
+
+	return chunks;
+}
+
+string P2PDownloadTarget::finalize()
+{
+	// Make sure the data is on disk before it's announced to anyone
+	fdatasync(file_descriptor);
+
+	// Nothing left to resume
+	this->removeBitfieldFile();
+
+	// Give the file its real name
+	string final_filename = P2PFileTransfer::DATA_FOLDER + '/'
+		+ P2PCommon::renameDuplicateFile(name, P2PFileTransfer::DATA_FOLDER);
+
+	if (rename(path.c_str(), final_filename.c_str()) != 0)
+	{
+		perror("Error: could not rename the completed download");
+		return path;
+	}
+
+	path = final_filename;
+	return path;
+}
+
+unsigned int P2PDownloadTarget::getFileId()
+{
+	return file_id;
+}
+
+string P2PDownloadTarget::getName()
+{
+	return name;
+}
+
+string P2PDownloadTarget::getHash()
+{
+	return hash;
+}
+
+unsigned int P2PDownloadTarget::getSize()
+{
+	return size;
+}
+
+unsigned int P2PDownloadTarget::getChunkSize()
+{
+	return chunk_size;
+}
+
+unsigned int P2PDownloadTarget::getNumChunks()
+{
+	return num_chunks;
+}
+
+unsigned int P2PDownloadTarget::getChunkLength(unsigned int chunk)
+{
+	// Only the last chunk may be short of the negotiated chunk size
+	if (chunk == num_chunks)
+	{
+		return size - (num_chunks - 1) * chunk_size;
+	}
+
+	return chunk_size;
+}
+
+P2PPieceScheduler * P2PDownloadTarget::getScheduler()
+{
+	return scheduler;
+}
+
+void P2PDownloadTarget::retain()
+{
+	pthread_mutex_lock(&mutex);
+	references++;
+	pthread_mutex_unlock(&mutex);
+}
+
+void P2PDownloadTarget::release()
+{
+	pthread_mutex_lock(&mutex);
+	bool b_last_reference = (--references == 0);
+	pthread_mutex_unlock(&mutex);
+
+	if (b_last_reference)
+	{
+		delete this;
+	}
+}
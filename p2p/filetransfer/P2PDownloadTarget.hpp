@@ -0,0 +1,80 @@
+#ifndef P2PDOWNLOADTARGET_H
+#define P2PDOWNLOADTARGET_H
+
+#include "P2PBitfield.hpp"
+
+using namespace std;
+
+/**
+ * The file a download is written into. Space for the whole file is
+ * allocated up front, and every verified chunk is written at its offset.
+ * The chunks received are tracked in a bitfield, mirrored to a sidecar
+ * file so an interrupted download can pick up where it left off.
+ * Each download has a scheduler deciding which peer sends which chunk.
+ * Shared between the node and the threads receiving chunks, so it's
+ * reference counted - the last one to release it frees it.
+ */
+class P2PDownloadTarget
+{
+	private:
+		unsigned int file_id;
+		unsigned int size;
+		unsigned int chunk_size;
+		unsigned int num_chunks;
+		string name;
+		string path;
+		string hash;
+		string piece_hashes;
+		int file_descriptor;
+		string bitfield_path;
+		int bitfield_descriptor;
+
+		// Chunks received so far - guarded by the mutex
+		P2PBitfield chunks_received;
+		unsigned int bytes_received;
+		pthread_mutex_t mutex;
+		int references;
+		bool b_completion_claimed;
+
+		P2PPieceScheduler * scheduler;
+
+		~P2PDownloadTarget();
+		bool resume();
+		void createBitfieldFile();
+		void removeBitfieldFile();
+
+	public:
+		P2PDownloadTarget(FileItem);
+		bool allocate();
+		bool writeChunk(unsigned int, const char *, unsigned int);
+		bool verifyChunk(unsigned int, const char *, unsigned int);
+		bool isVerified();
+		bool isComplete();
+		bool claimCompletion();
+		void getMissingRanges(vector<unsigned int> &);
+		unsigned int getBytesReceived();
+		unsigned int getNumChunksReceived();
+		string finalize();
+
+		unsigned int getFileId();
+		string getName();
+		string getHash();
+		unsigned int getSize();
+		unsigned int getChunkSize();
+		unsigned int getNumChunks();
+		unsigned int getChunkLength(unsigned int);
+		P2PPieceScheduler * getScheduler();
+
+		void retain();
+		void release();
+
+		// Suffix for files still being downloaded
+		static const string PARTIAL_EXTENSION;
+
+		// Suffix for the bitfield sidecar, and the header it starts with
+		static const string BITFIELD_EXTENSION;
+		static const uint32_t BITFIELD_MAGIC = 0x50324246;
+		static const int BITFIELD_HEADER_SIZE = 16;
+};
+
+#endif
@@ -9,7 +9,27 @@
  */
 const string P2PFileTransfer::DATA_FOLDER = "P2PRawData";
 
-P2PFileTransfer::P2PFileTransfer() {}
+P2PFileTransfer::P2PFileTransfer()
+{
+	checksum_algorithm = P2PChecksum::DEFAULT_ALGORITHM;
+	file_descriptor = -1;
+	file_length = 0;
+	mapped_file = NULL;
+	buffer = NULL;
+	next_chunk = 1;
+	last_chunk = 0;
+	sent_mark = 0;
+}
+
+P2PFileTransfer::~P2PFileTransfer()
+{
+	// Close and deallocate
+	if (mapped_file != NULL)
+		munmap(mapped_file, file_length);
+	delete[] buffer;
+	if (file_descriptor >= 0)
+		close(file_descriptor);
+}
 
 void P2PFileTransfer::setBounds(unsigned int start, unsigned int count)
 {
@@ -17,378 +37,248 @@ void P2PFileTransfer::setBounds(unsigned int start, unsigned int count)
 	this->count = count;
 }
 
-void P2PFileTransfer::startTransferFile(FileItem file_item, int socket_id)
+void P2PFileTransfer::setChecksumAlgorithm(unsigned char algorithm)
 {
-	// Get the file ID and path
-	int file_id = file_item.file_id;
-	string path = file_item.path;
+	checksum_algorithm = algorithm;
+}
 
-	// Get the filename
-	string filename = file_item.name;
+bool P2PFileTransfer::startTransferFile(FileItem file_item)
+{
+	// Get the file ID, path and the chunk size agreed on with the receiver
+	file_id = file_item.file_id;
+	string path = file_item.path;
+	chunk_size = clampChunkSize(file_item.chunk_size);
 
-	// If the filename is greater than 255 characters, trim it accordingly
-	if (filename.length() > P2PCommon::MAX_FILENAME_LENGTH)
+	// Open the file to serve
+	file_descriptor = open(path.c_str(), O_RDONLY);
+	if (file_descriptor < 0)
 	{
-		vector<string> filename_info = P2PCommon::splitString(filename, '.');
-		string filename_ext = filename_info.back();
-
-		// Return a filename that fits
-		filename = filename.substr(0, P2PCommon::MAX_FILENAME_LENGTH - 1 - filename_ext.length()) + '.' + filename_ext;
+		perror("Error: could not initiate file transfer");
+		return false;
 	}
 
-	// Load in the file bit by bit
-	ifstream input_stream(path, ios::binary);
-	if (input_stream)
+	// Get length of file
+	struct stat s;
+	if (fstat(file_descriptor, &s) != 0)
 	{
-		// Get length of file
-		input_stream.seekg(0, input_stream.end);
-		unsigned int length = input_stream.tellg();
-
-		// Determine number of file chunks
-		unsigned int num_chunks;
-		if (length % FILE_CHUNK_SIZE == 0)
-			num_chunks = length/FILE_CHUNK_SIZE;
-		else
-			num_chunks = length/FILE_CHUNK_SIZE + 1;
-
-		// Start back at beginning
-		input_stream.seekg(0, input_stream.beg);
-
-		// Allocate memory for sending data in chunks
-		char * buffer = new char[FILE_CHUNK_SIZE + HEADER_SIZE];
-
-		// Read data as blocks
-		unsigned int i = 0;
-		unsigned int total = num_chunks;
-
-		if (start > 0 && start <= num_chunks)
-			i = start;
+		perror("Error: could not initiate file transfer");
+		return false;
+	}
+	file_length = s.st_size;
 
-		if (count > 0 && (count+i) <= num_chunks)
-			total = (count+i);
+	// Determine number of file chunks
+	unsigned int num_chunks = countChunks(file_length, chunk_size);
 
-		// Start at the proper location
-		if (i > 0)
-			input_stream.seekg((i-1) * FILE_CHUNK_SIZE);
-	
-		while (i <= total)
+	// Map the file, so the checksum reads straight from the page cache
+	// and the payload never has to be copied into our own buffers
+	if (file_length > 0)
+	{
+		void * mapping = mmap(NULL, file_length, PROT_READ, MAP_SHARED, file_descriptor, 0);
+		if (mapping != MAP_FAILED)
 		{
-			// Clear out the buffer
-			memset(buffer, 0, FILE_CHUNK_SIZE + HEADER_SIZE);
-
-			/*
-				Header:
-					flag (12) + 2 = 14 chars
-					file id = 10 + 1 = 11 chars
-					payload size = 5 + 1 = 6 chars
-					total number of chunks (10) + 1, current chunk (10) + 1 = 22 chars
-					checksum (8) + 2 = 10 chars
-					payload (variable)
-			// \t\r\n + file id + paysize + flag + chunks  + checksum = header
-			// 8      + 10      + 5       + 12   + 10 + 10 + 8        = 63
-			*/
-
-			// Read in the data to send
-			input_stream.read(&buffer[HEADER_SIZE], FILE_CHUNK_SIZE);
-			int bytes_read = input_stream.gcount();
-
-			// Compute the checksum
-			string checksum = computeChecksum(&buffer[HEADER_SIZE], bytes_read);
-
-			// Prepend the header
-			char header[HEADER_SIZE+1]; // +1 = null terminator
-			sprintf(header, "%12s\r\n%10d\t%5d\t%10d\t%10d\t%8s\r\n", 
-				"fileTransfer", file_id, bytes_read, num_chunks, i, checksum.c_str());
-
-			// Copy the header to the buffer
-			memcpy(&buffer[0], header, HEADER_SIZE);
-
-			// Send the data across the wire
-			int bytes_written = write(socket_id, buffer, HEADER_SIZE + bytes_read);
-			if (bytes_written == -1)
-			{
-				perror("Error: could not write to socket");
-			}
-
-			if (bytes_written < HEADER_SIZE + bytes_read)
-			{
-				// TO BE HANDLED - when write could not deliver the full payload
-			}
-
-			// If we write too fast, then the messages are sent in one packet
-			usleep(5000);
-
-			// Move to the next chunk
-			input_stream.seekg((i++) * FILE_CHUNK_SIZE);
+			mapped_file = (char *) mapping;
+			madvise(mapped_file, file_length, MADV_SEQUENTIAL);
 		}
-
-		// Close and deallocate
-		input_stream.close();
-		delete[] buffer;
 	}
-	else
+
+	// Only needed if the file can't be mapped
+	if (mapped_file == NULL)
 	{
-		perror("Error: could not initiate file transfer");
+		buffer = new char[chunk_size];
 	}
-}
 
-void P2PFileTransfer::handleIncomingFileTransfer(FileDataPacket packet)
-{
-	// Get the raw message and file information from the packet
-	FileItem file_item = packet.file_item;
-	char * raw_message = packet.packet;
-
-	// Parse the request
-	vector<string> request = P2PCommon::parseRequest(raw_message);
-	vector<string> header_info = P2PCommon::splitString(request[1], '\t');
+	// Send the requested range of chunks - count of them, starting at start
+	next_chunk = (start > 0) ? start : 1;
+	last_chunk = num_chunks;
 
-	// Direct the data stream into the correct file
-	string file_id = P2PCommon::trimWhitespace(header_info[0]);
-	int payload_size = stoi(P2PCommon::trimWhitespace(header_info[1]));
-	string total_file_parts = P2PCommon::trimWhitespace(header_info[2]);
-	string file_part = P2PCommon::trimWhitespace(header_info[3]);
-	string checksum = P2PCommon::trimWhitespace(header_info[4]);
+	if (count > 0 && (next_chunk + count - 1) <= num_chunks)
+		last_chunk = next_chunk + count - 1;
 
-	// Validate the checksum before we do anything
-	string computed_checksum = computeChecksum(&raw_message[HEADER_SIZE], payload_size);
+	return true;
+}
 
-	if (checksum.compare(computed_checksum) != 0)
+bool P2PFileTransfer::continueTransferFile(P2PSendQueue * queue, void (*resume)(void *), void * arg)
+{
+	while (next_chunk <= last_chunk)
 	{
-		perror("Error: calculated checksums do not match.");
-		return;
-	}
+		// A slow peer's queue fills up - leave it to call us back once there's room, rather than wait here
+		if (queue->deferUntilSpace(resume, arg))
+		{
+			return true;
+		}
 
-	// Ensure we have the data storage folder to work with
-	struct stat s;
-	int file_status = stat(P2PFileTransfer::DATA_FOLDER.c_str(), &s);
-	if (!(file_status == 0 && (s.st_mode & S_IFDIR)))
-	{
-		if (mkdir(P2PFileTransfer::DATA_FOLDER.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0)
+		off_t offset = (off_t) (next_chunk - 1) * chunk_size;
+		unsigned int chunk_length = min((off_t) chunk_size, file_length - offset);
+
+		// Frames are length-prefixed, so chunks can go out back-to-back
+		bool b_sent;
+		if (mapped_file != NULL)
+			b_sent = sendChunkZeroCopy(queue, file_descriptor, mapped_file, file_id, next_chunk, offset, chunk_length);
+		else
+			b_sent = sendChunkBuffered(queue, file_descriptor, buffer, file_id, next_chunk, offset, chunk_length);
+
+		if (!b_sent)
 		{
-			string message = "Error: could not create folder to save data. Create folder called " + P2PFileTransfer::DATA_FOLDER;
-			perror(message.c_str());
-			return;
+			cout << "Error: could not write to socket" << endl;
+			next_chunk = last_chunk + 1;
+			break;
 		}
-	}
 
-	// Construct the download filename
-	string filename = file_id + ".pt." + file_part + ".of." + total_file_parts + ".p2pft";
+		// Move to the next chunk
+		next_chunk++;
+	}
 
-	// Save the piece to this folder
-	string data_filename = P2PFileTransfer::DATA_FOLDER + "/" + filename;
-	std::ofstream outfile(data_filename.c_str(), ios::binary);
-	if (outfile)
+	// The queue reads the payloads from the file - hold on to it until they're gone
+	if (mapped_file == NULL)
 	{
-		// Write and close
-		outfile.write(&raw_message[HEADER_SIZE], payload_size);
-		outfile.flush();
-		outfile.close();
+		return false;
 	}
-	else
+
+	if (sent_mark == 0)
 	{
-		perror("Error: could not open file to write");
+		sent_mark = queue->getBytesQueued();
 	}
+
+	return queue->deferUntilSent(sent_mark, resume, arg);
 }
 
-bool P2PFileTransfer::compileFileParts(FileItem & file_item)
+bool P2PFileTransfer::sendChunkZeroCopy(P2PSendQueue * queue, int file_descriptor, char * mapped_file, int file_id, unsigned int chunk, off_t offset, unsigned int chunk_length)
 {
-	// Keep track of whether the file is completed
-	bool b_file_completed = false;
-
-	// Compute the total number of parts from the file size
-	unsigned int length = file_item.size;
-	unsigned int num_chunks;
-	if (length % FILE_CHUNK_SIZE == 0)
-		num_chunks = length/FILE_CHUNK_SIZE;
-	else
-		num_chunks = length/FILE_CHUNK_SIZE + 1;
+	// The checksum is the only time the payload passes through user space
+	unsigned int checksum = P2PChecksum::compute(checksum_algorithm, &mapped_file[offset], chunk_length);
 
-	// Once we've saved the data, analyze to see if we have a full file
-	// Add all files in the directory
-	DIR *directory;
-	struct dirent *ep;
+	P2PFrameHeader header = P2PFrame::makeHeader(P2PFrame::TYPE_FILE_CHUNK, chunk_length, file_id, chunk, checksum);
+	header.flags = checksum_algorithm;
 
-	// Open the directory
-	directory = opendir(P2PFileTransfer::DATA_FOLDER.c_str());
-	if (directory == NULL)
+	// Queue the payload where it lies - it's written straight from the page cache
+	if (!queue->pushFileRegion(header, file_descriptor, mapped_file, offset, chunk_length))
 	{
 		return false;
 	}
 
-	// Get the file information
-	string file_id = to_string(file_item.file_id);
-	string filename = file_item.name;
+	return queue->flush() != P2PSendQueue::FLUSH_FAILED;
+}
 
-	// Prepare the array 
-	bool pieces_found[num_chunks];
-	for (unsigned int i = 1; i <= num_chunks; i++)
+bool P2PFileTransfer::sendChunkBuffered(P2PSendQueue * queue, int file_descriptor, char * buffer, int file_id, unsigned int chunk, off_t offset, unsigned int chunk_length)
+{
+	// Read in the data to send
+	unsigned int bytes_read = 0;
+	while (bytes_read < chunk_length)
 	{
-		pieces_found[i] = false;
+		ssize_t result = pread(file_descriptor, &buffer[bytes_read], chunk_length - bytes_read, offset + bytes_read);
+		if (result < 0 && errno == EINTR) continue;
+		if (result <= 0) return false;
+		bytes_read += result;
 	}
 
-	// See how many parts we have available
-	unsigned int i = 0;
-	while ((ep = readdir(directory)) != NULL && num_chunks >= i)
-	{
-		string this_filename = string(ep->d_name);
+	// Compute the checksum
+	unsigned int checksum = P2PChecksum::compute(checksum_algorithm, buffer, chunk_length);
 
-		// Validate the filename length
-		if (this_filename.length() < 8)
-		{
-			continue;
-		}
+	P2PFrameHeader header = P2PFrame::makeHeader(P2PFrame::TYPE_FILE_CHUNK, chunk_length, file_id, chunk, checksum);
+	header.flags = checksum_algorithm;
 
-		// Evaluate that each part is there
-		if (this_filename.compare(0, file_id.length() + 1, (file_id + ".").c_str()) == 0
-			&& this_filename.compare(this_filename.length() - 6, 6, ".p2pft") == 0)
-		{
-			// Get the piece number
-			vector<string> pieces = P2PCommon::splitString(this_filename, '.');
+	// The queue keeps its own copy, so the buffer is free for the next chunk
+	if (!queue->pushFrame(header, buffer, chunk_length))
+	{
+		return false;
+	}
 
-			// Keep track of found pieces so we can request the missing ones
-			pieces_found[stoi(pieces[2])] = true;
+	return queue->flush() != P2PSendQueue::FLUSH_FAILED;
+}
 
-			i++;
-		}
+bool P2PFileTransfer::handleIncomingFileTransfer(FileDataPacket packet)
+{
+	// Get the payload and the file it belongs in from the packet
+	P2PDownloadTarget * target = packet.target;
+	const char * payload = packet.payload;
+	unsigned int payload_size = packet.header.length;
+
+	// Only the last chunk may be short of the negotiated chunk size
+	unsigned int chunk = packet.header.chunk;
+	if (chunk < 1 || chunk > target->getNumChunks() || payload_size != target->getChunkLength(chunk))
+	{
+		cout << "Error: received a chunk that doesn't fit the negotiated chunk size." << endl;
+		return false;
 	}
 
-	// If we have all the parts, combine them
-	if (i == num_chunks)
+	// Validate the checksum before we do anything, with whichever algorithm the sender used
+	unsigned char algorithm = packet.header.flags & P2PFrame::FLAG_CHECKSUM_MASK;
+	if (!P2PChecksum::isKnownAlgorithm(algorithm))
 	{
-		string final_filename = P2PFileTransfer::DATA_FOLDER + '/' 
-			+ P2PCommon::renameDuplicateFile(filename, P2PFileTransfer::DATA_FOLDER);
-
-		std::ofstream outfile(final_filename.c_str(), ios::binary);
-
-		if (outfile)
-		{
-			for (i = 1; i <= num_chunks; i++)
-			{
-				// Get the current file to read
-				string this_filename = P2PFileTransfer::DATA_FOLDER + '/' + file_id 
-					+ ".pt." + to_string(i) + ".of." + to_string(num_chunks) + ".p2pft";
-
-				// Open the file to read in
-				ifstream input_stream(this_filename, ios::binary);
-				if (input_stream)
-				{
-					// Get length of file
-					input_stream.seekg(0, input_stream.end);
-					unsigned int length = input_stream.tellg();
-					input_stream.seekg(0, input_stream.beg);
-
-					// Allocate memory for transferring data
-					char * buffer = new char[length];
-					input_stream.read(buffer, length);
-
-					// Read the contents of this file into the general file
-					outfile.write(buffer, length);
-					outfile.flush();
-				}
-
-				// Delete the unneeded chunk
-				if (remove(this_filename.c_str()) != 0)
-				{
-					perror("Error: Could not remove outdated file chunk");
-				}
-			}
-
-			// Notify the user
-			cout << "Your download of \"" << filename << "\" is completed." << endl;
-			b_file_completed = true;
-			file_item.path = final_filename;
-
-			// Close the output file
-			outfile.close();
-		}
-		else
-		{
-			perror("Error: could not open file to write");
-		}
+		cout << "Error: received a chunk with an unknown checksum algorithm." << endl;
+		return false;
 	}
-	else
+
+	if (packet.header.checksum != P2PChecksum::compute(algorithm, payload, payload_size))
 	{
-		// If we're missing pieces, determine which ones we're missing
-		int start = 0; int count = 0;
-		for (int i = 1; i <= num_chunks; i++)
-		{
-			if (!pieces_found[i] && start < 1)
-			{
-				start = i;
-				count = 1;
-			}
-			else if (!pieces_found[i] && start >= 1)
-			{
-				count++;
-			}
-
-			if ((pieces_found[i] && start >= 1) || (i == num_chunks && start >= 1))
-			{
-				// We have a range - save it so that the peernode can restart the transfer
-				file_item.missing_pieces.push_back(start);
-				file_item.missing_pieces.push_back(count);
-				start = 0;
-				count = 0;
-
-			}
-		}
+		cout << "Error: calculated checksums do not match." << endl;
+		return false;
 	}
 
-	// Close the directory
-	closedir(directory);
+	// The checksum only catches damage in transit - the piece hash catches a bad sender
+	if (!target->verifyChunk(chunk, payload, payload_size))
+	{
+		cout << "Error: chunk " << chunk << " of \"" << target->getName() << "\" doesn't match its piece hash." << endl;
+		return false;
+	}
 
-	return b_file_completed;
+	// Write the chunk straight into place in the download
+	return target->writeChunk(chunk, payload, payload_size);
 }
 
-string P2PFileTransfer::computeChecksum(char * data, int size)
+bool P2PFileTransfer::compileFileParts(FileItem & file_item, P2PDownloadTarget * target)
 {
-	unsigned int checksum = 0;
-	unsigned int value = 0;
-	int i = 0;
-	while (i < size)
-	{
-		// Add on the next value
-		value <<= 8;
-		value |= data[i];
+	// Start from a clean slate - the missing pieces are recomputed each time
+	file_item.missing_pieces.clear();
 
-		// If we have a full value, add it to the checksum
-		if ((i+1)%4 == 0)
-		{
-			checksum += value;
-			checksum += (checksum <= value) ? 1 : 0; // Overflow -> Wraparound, add 1 bit
-			value = 0;
-		}
+	// The chunks were written in place, so a complete download just needs its name
+	if (target->isComplete())
+	{
+		file_item.path = target->finalize();
 
-		// Move to the next iteration
-		i++;
+		// Notify the user
+		cout << "Your download of \"" << file_item.name << "\" is completed." << endl;
+		return true;
 	}
 
-	// Handle leftover values
-	if (value > 0)
+	// If we're missing pieces, determine which ones we're missing
+	// Save them as ranges so that the peernode can restart the transfer
+	target->getMissingRanges(file_item.missing_pieces);
+
+	return false;
+}
+
+unsigned int P2PFileTransfer::chooseChunkSize(unsigned int file_size)
+{
+	// Aim for around TARGET_NUM_CHUNKS chunks, so big files get big chunks
+	unsigned int chunk_size = MIN_CHUNK_SIZE;
+	while (chunk_size < MAX_CHUNK_SIZE && (file_size / chunk_size) > TARGET_NUM_CHUNKS)
 	{
-		checksum += value;
-		checksum += (checksum <= value) ? 1 : 0; 
+		chunk_size <<= 1;
 	}
 
-	// Convert the checksum to hex and return as a string
-	stringstream sstream;
-	sstream << hex << checksum;
-	return sstream.str();
+	return chunk_size;
 }
 
-void P2PFileTransfer::reviewTransfers(vector<FileItem> &download_file_list)
+unsigned int P2PFileTransfer::clampChunkSize(unsigned int chunk_size)
 {
-	bool b_file_completed = false;
-	vector<FileItem>::iterator iter;
-	for (iter = download_file_list.begin(); iter < download_file_list.end(); iter++)
+	// Round down to a power of two, within the supported bounds
+	unsigned int clamped = MIN_CHUNK_SIZE;
+	while (clamped < MAX_CHUNK_SIZE && (clamped << 1) <= chunk_size)
 	{
-		// Skip finished files
-		if ((*iter).completed)
-		{
-			continue;
-		}
-
-		// Compile the file's parts
-		(*iter).completed = compileFileParts(*iter);
+		clamped <<= 1;
 	}
+
+	return clamped;
+}
+
+unsigned int P2PFileTransfer::countChunks(unsigned int size, unsigned int chunk_size)
+{
+	if (chunk_size == 0)
+		return 0;
+
+	if (size % chunk_size == 0)
+		return size/chunk_size;
+	else
+		return size/chunk_size + 1;
 }
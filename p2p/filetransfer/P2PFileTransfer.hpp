@@ -1,6 +1,8 @@
 #ifndef P2PFILETRANSFER_H
 #define P2PFILETRANSFER_H
 
+#include "P2PDownloadTarget.hpp"
+
 using namespace std;
 
 class P2PFileTransfer
@@ -9,20 +11,43 @@ class P2PFileTransfer
 		vector<FileItem> file_list;
 		unsigned int start;
 		unsigned int count;
+		unsigned char checksum_algorithm;
+
+		// The file being sent, and how far through the range it's got
+		int file_id;
+		unsigned int chunk_size;
+		int file_descriptor;
+		off_t file_length;
+		char * mapped_file;
+		char * buffer;
+		unsigned int next_chunk;
+		unsigned int last_chunk;
+		unsigned long long sent_mark;
+
+		// Sending chunks
+		bool sendChunkZeroCopy(P2PSendQueue *, int, char *, int, unsigned int, off_t, unsigned int);
+		bool sendChunkBuffered(P2PSendQueue *, int, char *, int, unsigned int, off_t, unsigned int);
 
 	public:
 		P2PFileTransfer();
+		~P2PFileTransfer();
 
 		void setBounds(unsigned int, unsigned int);
-		void startTransferFile(FileItem, int);
-		void handleIncomingFileTransfer(FileDataPacket);
-		string computeChecksum(char *, int);
-		void reviewTransfers(vector<FileItem>&);
-		bool compileFileParts(FileItem&);
-
-		// File transfer
-		static const unsigned int FILE_CHUNK_SIZE = 449;
-		static const unsigned int HEADER_SIZE = 63;
+		void setChecksumAlgorithm(unsigned char);
+		bool startTransferFile(FileItem);
+		bool continueTransferFile(P2PSendQueue *, void (*)(void *), void *);
+		bool handleIncomingFileTransfer(FileDataPacket);
+		bool compileFileParts(FileItem&, P2PDownloadTarget *);
+
+		// Chunk size negotiation
+		static unsigned int chooseChunkSize(unsigned int);
+		static unsigned int clampChunkSize(unsigned int);
+		static unsigned int countChunks(unsigned int, unsigned int);
+
+		// File transfer - chunk sizes are powers of two within these bounds
+		static const unsigned int MIN_CHUNK_SIZE = 16 * 1024;
+		static const unsigned int MAX_CHUNK_SIZE = 4 * 1024 * 1024;
+		static const unsigned int TARGET_NUM_CHUNKS = 1024;
 
 		// Data folder
 		static const string DATA_FOLDER;
@@ -0,0 +1,117 @@
+/**
+ * Peer-to-peer wire framing class
+ */
+
+#include "P2PFrame.hpp"
+
+P2PFrame::P2PFrame() {}
+
+void P2PFrame::packHeader(P2PFrameHeader header, char * data)
+{
+	unsigned short magic = htons(header.magic);
+	unsigned int length = htonl(header.length);
+	unsigned int file_id = htonl(header.file_id);
+	unsigned int chunk = htonl(header.chunk);
+	unsigned int checksum = htonl(header.checksum);
+
+	memcpy(&data[0], &magic, 2);
+	data[2] = header.type;
+	data[3] = header.flags;
+	memcpy(&data[4], &length, 4);
+	memcpy(&data[8], &file_id, 4);
+	memcpy(&data[12], &chunk, 4);
+	memcpy(&data[16], &checksum, 4);
+}
+
+bool P2PFrame::unpackHeader(const char * data, P2PFrameHeader & header)
+{
+	unsigned short magic;
+	memcpy(&magic, &data[0], 2);
+	memcpy(&header.length, &data[4], 4);
+	memcpy(&header.file_id, &data[8], 4);
+	memcpy(&header.chunk, &data[12], 4);
+	memcpy(&header.checksum, &data[16], 4);
+
+	header.magic = ntohs(magic);
+	header.type = data[2];
+	header.flags = data[3];
+	header.length = ntohl(header.length);
+	header.file_id = ntohl(header.file_id);
+	header.chunk = ntohl(header.chunk);
+	header.checksum = ntohl(header.checksum);
+
+	// Reject anything that isn't one of ours, or that we couldn't buffer
+	return header.magic == MAGIC && header.length <= MAX_PAYLOAD_SIZE;
+}
+
+P2PFrameHeader P2PFrame::makeHeader(unsigned char type, unsigned int length, unsigned int file_id, unsigned int chunk, unsigned int checksum)
+{
+	P2PFrameHeader header;
+	header.magic = MAGIC;
+	header.type = type;
+	header.flags = 0;
+	header.length = length;
+	header.file_id = file_id;
+	header.chunk = chunk;
+	header.checksum = checksum;
+
+	return header;
+}
+
+bool P2PFrame::sendFrame(int socket_id, P2PFrameHeader header, const char * payload, unsigned int length)
+{
+	char packed_header[HEADER_SIZE];
+	header.length = length;
+	packHeader(header, packed_header);
+
+	// Header and payload go out together, without copying the payload
+	struct iovec parts[2];
+	parts[0].iov_base = packed_header;
+	parts[0].iov_len = HEADER_SIZE;
+	parts[1].iov_base = (void *) payload;
+	parts[1].iov_len = length;
+
+	return sendParts(socket_id, parts, (length > 0) ? 2 : 1, 0);
+}
+
+bool P2PFrame::sendParts(int socket_id, struct iovec * part, int num_parts, int flags)
+{
+	// Keep writing until the kernel has taken everything
+	while (num_parts > 0)
+	{
+		// A peer hanging up shouldn't SIGPIPE the whole process
+		struct msghdr message;
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = part;
+		message.msg_iovlen = num_parts;
+
+		ssize_t bytes_written = sendmsg(socket_id, &message, flags | MSG_NOSIGNAL);
+		if (bytes_written < 0)
+		{
+			if (errno == EINTR) continue;
+			return false;
+		}
+
+		// Skip past whatever was written
+		while (num_parts > 0 && (size_t) bytes_written >= part->iov_len)
+		{
+			bytes_written -= part->iov_len;
+			part++;
+			num_parts--;
+		}
+
+		if (num_parts > 0)
+		{
+			part->iov_base = (char *) part->iov_base + bytes_written;
+			part->iov_len -= bytes_written;
+		}
+	}
+
+	return true;
+}
+
+bool P2PFrame::sendMessage(int socket_id, string message)
+{
+	P2PFrameHeader header = makeHeader(TYPE_MESSAGE, message.length(), 0, 0, 0);
+	return sendFrame(socket_id, header, message.c_str(), message.length());
+}
@@ -0,0 +1,42 @@
+#ifndef P2PFRAME_H
+#define P2PFRAME_H
+
+using namespace std;
+
+/**
+ * Wire format:
+ *   magic (2) + type (1) + flags (1) + payload length (4)
+ *   + file id (4) + chunk (4) + checksum (4) = 20 byte header,
+ *   followed by the payload. All fields are in network byte order.
+ * The file id names the transfer a chunk belongs to, so one connection
+ * can carry chunks of many files at once.
+ * Frames normally go out through the socket's P2PSendQueue. sendFrame()
+ * writes one directly, for sockets nothing else is sending on yet.
+ */
+class P2PFrame
+{
+	public:
+		P2PFrame();
+
+		static void packHeader(P2PFrameHeader, char *);
+		static bool unpackHeader(const char *, P2PFrameHeader &);
+		static P2PFrameHeader makeHeader(unsigned char, unsigned int, unsigned int, unsigned int, unsigned int);
+
+		static bool sendFrame(int, P2PFrameHeader, const char *, unsigned int);
+		static bool sendParts(int, struct iovec *, int, int);
+		static bool sendMessage(int, string);
+
+		// Frame types
+		static const unsigned char TYPE_MESSAGE = 1;
+		static const unsigned char TYPE_FILE_CHUNK = 2;
+
+		// The low bits of the flags name the checksum algorithm (see P2PChecksum)
+		static const unsigned char FLAG_CHECKSUM_MASK = 0x0F;
+
+		// Frame limits
+		static const unsigned short MAGIC = 0x5032;
+		static const unsigned int HEADER_SIZE = 20;
+		static const unsigned int MAX_PAYLOAD_SIZE = 16 * 1024 * 1024;
+};
+
+#endif
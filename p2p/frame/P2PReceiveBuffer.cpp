@@ -0,0 +1,155 @@
+/**
+ * Peer-to-peer socket receive buffer class
+ */
+
+#include "P2PReceiveBuffer.hpp"
+
+P2PReceiveBuffer::P2PReceiveBuffer()
+{
+	block = NULL;
+	start = 0;
+	end = 0;
+}
+
+P2PReceiveBuffer::~P2PReceiveBuffer()
+{
+	// Consumers may still hold the block - it goes with the last of them
+	if (block != NULL)
+	{
+		releaseBlock(block);
+	}
+}
+
+ReceiveBlock * P2PReceiveBuffer::createBlock(unsigned int capacity)
+{
+	ReceiveBlock * new_block = new ReceiveBlock;
+	new_block->data = new char[capacity];
+	new_block->capacity = capacity;
+	new_block->references = 1;
+	pthread_mutex_init(&new_block->mutex, NULL);
+
+	return new_block;
+}
+
+void P2PReceiveBuffer::releaseBlock(ReceiveBlock * released_block)
+{
+	pthread_mutex_lock(&released_block->mutex);
+	bool b_last_reference = (--released_block->references == 0);
+	pthread_mutex_unlock(&released_block->mutex);
+
+	if (b_last_reference)
+	{
+		pthread_mutex_destroy(&released_block->mutex);
+		delete[] released_block->data;
+		delete released_block;
+	}
+}
+
+ReceiveBlock * P2PReceiveBuffer::shareBlock()
+{
+	pthread_mutex_lock(&block->mutex);
+	block->references++;
+	pthread_mutex_unlock(&block->mutex);
+
+	return block;
+}
+
+unsigned int P2PReceiveBuffer::getFrameSize()
+{
+	// How much room the frame at the front needs - at least a header, until we know more
+	P2PFrameHeader header;
+	if (end - start < P2PFrame::HEADER_SIZE || !P2PFrame::unpackHeader(&block->data[start], header))
+	{
+		return P2PFrame::HEADER_SIZE;
+	}
+
+	return P2PFrame::HEADER_SIZE + header.length;
+}
+
+char * P2PReceiveBuffer::prepareWrite(unsigned int & space)
+{
+	if (block == NULL)
+	{
+		block = createBlock(BLOCK_SIZE);
+	}
+
+	pthread_mutex_lock(&block->mutex);
+	bool b_shared = (block->references > 1);
+	pthread_mutex_unlock(&block->mutex);
+
+	// Nobody else is reading from the block, and nothing's left in it - start over at the front
+	if (!b_shared && start == end)
+	{
+		start = 0;
+		end = 0;
+	}
+
+	// Move on if the frame at the front won't fit, or there's too little room to be worth a read
+	unsigned int frame_size = this->getFrameSize();
+	if (start + frame_size > block->capacity || block->capacity - end < MIN_READ_SIZE)
+	{
+		unsigned int remaining = end - start;
+		unsigned int capacity = max(frame_size + MIN_READ_SIZE, (unsigned int) BLOCK_SIZE);
+
+		if (!b_shared && capacity <= block->capacity)
+		{
+			// Slide the unfinished frame back to the front
+			memmove(block->data, &block->data[start], remaining);
+		}
+		else
+		{
+			// The old block stays with whoever's still reading it
+			ReceiveBlock * new_block = createBlock(capacity);
+			memcpy(new_block->data, &block->data[start], remaining);
+			releaseBlock(block);
+			block = new_block;
+		}
+
+		start = 0;
+		end = remaining;
+	}
+
+	space = block->capacity - end;
+	return &block->data[end];
+}
+
+void P2PReceiveBuffer::commitWrite(unsigned int bytes_written)
+{
+	end += bytes_written;
+}
+
+int P2PReceiveBuffer::nextFrame(P2PFrameHeader & header, const char *& payload)
+{
+	if (block == NULL || end - start < P2PFrame::HEADER_SIZE)
+	{
+		return FRAME_INCOMPLETE;
+	}
+
+	if (!P2PFrame::unpackHeader(&block->data[start], header))
+	{
+		return FRAME_MALFORMED;
+	}
+
+	// Wait for the rest of the payload
+	if (end - start - P2PFrame::HEADER_SIZE < header.length)
+	{
+		return FRAME_INCOMPLETE;
+	}
+
+	payload = &block->data[start + P2PFrame::HEADER_SIZE];
+	start += P2PFrame::HEADER_SIZE + header.length;
+
+	return FRAME_READY;
+}
+
+void P2PReceiveBuffer::trim()
+{
+	// Don't sit on a block sized for one big frame once it's been read
+	if (block != NULL && start == end && block->capacity > BLOCK_SIZE)
+	{
+		releaseBlock(block);
+		block = NULL;
+		start = 0;
+		end = 0;
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef P2PRECEIVEBUFFER_H
+#define P2PRECEIVEBUFFER_H
+
+using namespace std;
+
+/**
+ * Where one socket's incoming bytes land. Reads go straight into a block
+ * big enough for the frame being received, and frames are parsed where
+ * they lie - a chunk's payload is handed on as a pointer into the block,
+ * with a reference that keeps the block alive until the consumer is done.
+ * When the block fills, the unfinished frame moves to a fresh one, or back
+ * to the start of this one if nothing else is holding it.
+ * Only touched by the event loop.
+ */
+class P2PReceiveBuffer
+{
+	private:
+		ReceiveBlock * block;
+		unsigned int start;
+		unsigned int end;
+
+		static ReceiveBlock * createBlock(unsigned int);
+		unsigned int getFrameSize();
+
+	public:
+		P2PReceiveBuffer();
+		~P2PReceiveBuffer();
+
+		char * prepareWrite(unsigned int &);
+		void commitWrite(unsigned int);
+		int nextFrame(P2PFrameHeader &, const char *&);
+		ReceiveBlock * shareBlock();
+		void trim();
+
+		static void releaseBlock(ReceiveBlock *);
+
+		// What nextFrame() found
+		static const int FRAME_READY = 0;
+		static const int FRAME_INCOMPLETE = 1;
+		static const int FRAME_MALFORMED = 2;
+
+		// Blocks are at least this big, and a read is only tried with this much room
+		static const unsigned int BLOCK_SIZE = 256 * 1024;
+		static const unsigned int MIN_READ_SIZE = 16 * 1024;
+};
+
+#endif
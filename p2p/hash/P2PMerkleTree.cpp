@@ -0,0 +1,183 @@
+/**
+ * Peer-to-peer Merkle tree class
+ */
+
+#include "P2PMerkleTree.hpp"
+
+void P2PMerkleTree::hashFiles(vector<FileItem> & files, P2PThreadPool * pool)
+{
+	PieceHashBatch batch;
+	pthread_mutex_init(&batch.mutex, NULL);
+	pthread_cond_init(&batch.finished, NULL);
+	batch.tasks_remaining = 0;
+
+	// Set aside room for every piece hash up front, so the workers can fill them in place
+	bool * b_failed = new bool[files.size()];
+	for (unsigned int i = 0; i < files.size(); i++)
+	{
+		FileItem & file_item = files[i];
+		unsigned int num_pieces = (file_item.chunk_size == 0) ? 0
+			: (file_item.size + file_item.chunk_size - 1) / file_item.chunk_size;
+		file_item.piece_hashes.assign(num_pieces * P2PSha256::DIGEST_SIZE, '\0');
+		b_failed[i] = false;
+	}
+
+	// Split each file into tasks of a few pieces each - small files are one task
+	for (unsigned int i = 0; i < files.size(); i++)
+	{
+		FileItem & file_item = files[i];
+		unsigned int num_pieces = file_item.piece_hashes.length() / P2PSha256::DIGEST_SIZE;
+		unsigned int pieces_per_task = max(1U, BYTES_PER_TASK / max(1U, file_item.chunk_size));
+
+		for (unsigned int first_piece = 0; first_piece < num_pieces; first_piece += pieces_per_task)
+		{
+			PieceHashTask * task = new PieceHashTask;
+			task->batch = &batch;
+			task->path = file_item.path;
+			task->size = file_item.size;
+			task->piece_size = file_item.chunk_size;
+			task->first_piece = first_piece;
+			task->num_pieces = min(pieces_per_task, num_pieces - first_piece);
+			task->output = &file_item.piece_hashes[first_piece * P2PSha256::DIGEST_SIZE];
+			task->b_failed = &b_failed[i];
+
+			pthread_mutex_lock(&batch.mutex);
+			batch.tasks_remaining++;
+			pthread_mutex_unlock(&batch.mutex);
+
+			if (!pool->submit(&P2PMerkleTree::hashPieces, (void *) task))
+			{
+				// No workers left - do it here instead
+				hashPieces((void *) task);
+			}
+		}
+	}
+
+	// Wait for the workers to finish every piece
+	pthread_mutex_lock(&batch.mutex);
+	while (batch.tasks_remaining > 0)
+	{
+		pthread_cond_wait(&batch.finished, &batch.mutex);
+	}
+	pthread_mutex_unlock(&batch.mutex);
+
+	// The root is cheap - one hash per pair of pieces
+	for (unsigned int i = 0; i < files.size(); i++)
+	{
+		if (b_failed[i])
+		{
+			// Share it unverified rather than not at all
+			cout << "Warning: could not hash \"" << files[i].name << "\"." << endl;
+			files[i].piece_hashes.clear();
+			files[i].hash.clear();
+			continue;
+		}
+
+		files[i].hash = P2PCommon::toHex(computeRoot(files[i].piece_hashes));
+	}
+
+	delete[] b_failed;
+	pthread_cond_destroy(&batch.finished);
+	pthread_mutex_destroy(&batch.mutex);
+}
+
+void P2PMerkleTree::hashPieces(void * arg)
+{
+	PieceHashTask * task = (PieceHashTask *) arg;
+
+	bool b_ok = false;
+	int file_descriptor = open(task->path.c_str(), O_RDONLY);
+	if (file_descriptor >= 0)
+	{
+		char * buffer = new char[task->piece_size];
+		b_ok = true;
+
+		for (unsigned int i = 0; i < task->num_pieces && b_ok; i++)
+		{
+			// Read the whole piece - the last one may be short
+			off_t offset = (off_t) (task->first_piece + i) * task->piece_size;
+			unsigned int piece_length = min((off_t) task->piece_size, (off_t) task->size - offset);
+			unsigned int bytes_read = 0;
+			while (bytes_read < piece_length)
+			{
+				ssize_t result = pread(file_descriptor, &buffer[bytes_read], piece_length - bytes_read, offset + bytes_read);
+				if (result < 0 && errno == EINTR) continue;
+				if (result <= 0) break;
+				bytes_read += result;
+			}
+
+			if (bytes_read < piece_length)
+			{
+				b_ok = false;
+				break;
+			}
+
+			string digest = P2PSha256::hash(buffer, piece_length);
+			memcpy(&task->output[i * P2PSha256::DIGEST_SIZE], digest.data(), P2PSha256::DIGEST_SIZE);
+		}
+
+		delete[] buffer;
+		close(file_descriptor);
+	}
+
+	// Report back - the last task out wakes the caller
+	pthread_mutex_lock(&task->batch->mutex);
+	if (!b_ok)
+	{
+		*task->b_failed = true;
+	}
+
+	if (--task->batch->tasks_remaining == 0)
+	{
+		pthread_cond_signal(&task->batch->finished);
+	}
+	pthread_mutex_unlock(&task->batch->mutex);
+
+	delete task;
+}
+
+string P2PMerkleTree::computeRoot(const string & piece_hashes)
+{
+	unsigned int num_nodes = piece_hashes.length() / P2PSha256::DIGEST_SIZE;
+	if (num_nodes == 0)
+	{
+		return P2PSha256::hash("", 0);
+	}
+
+	// Work up the tree a level at a time
+	string level = piece_hashes.substr(0, num_nodes * P2PSha256::DIGEST_SIZE);
+	while (num_nodes > 1)
+	{
+		string next_level;
+		for (unsigned int i = 0; i < num_nodes; i += 2)
+		{
+			if (i + 1 == num_nodes)
+			{
+				next_level.append(level, i * P2PSha256::DIGEST_SIZE, P2PSha256::DIGEST_SIZE);
+				break;
+			}
+
+			P2PSha256 sha;
+			sha.update("\x01", 1);
+			sha.update(&level[i * P2PSha256::DIGEST_SIZE], 2 * P2PSha256::DIGEST_SIZE);
+			next_level += sha.finish();
+		}
+
+		level.swap(next_level);
+		num_nodes = level.length() / P2PSha256::DIGEST_SIZE;
+	}
+
+	return level;
+}
+
+bool P2PMerkleTree::verifyPiece(const string & piece_hashes, unsigned int piece, const char * data, unsigned int length)
+{
+	// Pieces count from one, like chunks
+	size_t offset = (size_t) (piece - 1) * P2PSha256::DIGEST_SIZE;
+	if (piece < 1 || offset + P2PSha256::DIGEST_SIZE > piece_hashes.length())
+	{
+		return false;
+	}
+
+	return P2PSha256::hash(data, length).compare(0, P2PSha256::DIGEST_SIZE, piece_hashes, offset, P2PSha256::DIGEST_SIZE) == 0;
+}
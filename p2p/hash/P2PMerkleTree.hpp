@@ -0,0 +1,43 @@
+#ifndef P2PMERKLETREE_H
+#define P2PMERKLETREE_H
+
+using namespace std;
+
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t finished;
+	unsigned int tasks_remaining;
+} PieceHashBatch;
+
+typedef struct {
+	PieceHashBatch * batch;
+	string path;
+	unsigned int size;
+	unsigned int piece_size;
+	unsigned int first_piece;
+	unsigned int num_pieces;
+	char * output;
+	bool * b_failed;
+} PieceHashTask;
+
+/**
+ * Content hashes for files. Each piece (one chunk) is hashed with SHA-256,
+ * and the piece hashes are the leaves of a binary tree whose root names the
+ * file. Inner nodes hash a 0x01 byte and their two children; an odd node at
+ * the end of a level is carried up as-is.
+ */
+class P2PMerkleTree
+{
+	private:
+		static void hashPieces(void *);
+
+	public:
+		static void hashFiles(vector<FileItem> &, P2PThreadPool *);
+		static string computeRoot(const string &);
+		static bool verifyPiece(const string &, unsigned int, const char *, unsigned int);
+
+		// Bytes hashed per task, so small pieces are batched together
+		static const unsigned int BYTES_PER_TASK = 4 * 1024 * 1024;
+};
+
+#endif
@@ -0,0 +1,260 @@
+/**
+ * Peer-to-peer SHA-256 class
+ */
+
+#include "P2PSha256.hpp"
+
+pthread_once_t P2PSha256::init_once = PTHREAD_ONCE_INIT;
+void (*P2PSha256::compress_impl)(uint32_t *, const unsigned char *, size_t) = NULL;
+
+static const uint32_t SHA256_K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+P2PSha256::P2PSha256()
+{
+	pthread_once(&init_once, &P2PSha256::initialize);
+
+	state[0] = 0x6a09e667;
+	state[1] = 0xbb67ae85;
+	state[2] = 0x3c6ef372;
+	state[3] = 0xa54ff53a;
+	state[4] = 0x510e527f;
+	state[5] = 0x9b05688c;
+	state[6] = 0x1f83d9ab;
+	state[7] = 0x5be0cd19;
+
+	block_length = 0;
+	total_length = 0;
+}
+
+void P2PSha256::initialize()
+{
+	compress_impl = hasShaNi() ? &P2PSha256::compressShaNi : &P2PSha256::compressScalar;
+}
+
+bool P2PSha256::hasShaNi()
+{
+#ifdef P2P_HAVE_X86_SIMD
+	// The SHA extensions are reported in CPUID leaf 7, which __builtin_cpu_supports doesn't cover
+	unsigned int eax, ebx, ecx, edx;
+	__asm__ ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (0), "c" (0));
+	if (eax < 7)
+	{
+		return false;
+	}
+
+	__asm__ ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (7), "c" (0));
+	return (ebx & (1 << 29)) && __builtin_cpu_supports("sse4.1");
+#else
+	return false;
+#endif
+}
+
+string P2PSha256::describeImplementation()
+{
+	pthread_once(&init_once, &P2PSha256::initialize);
+	return (compress_impl == &P2PSha256::compressShaNi) ? "sha-ni" : "scalar";
+}
+
+void P2PSha256::update(const char * data, size_t length)
+{
+	const unsigned char * bytes = (const unsigned char *) data;
+	total_length += length;
+
+	// Top up a partial block first
+	if (block_length > 0)
+	{
+		size_t fill = min((size_t) (64 - block_length), length);
+		memcpy(&block[block_length], bytes, fill);
+		block_length += fill;
+		bytes += fill;
+		length -= fill;
+
+		if (block_length < 64)
+		{
+			return;
+		}
+
+		compress_impl(state, block, 1);
+		block_length = 0;
+	}
+
+	// Whole blocks straight from the caller's buffer
+	if (length >= 64)
+	{
+		compress_impl(state, bytes, length / 64);
+		bytes += (length / 64) * 64;
+		length %= 64;
+	}
+
+	memcpy(block, bytes, length);
+	block_length = length;
+}
+
+string P2PSha256::finish()
+{
+	// Pad with a one bit, zeros, then the length in bits
+	uint64_t bit_length = total_length * 8;
+	unsigned char padding[72];
+	memset(padding, 0, sizeof(padding));
+	padding[0] = 0x80;
+
+	size_t padding_length = (block_length < 56) ? (56 - block_length) : (120 - block_length);
+	for (int i = 0; i < 8; i++)
+	{
+		padding[padding_length + i] = (unsigned char) (bit_length >> (56 - 8 * i));
+	}
+	update((const char *) padding, padding_length + 8);
+
+	string digest(DIGEST_SIZE, '\0');
+	for (int i = 0; i < 8; i++)
+	{
+		uint32_t word = htonl(state[i]);
+		memcpy(&digest[i * 4], &word, 4);
+	}
+
+	return digest;
+}
+
+string P2PSha256::hash(const char * data, size_t length)
+{
+	P2PSha256 sha;
+	sha.update(data, length);
+	return sha.finish();
+}
+
+string P2PSha256::hash(const string & data)
+{
+	return hash(data.data(), data.length());
+}
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void P2PSha256::compressScalar(uint32_t * state, const unsigned char * data, size_t num_blocks)
+{
+	while (num_blocks--)
+	{
+		// Expand the message schedule
+		uint32_t w[64];
+		for (int t = 0; t < 16; t++)
+		{
+			w[t] = ((uint32_t) data[t * 4] << 24) | ((uint32_t) data[t * 4 + 1] << 16)
+				| ((uint32_t) data[t * 4 + 2] << 8) | (uint32_t) data[t * 4 + 3];
+		}
+
+		for (int t = 16; t < 64; t++)
+		{
+			uint32_t s0 = SHA256_ROTR(w[t - 15], 7) ^ SHA256_ROTR(w[t - 15], 18) ^ (w[t - 15] >> 3);
+			uint32_t s1 = SHA256_ROTR(w[t - 2], 17) ^ SHA256_ROTR(w[t - 2], 19) ^ (w[t - 2] >> 10);
+			w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+		}
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+		for (int t = 0; t < 64; t++)
+		{
+			uint32_t s1 = SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25);
+			uint32_t ch = (e & f) ^ (~e & g);
+			uint32_t temp1 = h + s1 + ch + SHA256_K[t] + w[t];
+			uint32_t s0 = SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22);
+			uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+			uint32_t temp2 = s0 + maj;
+
+			h = g;
+			g = f;
+			f = e;
+			e = d + temp1;
+			d = c;
+			c = b;
+			b = a;
+			a = temp1 + temp2;
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+
+		data += 64;
+	}
+}
+
+#undef SHA256_ROTR
+
+#ifdef P2P_HAVE_X86_SIMD
+
+__attribute__((target("sha,sse4.1")))
+void P2PSha256::compressShaNi(uint32_t * state, const unsigned char * data, size_t num_blocks)
+{
+	const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	// The instructions want the state as ABEF and CDGH
+	__m128i temp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xB1);
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1B);
+	__m128i state0 = _mm_alignr_epi8(temp, state1, 8);
+	state1 = _mm_blend_epi16(state1, temp, 0xF0);
+
+	while (num_blocks--)
+	{
+		__m128i abef_save = state0;
+		__m128i cdgh_save = state1;
+
+		__m128i words[4];
+		for (int i = 0; i < 4; i++)
+		{
+			words[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) &data[i * 16]), byte_swap);
+		}
+
+		// Four rounds at a time, expanding the schedule four words ahead
+		for (int i = 0; i < 16; i++)
+		{
+			__m128i message = _mm_add_epi32(words[i & 3], _mm_loadu_si128((const __m128i *) &SHA256_K[i * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+
+			if (i < 12)
+			{
+				__m128i next = _mm_sha256msg1_epu32(words[i & 3], words[(i + 1) & 3]);
+				next = _mm_add_epi32(next, _mm_alignr_epi8(words[(i + 3) & 3], words[(i + 2) & 3], 4));
+				words[i & 3] = _mm_sha256msg2_epu32(next, words[(i + 3) & 3]);
+			}
+
+			message = _mm_shuffle_epi32(message, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, message);
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+		data += 64;
+	}
+
+	// Back to ABCD and EFGH
+	temp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(temp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, temp, 8);
+
+	_mm_storeu_si128((__m128i *) &state[0], state0);
+	_mm_storeu_si128((__m128i *) &state[4], state1);
+}
+
+#else
+
+void P2PSha256::compressShaNi(uint32_t * state, const unsigned char * data, size_t num_blocks)
+{
+	compressScalar(state, data, num_blocks);
+}
+
+#endif
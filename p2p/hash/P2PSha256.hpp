@@ -0,0 +1,43 @@
+#ifndef P2PSHA256_H
+#define P2PSHA256_H
+
+#include <stdint.h>
+
+using namespace std;
+
+/**
+ * SHA-256 (FIPS 180-4). Uses the SHA extensions when the CPU has them,
+ * picked on first use like the checksums.
+ */
+class P2PSha256
+{
+	private:
+		uint32_t state[8];
+		unsigned char block[64];
+		unsigned int block_length;
+		uint64_t total_length;
+
+		static pthread_once_t init_once;
+		static void (*compress_impl)(uint32_t *, const unsigned char *, size_t);
+		static void initialize();
+
+	public:
+		P2PSha256();
+
+		void update(const char *, size_t);
+		string finish();
+
+		// Digest of a whole buffer, as 32 raw bytes
+		static string hash(const char *, size_t);
+		static string hash(const string &);
+
+		// Each block function, for comparison by the benchmark
+		static void compressScalar(uint32_t *, const unsigned char *, size_t);
+		static void compressShaNi(uint32_t *, const unsigned char *, size_t);
+		static bool hasShaNi();
+		static string describeImplementation();
+
+		static const unsigned int DIGEST_SIZE = 32;
+};
+
+#endif
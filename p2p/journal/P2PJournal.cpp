@@ -0,0 +1,415 @@
+/**
+ * Peer-to-peer append-only journal class
+ */
+
+#include "P2PJournal.hpp"
+
+P2PJournal::P2PJournal()
+{
+	log_descriptor = -1;
+	generation = 0;
+	log_bytes = 0;
+	appended_sequence = 0;
+	durable_sequence = 0;
+	b_failed = false;
+	b_stopping = false;
+	b_flush_thread_started = false;
+
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&pending_available, NULL);
+	pthread_cond_init(&records_durable, NULL);
+}
+
+P2PJournal::~P2PJournal()
+{
+	this->close();
+
+	pthread_cond_destroy(&records_durable);
+	pthread_cond_destroy(&pending_available);
+	pthread_mutex_destroy(&mutex);
+}
+
+bool P2PJournal::open(const string & log_directory, unsigned int log_generation)
+{
+	directory = log_directory;
+	if (!makeDirectory(directory) || !this->openLog(log_generation))
+	{
+		return false;
+	}
+
+	if (pthread_create(&flush_thread, NULL, &P2PJournal::startFlushThread, (void *) this) != 0)
+	{
+		perror("Error: could not start the journal flusher");
+		return false;
+	}
+
+	b_flush_thread_started = true;
+	return true;
+}
+
+void P2PJournal::close()
+{
+	// Let the flusher write out what's left, then stop it
+	pthread_mutex_lock(&mutex);
+	b_stopping = true;
+	pthread_cond_signal(&pending_available);
+	pthread_mutex_unlock(&mutex);
+
+	if (b_flush_thread_started)
+	{
+		pthread_join(flush_thread, NULL);
+		b_flush_thread_started = false;
+	}
+
+	if (log_descriptor >= 0)
+	{
+		::close(log_descriptor);
+		log_descriptor = -1;
+	}
+}
+
+unsigned long long P2PJournal::append(const string & record)
+{
+	// Frame the record with its length and checksum
+	string frame;
+	frame.reserve(FRAME_SIZE + record.length());
+	putNumber(frame, record.length());
+	putNumber(frame, P2PChecksum::compute(P2PChecksum::CRC32C, record.data(), record.length()));
+	frame += record;
+
+	pthread_mutex_lock(&mutex);
+	pending += frame;
+	log_bytes += frame.length();
+	unsigned long long sequence = ++appended_sequence;
+	pthread_cond_signal(&pending_available);
+	pthread_mutex_unlock(&mutex);
+
+	return sequence;
+}
+
+bool P2PJournal::waitUntilDurable(unsigned long long sequence)
+{
+	pthread_mutex_lock(&mutex);
+	while (durable_sequence < sequence && !b_failed && b_flush_thread_started)
+	{
+		pthread_cond_wait(&records_durable, &mutex);
+	}
+
+	bool b_durable = (durable_sequence >= sequence);
+	pthread_mutex_unlock(&mutex);
+
+	return b_durable;
+}
+
+bool P2PJournal::rotate()
+{
+	// Everything so far goes in the current log - the caller makes sure nothing is appended meanwhile
+	this->waitUntilDurable(this->getAppendedSequence());
+
+	pthread_mutex_lock(&mutex);
+	int old_descriptor = log_descriptor;
+	bool b_opened = this->openLog(generation + 1);
+	pthread_mutex_unlock(&mutex);
+
+	if (b_opened && old_descriptor >= 0)
+	{
+		::close(old_descriptor);
+	}
+
+	return b_opened;
+}
+
+unsigned int P2PJournal::getGeneration()
+{
+	pthread_mutex_lock(&mutex);
+	unsigned int current_generation = generation;
+	pthread_mutex_unlock(&mutex);
+
+	return current_generation;
+}
+
+unsigned long long P2PJournal::getLogBytes()
+{
+	pthread_mutex_lock(&mutex);
+	unsigned long long bytes = log_bytes;
+	pthread_mutex_unlock(&mutex);
+
+	return bytes;
+}
+
+unsigned long long P2PJournal::getAppendedSequence()
+{
+	pthread_mutex_lock(&mutex);
+	unsigned long long sequence = appended_sequence;
+	pthread_mutex_unlock(&mutex);
+
+	return sequence;
+}
+
+void * P2PJournal::startFlushThread(void * arg)
+{
+	P2PJournal * journal = (P2PJournal *) arg;
+	journal->runFlusher();
+	return NULL;
+}
+
+void P2PJournal::runFlusher()
+{
+	pthread_mutex_lock(&mutex);
+	while (true)
+	{
+		while (pending.empty() && !b_stopping)
+		{
+			pthread_cond_wait(&pending_available, &mutex);
+		}
+
+		if (pending.empty())
+		{
+			break;
+		}
+
+		// Take everything appended so far - appends carry on into a fresh buffer while this one is written
+		string batch;
+		batch.swap(pending);
+		unsigned long long sequence = appended_sequence;
+		int descriptor = log_descriptor;
+		pthread_mutex_unlock(&mutex);
+
+		bool b_written = true;
+		size_t written = 0;
+		while (written < batch.length() && b_written)
+		{
+			ssize_t result = write(descriptor, batch.data() + written, batch.length() - written);
+			if (result < 0 && errno != EINTR)
+			{
+				b_written = false;
+			}
+			else if (result > 0)
+			{
+				written += result;
+			}
+		}
+
+		// One sync for the whole batch
+		b_written = b_written && (fdatasync(descriptor) == 0);
+		if (!b_written)
+		{
+			perror("Error: could not write the journal");
+		}
+
+		pthread_mutex_lock(&mutex);
+		if (b_written)
+		{
+			durable_sequence = sequence;
+		}
+		else
+		{
+			b_failed = true;
+		}
+		pthread_cond_broadcast(&records_durable);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+bool P2PJournal::openLog(unsigned int log_generation)
+{
+	// A log already there belongs to some other run - never write after its records
+	string path = getLogPath(directory, log_generation);
+	int descriptor = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (descriptor < 0)
+	{
+		perror("Error: could not open the journal");
+		return false;
+	}
+
+	// Make sure the new log itself survives a crash, not just what's written to it
+	int directory_descriptor = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+	if (directory_descriptor >= 0)
+	{
+		fsync(directory_descriptor);
+		::close(directory_descriptor);
+	}
+
+	log_descriptor = descriptor;
+	generation = log_generation;
+	log_bytes = 0;
+
+	return true;
+}
+
+string P2PJournal::getLogPath(const string & log_directory, unsigned int log_generation)
+{
+	return log_directory + "/catalog.log." + to_string(log_generation);
+}
+
+void P2PJournal::findLogs(const string & log_directory, vector<unsigned int> & log_generations)
+{
+	log_generations.clear();
+	DIR * folder = opendir(log_directory.c_str());
+	if (folder == NULL)
+	{
+		return;
+	}
+
+	// Only the names getLogPath makes - not anything set aside
+	string prefix = "catalog.log.";
+	struct dirent * entry;
+	while ((entry = readdir(folder)) != NULL)
+	{
+		string name = entry->d_name;
+		if (name.length() <= prefix.length() || name.compare(0, prefix.length(), prefix) != 0 ||
+			name.find_first_not_of("0123456789", prefix.length()) != string::npos)
+		{
+			continue;
+		}
+
+		log_generations.push_back((unsigned int) strtoul(name.c_str() + prefix.length(), NULL, 10));
+	}
+	closedir(folder);
+
+	sort(log_generations.begin(), log_generations.end());
+}
+
+bool P2PJournal::makeDirectory(const string & path)
+{
+	// Each folder along the way
+	size_t position = 0;
+	while (position != string::npos)
+	{
+		position = path.find('/', position + 1);
+		string folder = path.substr(0, position);
+
+		struct stat s;
+		if (stat(folder.c_str(), &s) == 0 && (s.st_mode & S_IFDIR))
+		{
+			continue;
+		}
+
+		if (mkdir(folder.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0 && errno != EEXIST)
+		{
+			string message = "Error: could not create folder " + folder;
+			perror(message.c_str());
+			return false;
+		}
+	}
+
+	return true;
+}
+
+const char * P2PJournal::mapFile(const string & path, size_t & length)
+{
+	length = 0;
+	int descriptor = ::open(path.c_str(), O_RDONLY);
+	if (descriptor < 0)
+	{
+		return NULL;
+	}
+
+	struct stat s;
+	if (fstat(descriptor, &s) != 0 || s.st_size == 0)
+	{
+		::close(descriptor);
+		return NULL;
+	}
+
+	// Read straight through once - ask for it all up front
+	void * data = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, descriptor, 0);
+	::close(descriptor);
+	if (data == MAP_FAILED)
+	{
+		perror("Error: could not map the file");
+		return NULL;
+	}
+
+	madvise(data, s.st_size, MADV_SEQUENTIAL);
+	length = s.st_size;
+
+	return (const char *) data;
+}
+
+void P2PJournal::unmapFile(const char * data, size_t length)
+{
+	if (data != NULL)
+	{
+		munmap((void *) data, length);
+	}
+}
+
+RecordReader P2PJournal::makeReader(const char * data, size_t length)
+{
+	RecordReader reader;
+	reader.data = data;
+	reader.length = length;
+	reader.position = 0;
+	reader.b_valid = (data != NULL);
+
+	return reader;
+}
+
+bool P2PJournal::nextRecord(RecordReader & log, RecordReader & record)
+{
+	// A frame cut short, or one whose checksum is off, is where a crash stopped the log
+	if (log.position + FRAME_SIZE > log.length)
+	{
+		return false;
+	}
+
+	unsigned int length = readNumber(log);
+	unsigned int checksum = readNumber(log);
+	if (length > log.length - log.position
+		|| P2PChecksum::compute(P2PChecksum::CRC32C, log.data + log.position, length) != checksum)
+	{
+		log.b_valid = false;
+		return false;
+	}
+
+	record = makeReader(log.data + log.position, length);
+	log.position += length;
+
+	return true;
+}
+
+void P2PJournal::putNumber(string & record, unsigned int number)
+{
+	char bytes[4];
+	bytes[0] = number & 0xFF;
+	bytes[1] = (number >> 8) & 0xFF;
+	bytes[2] = (number >> 16) & 0xFF;
+	bytes[3] = (number >> 24) & 0xFF;
+	record.append(bytes, 4);
+}
+
+void P2PJournal::putString(string & record, const string & text)
+{
+	putNumber(record, text.length());
+	record += text;
+}
+
+unsigned int P2PJournal::readNumber(RecordReader & reader)
+{
+	if (!reader.b_valid || reader.position + 4 > reader.length)
+	{
+		reader.b_valid = false;
+		return 0;
+	}
+
+	const unsigned char * bytes = (const unsigned char *) reader.data + reader.position;
+	reader.position += 4;
+
+	return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((unsigned int) bytes[3] << 24);
+}
+
+string P2PJournal::readString(RecordReader & reader)
+{
+	unsigned int length = readNumber(reader);
+	if (!reader.b_valid || length > reader.length - reader.position)
+	{
+		reader.b_valid = false;
+		return "";
+	}
+
+	string text(reader.data + reader.position, length);
+	reader.position += length;
+
+	return text;
+}
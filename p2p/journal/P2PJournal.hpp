@@ -0,0 +1,88 @@
+#ifndef P2PJOURNAL_H
+#define P2PJOURNAL_H
+
+using namespace std;
+
+typedef struct {
+	const char * data;
+	size_t length;
+	size_t position;
+	bool b_valid;
+} RecordReader;
+
+/**
+ * An append-only log of records, for changes that have to outlive the
+ * process. Each record is framed by its length and a CRC32C, so a record
+ * torn by a crash is spotted and the log read up to it.
+ * Appends only copy the record into memory. A flusher thread writes out
+ * whatever has built up and syncs it in one go - while it waits on the
+ * disk, the next batch gathers - so any number of writers share each
+ * sync. A writer that needs its record on disk waits for it by sequence
+ * number.
+ * Logs are numbered by generation. Rotating starts the next one, so a
+ * snapshot taken at that point only needs the logs from then on. A log
+ * is only ever opened new - never appended to once reopened.
+ * Also has the helpers that read and write the records' fields.
+ * Guarded by its own mutex.
+ */
+class P2PJournal
+{
+	private:
+		string directory;
+		int log_descriptor;
+		unsigned int generation;
+		unsigned long long log_bytes;
+
+		// Records not yet handed to the flusher, and how far appends and syncs have got
+		string pending;
+		unsigned long long appended_sequence;
+		unsigned long long durable_sequence;
+		bool b_failed;
+		bool b_stopping;
+
+		pthread_t flush_thread;
+		bool b_flush_thread_started;
+		pthread_mutex_t mutex;
+		pthread_cond_t pending_available;
+		pthread_cond_t records_durable;
+
+		static void * startFlushThread(void *);
+		void runFlusher();
+		bool openLog(unsigned int);
+
+	public:
+		P2PJournal();
+		~P2PJournal();
+
+		bool open(const string &, unsigned int);
+		void close();
+
+		unsigned long long append(const string &);
+		bool waitUntilDurable(unsigned long long);
+		bool rotate();
+
+		unsigned int getGeneration();
+		unsigned long long getLogBytes();
+		unsigned long long getAppendedSequence();
+
+		static string getLogPath(const string &, unsigned int);
+		static void findLogs(const string &, vector<unsigned int> &);
+		static bool makeDirectory(const string &);
+
+		// Reading logs and snapshots straight out of memory
+		static const char * mapFile(const string &, size_t &);
+		static void unmapFile(const char *, size_t);
+		static RecordReader makeReader(const char *, size_t);
+		static bool nextRecord(RecordReader &, RecordReader &);
+
+		// Record fields - numbers are little-endian, strings are length-prefixed
+		static void putNumber(string &, unsigned int);
+		static void putString(string &, const string &);
+		static unsigned int readNumber(RecordReader &);
+		static string readString(RecordReader &);
+
+		// Bytes in each record's frame, ahead of the record - its length and checksum
+		static const unsigned int FRAME_SIZE = 8;
+};
+
+#endif
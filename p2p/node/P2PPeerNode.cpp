@@ -25,14 +25,29 @@ void P2PPeerNode::construct(int port, int max_connections_value)
 
 	// Define server limits
 	MAX_CONNECTIONS = max_connections_value;
-	BUFFER_SIZE = 513; // Size given in bytes
-	INCOMING_MESSAGE_SIZE = BUFFER_SIZE - 1;
-
-	// Keep track of the client sockets
-	sockets = new int[MAX_CONNECTIONS];
-
-	// Handle the buffer
-	buffer = new char[BUFFER_SIZE];
+	MAX_EVENTS = 64;
+	MAX_QUEUED_CHUNKS = 256; // Chunks waiting for a worker before reading stalls
+	NUM_SEND_WORKERS = 8; // File requests served at once
+	MAX_BAD_CHUNKS = 3; // Chunks failing verification before a peer is dropped
+	TIMER_INTERVAL_MS = 100; // Between checks for overdue requests, while downloading
+	TRACKER_RETRY_MS = 3000; // Between asking the server again for a download with no peers
+	CONNECT_TIMEOUT_MS = 5000; // Before giving up on a peer that hasn't accepted our connection
+	MAX_PEER_CONNECTIONS = 64; // Peers we keep a connection open to, before idle ones are closed to make room
+	PEER_IDLE_TIMEOUT_MS = 30000; // Before closing a peer connection no download is using
+
+	// The event loop and workers are created when the node is started
+	epoll_descriptor = -1;
+	wakeup_descriptor = -1;
+	timer_descriptor = -1;
+	events = new struct epoll_event[MAX_EVENTS];
+	resolver = NULL;
+	shard_ring = NULL;
+	connection_pool = NULL;
+	receive_pool = NULL;
+	send_pool = NULL;
+
+	// Messages for the program thread
+	message_queue = new P2PMessageQueue();
 
 	// Default bind offset
 	number_bind_tries = 1;
@@ -62,10 +77,83 @@ void P2PPeerNode::start()
  */
 void P2PPeerNode::initialize()
 {
-	// Ensure that all sockets are invalid to boot
-	for (int i = 0; i < MAX_CONNECTIONS; i++)
+	// Guard the socket map - it's read by the program threads
+	pthread_mutex_init(&socket_mutex, NULL);
+	pthread_mutex_init(&download_mutex, NULL);
+
+	// Make sure we're allowed to open as many descriptors as we accept connections
+	this->raiseDescriptorLimit();
+
+	// Create the event loop
+	epoll_descriptor = epoll_create1(0);
+	if (epoll_descriptor < 0)
+	{
+		perror("Error: could not create epoll instance");
+		exit(1);
+	}
+
+	// Other threads poke this descriptor to interrupt epoll_wait()
+	wakeup_descriptor = eventfd(0, EFD_NONBLOCK);
+	if (wakeup_descriptor < 0)
+	{
+		perror("Error: could not create eventfd");
+		exit(1);
+	}
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLET;
+	event.data.fd = wakeup_descriptor;
+	if (epoll_ctl(epoll_descriptor, EPOLL_CTL_ADD, wakeup_descriptor, &event) < 0)
+	{
+		perror("Error: could not register eventfd");
+		exit(1);
+	}
+
+	// Request timeouts are checked on this timer, armed only while downloading
+	timer_descriptor = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (timer_descriptor < 0)
+	{
+		perror("Error: could not create timerfd");
+		exit(1);
+	}
+
+	event.data.fd = timer_descriptor;
+	if (epoll_ctl(epoll_descriptor, EPOLL_CTL_ADD, timer_descriptor, &event) < 0)
+	{
+		perror("Error: could not register timerfd");
+		exit(1);
+	}
+
+	// Received chunks only wait on the disk, so it's safe to block the event loop when they back up.
+	// Uploads can wait on the network, so their queue must never block it.
+	receive_pool = new P2PThreadPool(P2PThreadPool::defaultThreadCount(), MAX_QUEUED_CHUNKS);
+	send_pool = new P2PThreadPool(NUM_SEND_WORKERS, 0);
+
+	// Host names are looked up off the event loop
+	resolver = new P2PResolver();
+	connection_pool = new P2PConnectionPool();
+	shard_ring = new P2PShardRing();
+}
+
+void P2PPeerNode::raiseDescriptorLimit()
+{
+	// The default soft limit (often 1024) would cap us well below MAX_CONNECTIONS
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+	{
+		return;
+	}
+
+	// Leave some room for files, the primary socket, epoll and eventfd
+	rlim_t wanted = MAX_CONNECTIONS + 64;
+	if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < wanted)
 	{
-		sockets[i] = 0;
+		limit.rlim_cur = (limit.rlim_max == RLIM_INFINITY) ? wanted : min(wanted, limit.rlim_max);
+		if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+		{
+			perror("Warning: could not raise the open file limit");
+		}
 	}
 }
 
@@ -118,13 +206,14 @@ void P2PPeerNode::openPrimarySocket()
 	// Set the public-facing port
 	public_port = PORT_NUMBER + port_offset;
 
-	P2PSocket a_socket;
-	a_socket.socket_id = primary_socket;
-	a_socket.type = "primary";
-	socket_vector.push_back(a_socket);
+	// Accept in a loop until EAGAIN, as required for edge-triggered events
+	fcntl(primary_socket, F_SETFL, fcntl(primary_socket, F_GETFL, 0) | O_NONBLOCK);
 
-	// Keep track of the last update to the sockets
-	gettimeofday(&sockets_last_modified, NULL);
+	if (!this->registerSocket(primary_socket, "primary", ""))
+	{
+		perror("Error: could not register primary socket");
+		exit(1);
+	}
 
 	cout << "Listening on port " << (PORT_NUMBER + port_offset) << endl;
 }
@@ -151,21 +240,20 @@ int P2PPeerNode::bindPrimarySocket(int socket, int offset)
 int P2PPeerNode::makeConnection(string name, string host, int port)
 {
 	struct sockaddr_in server_address;
-	struct hostent * server;
 
-	// Create the socket - use SOCK_STREAM for TCP, SOCK_DGRAM for UDP
-	int new_socket = socket(AF_INET, SOCK_STREAM, 0);
-	if (new_socket < 0)
+	// Find the server host
+	struct in_addr host_address;
+	if (resolver->resolve(host, host_address) != P2PResolver::RESULT_FOUND)
 	{
-		cout << "Error: could not open socket" << endl;
+		cout << "Error: could not find the host" << endl;
 		return -1;
 	}
 
-	// Find the server host
-	server = gethostbyname(host.c_str());
-	if (server == NULL)
+	// Create the socket - use SOCK_STREAM for TCP, SOCK_DGRAM for UDP
+	int new_socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (new_socket < 0)
 	{
-		cout << "Error: could not find the host" << endl;
+		cout << "Error: could not open socket" << endl;
 		return -1;
 	}
 
@@ -174,50 +262,316 @@ int P2PPeerNode::makeConnection(string name, string host, int port)
 
 	// Configure the socket information
 	server_address.sin_family = AF_INET;
-	memcpy(server->h_addr, &server_address.sin_addr.s_addr, server->h_length);
+	server_address.sin_addr = host_address;
 	server_address.sin_port = htons(port);
 
 	// Connect to the server
 	if (connect(new_socket, (struct sockaddr *) &server_address, sizeof(server_address)) < 0) 
 	{
 		perror("Error: could not connect to host");
+		close(new_socket);
+		return -1;
+	}
+
+	// From here on, writes are queued and finished by the event loop
+	fcntl(new_socket, F_SETFL, fcntl(new_socket, F_GETFL, 0) | O_NONBLOCK);
+
+	// Add the socket to the event loop
+	if (!this->registerSocket(new_socket, "server", name))
+	{
+		// Report connection denied
+		cout << "Reached maximum number of connections, can't add new one" << endl;
+		close(new_socket);
 		return -1;
 	}
 
-	// Add socket to open slot
-	for (int i = 0; i <= MAX_CONNECTIONS; i++) 
+	cout << "Connected to server on port " << port << endl;
+
+	return new_socket;
+}
+
+int P2PPeerNode::connectToTracker(unsigned int shard, string host, int port)
+{
+	// Files whose keys land on this shard are tracked by it from now on
+	int tracker_socket = this->makeConnection(getTrackerName(shard), host, port);
+	if (tracker_socket >= 0)
 	{
-		// If we reach the maximum number of clients, we've gone too far
-		// Can't make a new connection!
-		if (i == MAX_CONNECTIONS)
+		shard_ring->addShard(shard);
+	}
+
+	return tracker_socket;
+}
+
+unsigned int P2PPeerNode::getTrackerForFile(const FileItem & file_item)
+{
+	return shard_ring->getShardForFile(file_item);
+}
+
+string P2PPeerNode::getTrackerName(unsigned int shard)
+{
+	return "central_server_" + to_string(shard);
+}
+
+void P2PPeerNode::connectToPeer(unsigned int file_id, string address_pair)
+{
+	// Share the connection we already have to this peer, if there is one
+	int socket_id = connection_pool->getSocket(address_pair);
+	if (socket_id >= 0)
+	{
+		this->attachPeer(file_id, socket_id, address_pair);
+		return;
+	}
+
+	// Or ride along with one that's on its way
+	if (this->joinPendingConnection(file_id, address_pair))
+	{
+		return;
+	}
+
+	PendingConnection pending;
+	pending.file_ids.push_back(file_id);
+	pending.address = address_pair;
+	gettimeofday(&pending.started, NULL);
+
+	// Connect now if we know where the peer is, otherwise once the resolver finds out
+	vector<string> address = P2PCommon::parseAddress(address_pair);
+	struct in_addr host_address;
+	int result = resolver->lookup(address[0], host_address);
+	if (result == P2PResolver::RESULT_FOUND)
+	{
+		this->startConnection(pending, host_address);
+	}
+	else if (result == P2PResolver::RESULT_FAILED)
+	{
+		cout << "Error: could not find the host " << address[0] << endl;
+	}
+	else
+	{
+		resolving_connections.push_back(pending);
+		resolver->resolveAsync(address[0], &P2PPeerNode::hostResolved, (void *) this);
+	}
+}
+
+bool P2PPeerNode::joinPendingConnection(unsigned int file_id, string address_pair)
+{
+	vector<PendingConnection>::iterator iter;
+	for (iter = resolving_connections.begin(); iter != resolving_connections.end(); ++iter)
+	{
+		if ((*iter).address == address_pair)
 		{
-			// Report connection denied
-			cout << "Reached maximum number of connections, can't add new one" << endl;
-			close(new_socket);
-			return -1;
+			if (find((*iter).file_ids.begin(), (*iter).file_ids.end(), file_id) == (*iter).file_ids.end())
+			{
+				(*iter).file_ids.push_back(file_id);
+			}
+			return true;
 		}
+	}
 
-		// Skip all valid client sockets
-		if (sockets[i] != 0) continue;
+	bool b_joined = false;
 
-		// Add new socket
-		sockets[i] = new_socket;
+	pthread_mutex_lock(&socket_mutex);
+	map<int, PendingConnection>::iterator pending_iter;
+	for (pending_iter = pending_connections.begin(); pending_iter != pending_connections.end(); ++pending_iter)
+	{
+		vector<unsigned int> & file_ids = pending_iter->second.file_ids;
+		if (pending_iter->second.address == address_pair)
+		{
+			if (find(file_ids.begin(), file_ids.end(), file_id) == file_ids.end())
+			{
+				file_ids.push_back(file_id);
+			}
+			b_joined = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&socket_mutex);
 
-		P2PSocket a_socket;
-		a_socket.socket_id = new_socket;
-		a_socket.type = "server";
-		a_socket.name = name;
-		socket_vector.push_back(a_socket);
+	return b_joined;
+}
 
-		// Keep track of the last update to the sockets
-		gettimeofday(&sockets_last_modified, NULL);
+void P2PPeerNode::attachPeer(unsigned int file_id, int socket_id, string address_pair)
+{
+	// The download may have finished while we were connecting
+	P2PDownloadTarget * target = acquireDownloadTarget(file_id);
+	if (target == NULL)
+	{
+		return;
+	}
 
-		break;
+	// Open a stream for the file on the connection, and start it on its first window of chunks
+	if (target->getScheduler()->addPeer(socket_id, address_pair))
+	{
+		connection_pool->openStream(socket_id, file_id);
+		requestChunks(target, socket_id);
 	}
 
-	cout << "Connected to server on port " << port << endl;
+	target->release();
+}
 
-	return new_socket;
+void P2PPeerNode::hostResolved(void * arg)
+{
+	// The answer is in the resolver's cache - the event loop picks it up from there
+	P2PPeerNode * node = static_cast<P2PPeerNode *>(arg);
+	node->wakeEventLoop();
+}
+
+void P2PPeerNode::startResolvedConnections()
+{
+	vector<PendingConnection>::iterator iter = resolving_connections.begin();
+	while (iter != resolving_connections.end())
+	{
+		vector<string> address = P2PCommon::parseAddress((*iter).address);
+		struct in_addr host_address;
+		int result = resolver->lookup(address[0], host_address);
+		if (result == P2PResolver::RESULT_UNKNOWN)
+		{
+			iter++;
+			continue;
+		}
+
+		if (result == P2PResolver::RESULT_FOUND)
+		{
+			this->startConnection(*iter, host_address);
+		}
+		else
+		{
+			cout << "Error: could not find the host " << address[0] << endl;
+		}
+
+		iter = resolving_connections.erase(iter);
+	}
+}
+
+void P2PPeerNode::startConnection(PendingConnection pending, struct in_addr host_address)
+{
+	vector<string> address = P2PCommon::parseAddress(pending.address);
+
+	// Non-blocking, so the connection completes in the event loop instead of holding it up
+	int new_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (new_socket < 0)
+	{
+		cout << "Error: could not open socket" << endl;
+		return;
+	}
+
+	struct sockaddr_in peer_address;
+	memset((char *) &peer_address, 0, sizeof(peer_address));
+	peer_address.sin_family = AF_INET;
+	peer_address.sin_addr = host_address;
+	peer_address.sin_port = htons(stoi(address[1]));
+
+	// Make room if the pool is full, by dropping whichever peer we've gone longest without
+	if (connection_pool->countConnections() >= (unsigned int) MAX_PEER_CONNECTIONS)
+	{
+		int idle_socket = connection_pool->getLeastRecentlyUsed();
+		if (idle_socket >= 0)
+		{
+			closeSocket(idle_socket);
+		}
+	}
+
+	if (connect(new_socket, (struct sockaddr *) &peer_address, sizeof(peer_address)) < 0 && errno != EINPROGRESS)
+	{
+		perror("Error: could not connect to peer");
+		close(new_socket);
+		return;
+	}
+
+	// Writable means connected, or failed - either way we hear about it in the event loop
+	pthread_mutex_lock(&socket_mutex);
+	pending_connections[new_socket] = pending;
+	pthread_mutex_unlock(&socket_mutex);
+
+	if (!this->registerSocket(new_socket, "connecting", pending.address))
+	{
+		cout << "Reached maximum number of connections, can't add new one" << endl;
+
+		pthread_mutex_lock(&socket_mutex);
+		pending_connections.erase(new_socket);
+		pthread_mutex_unlock(&socket_mutex);
+
+		close(new_socket);
+	}
+}
+
+bool P2PPeerNode::isPendingConnection(int socket_id)
+{
+	pthread_mutex_lock(&socket_mutex);
+	bool b_pending = (pending_connections.find(socket_id) != pending_connections.end());
+	pthread_mutex_unlock(&socket_mutex);
+
+	return b_pending;
+}
+
+void P2PPeerNode::handleConnectionResult(int socket_id)
+{
+	pthread_mutex_lock(&socket_mutex);
+	PendingConnection pending = pending_connections[socket_id];
+	pending_connections.erase(socket_id);
+	pthread_mutex_unlock(&socket_mutex);
+
+	// Find out how the connection attempt went
+	int error = 0;
+	socklen_t error_length = sizeof(error);
+	if (getsockopt(socket_id, SOL_SOCKET, SO_ERROR, &error, &error_length) < 0 || error != 0)
+	{
+		cout << "Error: could not connect to peer " << pending.address << ": " << strerror(error) << endl;
+		closeSocket(socket_id);
+		return;
+	}
+
+	// It stays non-blocking - from now on, writable means its send queue can move
+	pthread_mutex_lock(&socket_mutex);
+	map<int, P2PSocket>::iterator iter = socket_map.find(socket_id);
+	if (iter != socket_map.end())
+	{
+		iter->second.type = "server";
+	}
+	pthread_mutex_unlock(&socket_mutex);
+
+	cout << "Connected to peer " << pending.address << endl;
+
+	// Every download that wanted this peer shares the connection - with none left, it just sits idle
+	connection_pool->addConnection(socket_id, pending.address);
+	vector<unsigned int>::iterator file_iter;
+	for (file_iter = pending.file_ids.begin(); file_iter != pending.file_ids.end(); ++file_iter)
+	{
+		this->attachPeer(*file_iter, socket_id, pending.address);
+	}
+
+	this->updateTransferTimer();
+}
+
+void P2PPeerNode::expireConnections()
+{
+	timeval now;
+	gettimeofday(&now, NULL);
+
+	// Give up on peers that haven't answered in time
+	vector<int> expired_sockets;
+	pthread_mutex_lock(&socket_mutex);
+	map<int, PendingConnection>::iterator iter = pending_connections.begin();
+	while (iter != pending_connections.end())
+	{
+		long elapsed_ms = (now.tv_sec - iter->second.started.tv_sec) * 1000 + (now.tv_usec - iter->second.started.tv_usec) / 1000;
+		if (elapsed_ms >= CONNECT_TIMEOUT_MS)
+		{
+			cout << "Error: timed out connecting to peer " << iter->second.address << endl;
+			expired_sockets.push_back(iter->first);
+			pending_connections.erase(iter++);
+		}
+		else
+		{
+			iter++;
+		}
+	}
+	pthread_mutex_unlock(&socket_mutex);
+
+	vector<int>::iterator socket_iter;
+	for (socket_iter = expired_sockets.begin(); socket_iter != expired_sockets.end(); ++socket_iter)
+	{
+		closeSocket(*socket_iter);
+	}
 }
 
 /*
@@ -235,372 +589,695 @@ bool P2PPeerNode::isConnection(string address, int port)
 }
 */
 
+bool P2PPeerNode::registerSocket(int socket_id, string type, string name)
+{
+	pthread_mutex_lock(&socket_mutex);
+
+	// Enforce the connection limit - the primary socket doesn't count against it
+	if (type != "primary" && (int) socket_map.size() > MAX_CONNECTIONS)
+	{
+		pthread_mutex_unlock(&socket_mutex);
+		return false;
+	}
+
+	// Register once - the event loop only hears about this socket when it's ready.
+	// Writable means its send queue can move again, or, while connecting, that it's done.
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	if (type != "primary")
+	{
+		event.events |= EPOLLOUT;
+	}
+	event.data.fd = socket_id;
+	if (epoll_ctl(epoll_descriptor, EPOLL_CTL_ADD, socket_id, &event) < 0)
+	{
+		pthread_mutex_unlock(&socket_mutex);
+		perror("Error: could not add socket to epoll");
+		return false;
+	}
+
+	P2PSocket a_socket;
+	a_socket.socket_id = socket_id;
+	a_socket.type = type;
+	a_socket.name = name;
+	socket_map[socket_id] = a_socket;
+
+	// Everything written to it goes through its queue
+	if (type != "primary")
+	{
+		send_queues[socket_id] = new P2PSendQueue(socket_id);
+	}
+
+	// Keep track of the last update to the sockets
+	gettimeofday(&sockets_last_modified, NULL);
+
+	pthread_mutex_unlock(&socket_mutex);
+	return true;
+}
+
+void P2PPeerNode::wakeEventLoop()
+{
+	uint64_t value = 1;
+	if (write(wakeup_descriptor, &value, sizeof(value)) < 0 && errno != EAGAIN)
+	{
+		perror("Error: could not wake the event loop");
+	}
+}
+
 void P2PPeerNode::queueSocketToClose(int socket_id)
 {
+	pthread_mutex_lock(&socket_mutex);
 	sockets_to_close.push_back(socket_id);
+	pthread_mutex_unlock(&socket_mutex);
+
+	// Let the event loop close it
+	this->wakeEventLoop();
 }
 
 void P2PPeerNode::queueSocketToCloseByName(string socket_name)
 {
-	P2PSocket socket = getSocketByName(socket_name);
-	sockets_to_close.push_back(socket.socket_id);
+	// Every socket with the name
+	pthread_mutex_lock(&socket_mutex);
+	map<int, P2PSocket>::iterator iter;
+	for (iter = socket_map.begin(); iter != socket_map.end(); ++iter)
+	{
+		if (iter->second.name == socket_name)
+		{
+			sockets_to_close.push_back(iter->first);
+		}
+	}
+	pthread_mutex_unlock(&socket_mutex);
+
+	// Let the event loop close them
+	this->wakeEventLoop();
 }
 
 void P2PPeerNode::closeSocketByName(string socket_name)
 {
-	// Remove the socket from the vector
-	vector<P2PSocket>::iterator iter;
-	for (iter = socket_vector.begin(); iter != socket_vector.end(); )
+	// Collect the matching sockets first, closeSocket modifies the map
+	vector<int> matching_sockets;
+
+	pthread_mutex_lock(&socket_mutex);
+	map<int, P2PSocket>::iterator iter;
+	for (iter = socket_map.begin(); iter != socket_map.end(); ++iter)
 	{
-		if (iter->name.compare(socket_name) == 0)
+		if (iter->second.name.compare(socket_name) == 0)
 		{
-			// Remove from the int array
-			for (int i = 0; i < MAX_CONNECTIONS; i++)
-			{
-				if (iter->socket_id == sockets[i])
-				{
-					sockets[i] = 0;
-					break;
-				}
-			}
-
-			iter = socket_vector.erase(iter);
-
-			// Close and free the socket
-			close(iter->socket_id);
+			matching_sockets.push_back(iter->first);
 		}
-		else
-			++iter;
 	}
+	pthread_mutex_unlock(&socket_mutex);
 
-	// Keep track of the last update to the sockets
-	gettimeofday(&sockets_last_modified, NULL);
+	vector<int>::iterator socket_iter;
+	for (socket_iter = matching_sockets.begin(); socket_iter != matching_sockets.end(); ++socket_iter)
+	{
+		closeSocket(*socket_iter);
+	}
 }
 
 void P2PPeerNode::closeSocket(int socket)
 {
-	// Remove the socket from the vector
-	vector<P2PSocket>::iterator iter;
-	for (iter = socket_vector.begin(); iter != socket_vector.end(); )
+	pthread_mutex_lock(&socket_mutex);
+
+	// Ignore sockets we don't own (e.g. already closed)
+	if (socket_map.erase(socket) == 0)
 	{
-		if (iter->socket_id == socket)
-			iter = socket_vector.erase(iter);
-		else
-			++iter;
+		pthread_mutex_unlock(&socket_mutex);
+		return;
 	}
 
+	// Drop any partial frame - chunks already handed on keep their part of the buffer
+	map<int, P2PReceiveBuffer *>::iterator buffer_iter = receive_buffers.find(socket);
+	if (buffer_iter != receive_buffers.end())
+	{
+		delete buffer_iter->second;
+		receive_buffers.erase(buffer_iter);
+	}
+	bad_chunk_counts.erase(socket);
+	pending_connections.erase(socket);
+	connection_pool->removeConnection(socket);
+
 	// Keep track of the last update to the sockets
 	gettimeofday(&sockets_last_modified, NULL);
 
-	// Remove from the int array
-	for (int i = 0; i < MAX_CONNECTIONS; i++)
+	// Stop writing to it - this waits out any write in progress, so the descriptor is safe to close
+	map<int, P2PSendQueue *>::iterator queue_iter = send_queues.find(socket);
+	if (queue_iter != send_queues.end())
 	{
-		if (socket == sockets[i])
-		{
-			sockets[i] = 0;
-			break;
-		}
+		queue_iter->second->close();
+		queue_iter->second->release();
+		send_queues.erase(queue_iter);
 	}
 
-	// Close and free the socket
+	// Stop listening for the socket, then close and free it
+	epoll_ctl(epoll_descriptor, EPOLL_CTL_DEL, socket, NULL);
 	close(socket);
+
+	pthread_mutex_unlock(&socket_mutex);
+
+	// Anything it was sending us goes to the other peers
+	this->dropPeerFromDownloads(socket);
+}
+
+void P2PPeerNode::dropPeerFromDownloads(int socket_id)
+{
+	vector<P2PDownloadTarget *> targets = acquireDownloadTargets();
+	vector<P2PDownloadTarget *>::iterator target_iter;
+	for (target_iter = targets.begin(); target_iter != targets.end(); ++target_iter)
+	{
+		if ((*target_iter)->getScheduler()->removePeer(socket_id))
+		{
+			requestChunksFromAll(*target_iter);
+		}
+
+		(*target_iter)->release();
+	}
 }
 
 /**
  * Handle Connection Activity
  */
 
-void P2PPeerNode::resetSocketDescriptors()
+void P2PPeerNode::closeQueuedSockets()
 {
-	// Determine if we have any sockets to close
-	while (sockets_to_close.size() > 0)
+	// Take the queue, so other threads can keep queueing while we close
+	pthread_mutex_lock(&socket_mutex);
+	vector<int> closing_sockets;
+	closing_sockets.swap(sockets_to_close);
+	pthread_mutex_unlock(&socket_mutex);
+
+	vector<int>::iterator iter;
+	for (iter = closing_sockets.begin(); iter != closing_sockets.end(); ++iter)
 	{
-		closeSocket(sockets_to_close.front());
-		sockets_to_close.erase(sockets_to_close.begin());
+		closeSocket(*iter);
 	}
+}
 
-	// Reset the current socket descriptors
-	FD_ZERO(&socket_descriptors);
-	FD_SET(primary_socket, &socket_descriptors);
+void P2PPeerNode::handleNewConnectionRequest()
+{
+	// Prepare the client address
+	struct sockaddr_in client_address;
+	socklen_t client_address_length = sizeof(client_address);
 
-	// Keep track of the maximum socket descriptor for select()
-	max_connection = primary_socket;
+	// Edge-triggered - accept everything that's pending
+	while (true)
+	{
+		// Accept a new socket
+		client_address_length = sizeof(client_address);
+		int new_socket = accept4(primary_socket, (struct sockaddr *)&client_address, &client_address_length, SOCK_NONBLOCK);
 
-	// Add remaining sockets
-	for (int i = 0; i < MAX_CONNECTIONS; i++)
+		// Validate the new socket
+		if (new_socket < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			{
+				return;
+			}
+
+			// Out of descriptors, or the peer gave up - not fatal to the node
+			perror("Error: failure to accept new socket");
+			return;
+		}
+
+		// Report new connection
+		//cout << "New Connection Request: " << inet_ntoa(client_address.sin_addr) << ":" << ntohs(client_address.sin_port) << endl;
+
+		// Add the socket to the event loop
+		if (!this->registerSocket(new_socket, "client", ""))
+		{
+			// Report connection denied
+			cout << "Reached maximum number of clients, denied connection request" << endl;
+
+			// Send refusal message to socket - it has no queue, but it's empty enough to take this
+			P2PFrame::sendMessage(new_socket, "Server is too busy, please try again later\r\n");
+
+			close(new_socket);
+		}
+	}
+}
+
+void P2PPeerNode::handleExistingConnection(int socket_id, bool b_hung_up)
+{
+	// Reads land straight in the socket's own buffer
+	P2PReceiveBuffer *& receive_buffer = receive_buffers[socket_id];
+	if (receive_buffer == NULL)
 	{
-		// Validate the socket
-		if (sockets[i] <= 0) continue;
+		receive_buffer = new P2PReceiveBuffer();
+	}
+	P2PReceiveBuffer * socket_buffer = receive_buffer;
 
-		// Add socket to set
-		FD_SET(sockets[i], &socket_descriptors);
+	// Edge-triggered - keep reading until the socket is drained
+	while (true)
+	{
+		// Read whatever has arrived, as much as there's room for - it may hold several frames, or part of one
+		unsigned int space;
+		char * write_space = socket_buffer->prepareWrite(space);
+		int message_size = recv(socket_id, write_space, space, MSG_DONTWAIT);
 
-		// Update the maximum socket descriptor
-		max_connection = max(max_connection, sockets[i]);
+		if (message_size < 0)
+		{
+			// Nothing left to read - wait for the next event
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				socket_buffer->trim();
+				return;
+			}
+			else if (errno == EINTR)
+			{
+				continue;
+			}
+
+			// Treat any other error as a closed connection
+			closeSocket(socket_id);
+			return;
+		}
+
+		// Handle a closed connection
+		if (message_size == 0)
+		{
+			// Report the disconnection
+			//struct sockaddr_in client_address = getClientAddressFromSocket(socket_id);
+			//cout << "Connection closed: " << inet_ntoa(client_address.sin_addr) << ":" << ntohs(client_address.sin_port) << endl;
+
+			// Close and free the socket
+			closeSocket(socket_id);
+			return;
+		}
+
+		// Hand off all complete frames
+		socket_buffer->commitWrite(message_size);
+		if (!this->handleIncomingData(socket_id, socket_buffer))
+		{
+			cout << "Error: malformed frame, closing connection" << endl;
+			closeSocket(socket_id);
+			return;
+		}
+
+		// The socket may have been closed while handling a frame
+		if (receive_buffers.find(socket_id) == receive_buffers.end())
+		{
+			return;
+		}
+
+		// A short read means the socket's drained, and the next edge brings more - unless the peer
+		// hung up, when the only way to find out is to read until it says so
+		if ((unsigned int) message_size < space && !b_hung_up)
+		{
+			socket_buffer->trim();
+			return;
+		}
 	}
 }
 
-void P2PPeerNode::handleNewConnectionRequest()
+bool P2PPeerNode::handleIncomingData(int socket_id, P2PReceiveBuffer * receive_buffer)
 {
-	// Prepare the client address
-	struct sockaddr_in client_address;
-	socklen_t client_address_length = sizeof(client_address);
+	// Handle every complete frame where it lies
+	P2PFrameHeader header;
+	const char * payload;
+	int result;
+	while ((result = receive_buffer->nextFrame(header, payload)) == P2PReceiveBuffer::FRAME_READY)
+	{
+		this->handleRequest(socket_id, header, payload, receive_buffer);
+
+		// The socket may have been closed while handling the frame
+		if (receive_buffers.find(socket_id) == receive_buffers.end())
+		{
+			return true;
+		}
+	}
 
-	// Accept a new socket
-	int new_socket = accept(primary_socket, (struct sockaddr *)&client_address, &client_address_length);
+	return result != P2PReceiveBuffer::FRAME_MALFORMED;
+}
 
-	// Validate the new socket
-	if (new_socket < 0)
+void P2PPeerNode::handleRequest(int socket_id, P2PFrameHeader header, const char * payload, P2PReceiveBuffer * receive_buffer)
+{
+	// Find out who sent this
+	pthread_mutex_lock(&socket_mutex);
+	map<int, P2PSocket>::iterator socket_iter = socket_map.find(socket_id);
+	if (socket_iter == socket_map.end())
 	{
-		perror("Error: failure to accept new socket");
-		exit(1);
+		pthread_mutex_unlock(&socket_mutex);
+		return;
+	}
+	P2PSocket socket = socket_iter->second;
+	pthread_mutex_unlock(&socket_mutex);
+
+	if (header.type == P2PFrame::TYPE_FILE_CHUNK)
+	{
+		// Ignore chunks for files we aren't downloading
+		P2PDownloadTarget * target = acquireDownloadTarget(header.file_id);
+		if (target == NULL)
+		{
+			return;
+		}
+
+		// Pack the data neatly for travel - the payload stays where it was read, and the thread
+		// lets go of it and frees the packet
+		FileDataPacket * packet = new FileDataPacket;
+		packet->node = this;
+		packet->socket_id = socket_id;
+		packet->target = target;
+		packet->header = header;
+		packet->payload = payload;
+		packet->block = receive_buffer->shareBlock();
+
+		// Hand it to a worker
+		if (!receive_pool->submit(&P2PPeerNode::handleFileTransfer, (void *)packet))
+		{
+			target->release();
+			P2PReceiveBuffer::releaseBlock(packet->block);
+			delete packet;
+		}
+
+		return;
+	}
+
+	// Everything else is a text command
+	string message(payload, header.length);
+
+	// Parse the request
+	vector<string> request_parsed = P2PCommon::parseRequest(message);
+	if (request_parsed.size() == 0)
+	{
+		return;
 	}
 
-	// Report new connection
-	//cout << "New Connection Request: " << inet_ntoa(client_address.sin_addr) << ":" << ntohs(client_address.sin_port) << endl;
+	// Trim whitespace from the command
+	request_parsed[0] = P2PCommon::trimWhitespace(request_parsed[0]);
 
-	// Add socket to open slot
-	for (int i = 0; i <= MAX_CONNECTIONS; i++)
+	if (request_parsed[0].compare("fileRequest") == 0)
 	{
-		// If we reach the maximum number of clients, we've gone too far
-		// Can't accept a new connection!
-		if (i == MAX_CONNECTIONS)
+		// Straight from the peer - ignore anything short a field or with a field that isn't a number
+		unsigned int file_id, size, start, count, chunk_size;
+		if (request_parsed.size() < 7
+			|| !P2PCommon::parseNumber(request_parsed[1], file_id)
+			|| !P2PCommon::parseNumber(request_parsed[3], size)
+			|| !P2PCommon::parseNumber(request_parsed[4], start)
+			|| !P2PCommon::parseNumber(request_parsed[5], count)
+			|| !P2PCommon::parseNumber(request_parsed[6], chunk_size))
 		{
-			// Report connection denied
-			cout << "Reached maximum number of clients, denied connection request" << endl;
+			cout << "Error: received a malformed file request." << endl;
+			return;
+		}
+
+		string name = P2PCommon::trimWhitespace(request_parsed[2]);
+		chunk_size = P2PFileTransfer::clampChunkSize(chunk_size);
+		string hash = (request_parsed.size() > 7) ? P2PCommon::trimWhitespace(request_parsed[7]) : "";
+
+		// Chunks go out through the socket's queue
+		P2PSendQueue * queue = acquireSendQueue(socket_id);
+		if (queue == NULL)
+		{
+			return;
+		}
+
+		// Prepare the request - the worker frees it
+		FileDataRequest * request = new FileDataRequest;
+		request->node = this;
+		request->queue = queue;
+		request->transfer = NULL;
+		request->socket_id = socket_id;
+		request->start = start;
+		request->count = count;
+
+		// The same bytes may be shared here under another name, so look for the content first
+		request->file_item = (hash.length() > 0) ? getLocalFileItemByHash(hash) : FileItem();
+		if (request->file_item.path.length() == 0)
+		{
+			request->file_item = getLocalFileItem(name, size);
+		}
+
+		// Set the file ID and chunk size
+		request->file_item.file_id = file_id;
+		request->file_item.chunk_size = chunk_size;
 
-			// Send refusal message to socket
-			string message = "Server is too busy, please try again later\r\n";
-			write(new_socket, message.c_str(), message.length());
+		// Hand it to a worker
+		if (!send_pool->submit(&P2PPeerNode::initiateFileTransfer, (void *)request))
+		{
+			queue->release();
+			delete request;
+		}
+	}
+	else if (request_parsed[0].compare("fileAddress") == 0)
+	{
+		prepareFileTransferRequest(request_parsed);
+	}
+	else if (socket.type.compare("server") == 0)
+	{
+		this->enqueueMessage(socket_id, message);
+	}
+	else if (socket.type.compare("client") == 0)
+	{
+		this->enqueueMessage(socket_id, message);
+	}
+}
+
+void P2PPeerNode::listenForActivity()
+{
+	while (true) 
+	{
+		// Wait for activity - only ready sockets are reported
+		int num_events = epoll_wait(epoll_descriptor, events, MAX_EVENTS, -1);
+
+		// Validate the activity
+		if (num_events < 0)
+		{
+			if (errno == EINTR) continue;
+
+			perror("Error: epoll_wait failed");
+			exit(1);
+		}
+
+		for (int i = 0; i < num_events; i++)
+		{
+			int socket_id = events[i].data.fd;
+
+			if (socket_id == wakeup_descriptor)
+			{
+				// Drain the counter - the work itself is done below
+				uint64_t value;
+				while (read(wakeup_descriptor, &value, sizeof(value)) > 0);
+			}
+			else if (socket_id == timer_descriptor)
+			{
+				this->handleTransferTimer();
+			}
+			else if (this->isPendingConnection(socket_id))
+			{
+				// A peer we're connecting to - see if it worked
+				this->handleConnectionResult(socket_id);
+			}
+			else if (socket_id == primary_socket)
+			{
+				// Anything on the primary socket is a new connection
+				this->handleNewConnectionRequest();
+			}
+			else
+			{
+				// Perform any open activities on this client
+				if (events[i].events & ~EPOLLOUT)
+				{
+					this->handleExistingConnection(socket_id, (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0);
+				}
 
-			close(new_socket);
-			break;
+				// Carry on writing to it, now that it has room
+				if (events[i].events & EPOLLOUT)
+				{
+					this->flushSendQueue(socket_id);
+				}
+			}
 		}
 
-		// Skip all valid client sockets
-		if (sockets[i] != 0) continue;
+		// Connect to peers whose addresses just came back
+		this->startResolvedConnections();
 
-		// Add new socket
-		sockets[i] = new_socket;
+		// Finish any downloads whose last chunk just landed
+		this->finishCompletedDownloads();
 
-		P2PSocket a_socket;
-		a_socket.socket_id = new_socket;
-		a_socket.type = "client";
-		a_socket.name = "";
-		socket_vector.push_back(a_socket);
+		// Determine if we have any sockets to close
+		this->closeQueuedSockets();
+	}
+}
 
-		// Keep track of the last update to the sockets
-		gettimeofday(&sockets_last_modified, NULL);
+void P2PPeerNode::queueCompletedDownload(unsigned int file_id)
+{
+	pthread_mutex_lock(&download_mutex);
+	completed_downloads.push_back(file_id);
+	pthread_mutex_unlock(&download_mutex);
 
-		break;
-	}
+	// Let the event loop finish it
+	this->wakeEventLoop();
 }
 
-void P2PPeerNode::handleExistingConnections()
+void P2PPeerNode::finishCompletedDownloads()
 {
-	// Prepare the client address
-	struct sockaddr_in client_address;
-	socklen_t client_address_length = sizeof(client_address);
+	// Take the queue, so workers can keep queueing while we finish
+	pthread_mutex_lock(&download_mutex);
+	vector<unsigned int> finished_downloads;
+	finished_downloads.swap(completed_downloads);
+	pthread_mutex_unlock(&download_mutex);
 
-	// Iterate over all clients
-	for (int i = 0; i < MAX_CONNECTIONS; i++) 
+	if (finished_downloads.empty())
 	{
-		if (!FD_ISSET(sockets[i], &socket_descriptors)) continue;
-
-		// Clear out the buffer
-		memset(&buffer[0], 0, BUFFER_SIZE);
+		return;
+	}
 
-		// Read the incoming message into the buffer
-		int message_size = read(sockets[i], buffer, INCOMING_MESSAGE_SIZE);
+	P2PFileTransfer file_transfer;
+	vector<unsigned int>::iterator file_iter;
+	for (file_iter = finished_downloads.begin(); file_iter != finished_downloads.end(); ++file_iter)
+	{
+		unsigned int file_id = *file_iter;
 
-		// Handle a closed connection
-		if (message_size == 0)
+		// Stop writing to the file - late chunks are ignored
+		pthread_mutex_lock(&download_mutex);
+		P2PDownloadTarget * target = NULL;
+		map<unsigned int, P2PDownloadTarget *>::iterator target_iter = download_targets.find(file_id);
+		if (target_iter != download_targets.end())
 		{
-			// Report the disconnection
-			getpeername(sockets[i], (struct sockaddr*)&client_address, &client_address_length);
-			//cout << "Connection closed: " << inet_ntoa(client_address.sin_addr) << ":" << ntohs(client_address.sin_port) << endl;
-
-			// Close and free the socket
-			//queueSocketToClose(sockets[i]);
-			closeSocket(sockets[i]);
+			target = target_iter->second;
+			download_targets.erase(target_iter);
 		}
-		else
+		pthread_mutex_unlock(&download_mutex);
+
+		if (target == NULL)
 		{
-			// Make a copy of the vector to avoid concurrency issues
-			vector<P2PSocket> socket_vector_copy;
-			socket_vector_copy = socket_vector;
+			continue;
+		}
 
-			// Remove the socket from the vector
-			vector<P2PSocket>::iterator iter;
-			for (iter = socket_vector_copy.begin(); iter != socket_vector_copy.end(); ++iter)
+		// Give it its real name, then move it from the downloads list to the local list
+		vector<FileItem>::iterator iter;
+		for (iter = download_file_list.begin(); iter < download_file_list.end(); iter++)
+		{
+			if ((*iter).file_id != file_id)
 			{
-				if (iter->socket_id == sockets[i])
-				{
-					// Parse the request
-					vector<string> request_parsed = P2PCommon::parseRequest(buffer);
-
-					// Trim whitespace from the command
-					request_parsed[0] = P2PCommon::trimWhitespace(request_parsed[0]);
-
-					if (request_parsed[0].compare("fileTransfer") == 0)
-					{
-						// Get the File ID
-						vector<string> file_id_info = P2PCommon::splitString(request_parsed[1], ':');
-						vector<string> header_info = P2PCommon::splitString(request_parsed[1], '\t');
-						int file_id = stoi(P2PCommon::trimWhitespace(header_info[0]));
-
-						// Make a copy of the data
-						char * buffer_copy = new char[BUFFER_SIZE];
-						memcpy(buffer_copy, buffer, BUFFER_SIZE);
-
-						// Pack the data neatly for travel
-						FileDataPacket packet;
-						packet.file_item = getDownloadFileItem(file_id);
-						packet.packet = buffer_copy;
-
-						// Perform this as a separate thread
-						pthread_t thread;
-						if (pthread_create(&thread, NULL, &P2PPeerNode::handleFileTransfer, (void *)&packet) != 0)
-						{
-							perror("Error: could not spawn thread");
-							//exit(1);
-						}
-					}
-					//else if (request_parsed[0].compare("initiateFileTransfer") == 0)
-					else if (request_parsed[0].compare("fileRequest") == 0)
-					{
-						// Get the File ID
-						int file_id = stoi(P2PCommon::trimWhitespace(request_parsed[1]));
-						string name = P2PCommon::trimWhitespace(request_parsed[2]);
-						int size = stoi(P2PCommon::trimWhitespace(request_parsed[3]));
-						unsigned int start = stoi(P2PCommon::trimWhitespace(request_parsed[4]));
-						unsigned int count = stoi(P2PCommon::trimWhitespace(request_parsed[5]));
-
-						// Prepare the request
-						FileDataRequest request;
-						request.socket_id = iter->socket_id;
-						request.start = start;
-						request.count = count;
-						request.file_item = getLocalFileItem(name, size);
-
-						// Set the file ID
-						request.file_item.file_id = file_id;
-
-						// Perform this as a separate thread
-						pthread_t thread;
-						if (pthread_create(&thread, NULL, &P2PPeerNode::initiateFileTransfer, (void *)&request) != 0)
-						{
-							perror("Error: could not spawn thread");
-							//exit(1);
-						}
-
-						// Wait for the thread to obtain access to the data without freeing the memory
-						sleep(1);
-					}
-					else if (request_parsed[0].compare("fileAddress") == 0)
-					{
-						prepareFileTransferRequest(request_parsed);
-					}
-					else if (iter->type.compare("server") == 0)
-					{
-						this->enqueueMessage(sockets[i], buffer);
-					}
-					else if (iter->type.compare("client") == 0)
-					{
-						this->enqueueMessage(sockets[i], buffer);
-					}
-				}
+				continue;
 			}
+
+			(*iter).completed = file_transfer.compileFileParts(*iter, target);
+
+			FileItem copy_file_item;
+			copy_file_item.file_id = (*iter).file_id;
+			copy_file_item.name = (*iter).name;
+			copy_file_item.size = (*iter).size;
+			copy_file_item.path = (*iter).path; // This was updated when the pieces were put together
+			copy_file_item.chunk_size = (*iter).chunk_size;
+			copy_file_item.hash = (*iter).hash;
+			copy_file_item.piece_hashes = (*iter).piece_hashes;
+
+			// Make sure to register newly finished files with the server
+			local_file_list.push_back(copy_file_item);
+			addFileToServer(*iter);
+			download_file_list.erase(iter);
+			break;
+		}
+
+		// Close its streams - the connections stay open for the next download from those peers
+		vector<int> socket_ids = target->getScheduler()->getPeers();
+		vector<int>::iterator socket_iter;
+		for (socket_iter = socket_ids.begin(); socket_iter != socket_ids.end(); ++socket_iter)
+		{
+			connection_pool->closeStream(*socket_iter, file_id);
 		}
+
+		target->release();
+		download_idle_time.erase(file_id);
 	}
+
+	this->updateTransferTimer();
 }
 
-void P2PPeerNode::listenForActivity()
+void P2PPeerNode::handleTransferTimer()
 {
-	while (true) 
+	// Drain the expirations - one sweep covers however many there were
+	uint64_t expirations;
+	while (read(timer_descriptor, &expirations, sizeof(expirations)) > 0);
+
+	// Hand out again anything a peer has sat on for too long, and stop waiting on peers that won't answer
+	this->expireRequests();
+	this->expireConnections();
+
+	// Let go of peers we haven't needed in a while
+	vector<int> idle_sockets = connection_pool->getIdleSockets(PEER_IDLE_TIMEOUT_MS);
+	vector<int>::iterator socket_iter;
+	for (socket_iter = idle_sockets.begin(); socket_iter != idle_sockets.end(); ++socket_iter)
 	{
-		// Ready the socket descriptors
-		this->resetSocketDescriptors();
-  
-		// Wait for activity
-		int activity = select(max_connection + 1, &socket_descriptors, NULL, NULL, NULL);
+		closeSocket(*socket_iter);
+	}
 
-		// Validate the activity
-		if ((activity < 0) && (errno!=EINTR))
+	// With nothing downloading, the timer is only kept for idle connections - stop it once they're gone
+	if (download_file_list.empty() && connection_pool->countConnections() == 0)
+	{
+		this->updateTransferTimer();
+	}
+
+	// Slow peers are handled above - only a download with nobody left to ask needs the server
+	vector<FileItem>::iterator iter;
+	for (iter = download_file_list.begin(); iter < download_file_list.end(); iter++)
+	{
+		P2PDownloadTarget * target = acquireDownloadTarget((*iter).file_id);
+		bool b_has_peers = (target != NULL && target->getScheduler()->countPeers() > 0);
+		if (target != NULL)
 		{
-			perror("Error: select failed");
-			exit(1);
+			target->release();
 		}
 
-		// Anything on the primary socket is a new connection
-		if (FD_ISSET(primary_socket, &socket_descriptors))
+		if (b_has_peers)
 		{
-			this->handleNewConnectionRequest();
+			download_idle_time.erase((*iter).file_id);
+		}
+		else if ((download_idle_time[(*iter).file_id] += TIMER_INTERVAL_MS) >= TRACKER_RETRY_MS)
+		{
+			sendMessageToSocketName(getTrackerName(P2PShardRing::getShardOfFileId((*iter).file_id)), "getFile\r\n" + to_string((*iter).file_id));
+			download_idle_time[(*iter).file_id] = 0;
 		}
-
-		// Perform any open activities on all other clients
-		this->handleExistingConnections();
 	}
 }
 
-void P2PPeerNode::monitorTransfers()
+void P2PPeerNode::updateTransferTimer()
 {
-	P2PFileTransfer file_transfer;
-	map<int, int> file_to_missing_piece;
-
-	while (true)
+	// Tick while anything is downloading or any peer connection is open, and stay quiet otherwise
+	struct itimerspec timer;
+	memset(&timer, 0, sizeof(timer));
+	if (!download_file_list.empty() || connection_pool->countConnections() > 0)
 	{
-		// Give it a rest
-		sleep(3);
+		timer.it_interval.tv_sec = TIMER_INTERVAL_MS / 1000;
+		timer.it_interval.tv_nsec = (TIMER_INTERVAL_MS % 1000) * 1000000;
+		timer.it_value = timer.it_interval;
+	}
 
-		// Check to see how file transfers are doing.
-		// If any get stuck, make a request to download more parts.	
-		file_transfer.reviewTransfers(download_file_list);
+	if (timerfd_settime(timer_descriptor, 0, &timer, NULL) != 0)
+	{
+		perror("Error: could not set the transfer timer");
+	}
+}
 
-		// If any are newly completed, remove them from the list
-		vector<FileItem>::iterator iter;
-		for (iter = download_file_list.begin(); iter < download_file_list.end(); )
+void P2PPeerNode::expireRequests()
+{
+	vector<P2PDownloadTarget *> targets = acquireDownloadTargets();
+	vector<P2PDownloadTarget *>::iterator iter;
+	for (iter = targets.begin(); iter != targets.end(); ++iter)
+	{
+		P2PPieceScheduler * scheduler = (*iter)->getScheduler();
+		vector<int> slow_peers;
+		if (scheduler->expireRequests(slow_peers) > 0)
 		{
-			// Make sure to register newly finished files with the server
-			// Also remove from the downloads list, add to the local list
-			if ((*iter).completed)
-			{
-				FileItem copy_file_item;
-				copy_file_item.file_id = (*iter).file_id;
-				copy_file_item.name = (*iter).name;
-				copy_file_item.size = (*iter).size;
-				copy_file_item.path = (*iter).path; // This was updated when the pieces were put together
-
-				local_file_list.push_back(copy_file_item);
-				addFileToServer(*iter);
-				iter = download_file_list.erase(iter);
-
-				// Also disconnect when we're done
-				queueSocketToCloseByName(to_string(copy_file_item.file_id));
-			}
-			else if ((*iter).missing_pieces.size() > 0 && !file_to_missing_piece[(*iter).file_id])
+			// Give up on peers that keep letting requests lapse
+			vector<int>::iterator peer_iter;
+			for (peer_iter = slow_peers.begin(); peer_iter != slow_peers.end(); ++peer_iter)
 			{
-				// We have missing pieces, but this is the first time we've noticed it
-				// So, keep track of the file with missing pieces, and compare the next go-around
-				file_to_missing_piece[(*iter).file_id] = (*iter).missing_pieces[0];
-				iter++;
+				cout << "Error: dropping a peer that stopped sending \"" << (*iter)->getName() << "\"." << endl;
+				scheduler->removePeer(*peer_iter);
+				queueSocketToClose(*peer_iter);
 			}
-			else if ((*iter).missing_pieces.size() > 0 
-				&& file_to_missing_piece[(*iter).file_id] == (*iter).missing_pieces[0])
-			{
-				// We have missing pieces that have persisted - time to send a new request
-				//queueSocketToCloseByName(to_string((*iter).file_id));
-				sendMessageToSocketName("central_server", "getFile\r\n" + to_string((*iter).file_id));
 
-				file_to_missing_piece[(*iter).file_id] = 0;
-				//iter = download_file_list.erase(iter);
-				iter++;
-			}
+			requestChunksFromAll(*iter);
 		}
+
+		(*iter)->release();
 	}
 }
 
-
 void P2PPeerNode::addFileToServer(FileItem file_item)
 {
 	// Prepare the primary address
@@ -612,9 +1289,10 @@ void P2PPeerNode::addFileToServer(FileItem file_item)
 	string address = inet_ntoa(primary_address.sin_addr);
 
 	string add_files_message = "addFiles\r\n" + address + ":" + to_string(getPublicPort()) + "\r\n";
-	add_files_message += file_item.name + '\t' + to_string(file_item.size) + '\t' + file_item.path + "\r\n";
+	add_files_message += file_item.name + '\t' + to_string(file_item.size) + '\t' + file_item.path
+		+ '\t' + file_item.hash + '\t' + P2PCommon::toHex(file_item.piece_hashes) + "\r\n";
 
-	sendMessageToSocketName("central_server", add_files_message);
+	sendMessageToSocketName(getTrackerName(shard_ring->getShardForFile(file_item)), add_files_message);
 }
 
 /**
@@ -623,27 +1301,84 @@ void P2PPeerNode::addFileToServer(FileItem file_item)
 
 void P2PPeerNode::sendMessageToSocket(string request, int socket)
 {
-	// Write the message to the server socket
-	if (write(socket, request.c_str(), request.length()) < 0)
+	// Queue the message - a socket that can't take it is closed, not fatal
+	if (!this->queueMessage(socket, request))
 	{
-		perror("Error: could not send message to server");
-		exit(1);
+		cout << "Error: could not send message to socket" << endl;
+	}
+}
+
+bool P2PPeerNode::queueMessage(int socket_id, string message)
+{
+	P2PSendQueue * queue = acquireSendQueue(socket_id);
+	if (queue == NULL)
+	{
+		return false;
+	}
+
+	// Write what we can now - the event loop sends the rest when the socket has room
+	bool b_sent = queue->pushMessage(message) && queue->flush() != P2PSendQueue::FLUSH_FAILED;
+	queue->release();
+
+	if (!b_sent)
+	{
+		queueSocketToClose(socket_id);
+	}
+
+	return b_sent;
+}
+
+void P2PPeerNode::flushSendQueue(int socket_id)
+{
+	P2PSendQueue * queue = acquireSendQueue(socket_id);
+	if (queue == NULL)
+	{
+		return;
+	}
+
+	int result = queue->flush();
+	queue->release();
+
+	if (result == P2PSendQueue::FLUSH_FAILED)
+	{
+		closeSocket(socket_id);
+	}
+}
+
+P2PSendQueue * P2PPeerNode::acquireSendQueue(int socket_id)
+{
+	P2PSendQueue * queue = NULL;
+
+	// Hand out a reference, so the queue outlives the socket if it has to
+	pthread_mutex_lock(&socket_mutex);
+	map<int, P2PSendQueue *>::iterator iter = send_queues.find(socket_id);
+	if (iter != send_queues.end())
+	{
+		queue = iter->second;
+		queue->retain();
 	}
+	pthread_mutex_unlock(&socket_mutex);
+
+	return queue;
 }
 
-void P2PPeerNode::enqueueMessage(int client_socket, char* buffer)
+void P2PPeerNode::enqueueMessage(int client_socket, string request)
 {
 	P2PMessage message;
 	message.socket_id = client_socket;
-	message.message = string(buffer);
+	message.message = request;
 
-	// Push to the queue
-	message_queue.push_back(message);
+	// Push to the queue, and wake a reader
+	message_queue->push(message);
 }
 
 int P2PPeerNode::countSockets()
 {
-	return socket_vector.size();
+	pthread_mutex_lock(&socket_mutex);
+	int count = socket_map.size();
+	pthread_mutex_unlock(&socket_mutex);
+
+	return count;
 }
 
 timeval P2PPeerNode::getSocketsLastModified()
@@ -653,7 +1388,17 @@ timeval P2PPeerNode::getSocketsLastModified()
 
 vector<P2PSocket> P2PPeerNode::getSockets()
 {
-	return socket_vector;
+	vector<P2PSocket> sockets;
+
+	pthread_mutex_lock(&socket_mutex);
+	map<int, P2PSocket>::iterator iter;
+	for (iter = socket_map.begin(); iter != socket_map.end(); ++iter)
+	{
+		sockets.push_back(iter->second);
+	}
+	pthread_mutex_unlock(&socket_mutex);
+
+	return sockets;
 }
 
 struct sockaddr_in P2PPeerNode::getClientAddressFromSocket(int socket_id)
@@ -680,24 +1425,29 @@ int P2PPeerNode::getPublicPort()
 
 int P2PPeerNode::countQueueMessages()
 {
-	return message_queue.size();
+	return message_queue->size();
 }
 
 P2PMessage P2PPeerNode::popQueueMessage()
 {
 	// Validation
-	if (message_queue.size() <= 0)
+	P2PMessage message;
+	if (!message_queue->tryPop(message))
 	{
 		perror("Error: can't pop a message from an empty queue");
 		exit(1);
 	}
 
 	// Return a message
-	P2PMessage message = message_queue[0];
-	message_queue.erase(message_queue.begin());
 	return message;
 }
 
+bool P2PPeerNode::waitForQueueMessage(P2PMessage & message, int timeout_ms)
+{
+	// Sleeps until a message arrives, or the timeout passes
+	return message_queue->pop(message, timeout_ms);
+}
+
 string P2PPeerNode::getFileProgress()
 {
 	string progress;
@@ -720,37 +1470,20 @@ string P2PPeerNode::getFileProgress()
 
 string P2PPeerNode::analyzeFileProgress(FileItem file_item)
 {
-	// First, check to see if the file is finished downloading
-	DIR *directory;
-	struct dirent *ep;
-
-	// Open the directory
-	directory = opendir(P2PFileTransfer::DATA_FOLDER.c_str());
-	if (directory != NULL)
+	// Chunks are written straight into the download, which keeps count
+	P2PDownloadTarget * target = acquireDownloadTarget(file_item.file_id);
+	if (target != NULL)
 	{
-		// Get the expected number of parts
-		unsigned int size_downloaded = 0;
-
-		string filename = to_string(file_item.file_id) + ".pt.";
+		unsigned int size_downloaded = target->getBytesReceived();
+		unsigned int num_peers = target->getScheduler()->countPeers();
+		double throughput = target->getScheduler()->getThroughput();
+		target->release();
 
-		// See how many parts we have available
-		while ((ep = readdir(directory)) != NULL)
-		{
-			// Evaluate that each part is there
-			string this_filename = string(ep->d_name);
-			if (this_filename.compare(0, filename.length(), filename) == 0
-				&& this_filename.compare(this_filename.length() - 6, 6, ".p2pft") == 0)
-			{				
-				struct stat s;
-				string path = (P2PFileTransfer::DATA_FOLDER + '/' + this_filename);
-				if (stat(path.c_str(), &s) == 0 && (s.st_mode & S_IFREG))
-				{
-					size_downloaded += s.st_size;
-				}
-			}
-		}
+		char rate[32];
+		snprintf(rate, sizeof(rate), "%.1f", throughput / (1024 * 1024));
 
-		return to_string(size_downloaded) + " of " + to_string(file_item.size) + " bytes";
+		return to_string(size_downloaded) + " of " + to_string(file_item.size) + " bytes, from "
+			+ to_string(num_peers) + " peers at " + rate + " MiB/s";
 	}
 
 	return "Waiting for seeders...";
@@ -758,29 +1491,37 @@ string P2PPeerNode::analyzeFileProgress(FileItem file_item)
 
 bool P2PPeerNode::hasSocketByName(string name)
 {
-	vector<P2PSocket>::iterator iter;
-	for (iter = socket_vector.begin(); iter != socket_vector.end(); ++iter)
+	bool b_found = false;
+
+	pthread_mutex_lock(&socket_mutex);
+	map<int, P2PSocket>::iterator iter;
+	for (iter = socket_map.begin(); iter != socket_map.end(); ++iter)
 	{
-		if ((*iter).name == name)
+		if (iter->second.name == name)
 		{
-			return true;
+			b_found = true;
+			break;
 		}
 	}
+	pthread_mutex_unlock(&socket_mutex);
 
-	return false;
+	return b_found;
 }
 
 P2PSocket P2PPeerNode::getSocketByName(string name)
 {
 	P2PSocket socket;
-	vector<P2PSocket>::iterator iter;
-	for (iter = socket_vector.begin(); iter != socket_vector.end(); ++iter)
+
+	pthread_mutex_lock(&socket_mutex);
+	map<int, P2PSocket>::iterator iter;
+	for (iter = socket_map.begin(); iter != socket_map.end(); ++iter)
 	{
-		if ((*iter).name == name)
+		if (iter->second.name == name)
 		{
-			socket = (*iter);
+			socket = iter->second;
 		}
 	}
+	pthread_mutex_unlock(&socket_mutex);
 
 	return socket;
 }
@@ -795,139 +1536,299 @@ void P2PPeerNode::sendMessageToSocketName(string socket_name, string message)
 
 	// Get a socket by name
 	P2PSocket socket = getSocketByName(socket_name);
-	if (write(socket.socket_id, message.c_str(), message.length()) < 0)
-	{
-		perror("Error: could not send message to server");
-		exit(1);
-	}
+	sendMessageToSocket(message, socket.socket_id);
 }
 
 void P2PPeerNode::prepareFileTransferRequest(vector<string> request)
 {
-	prepareFileTransferRequest(request, 0, 0);
-}
-
-void P2PPeerNode::prepareFileTransferRequest(vector<string> request, int start, int count)
-{
-	// Trim any whitespace
-	string file_id = P2PCommon::trimWhitespace(request[1]);
-
 	// If the data came back invalid (possible race condition), just bail
-	if (file_id == "NULL")
+	if (request.size() < 2 || P2PCommon::trimWhitespace(request[1]) == "NULL")
+	{
+		return;
+	}
+
+	// Anything short a field, or with a field that isn't a number, can't be used either
+	unsigned int file_id, size, chunk_size;
+	if (request.size() < 7
+		|| !P2PCommon::parseNumber(request[1], file_id)
+		|| !P2PCommon::parseNumber(request[3], size)
+		|| !P2PCommon::parseNumber(request[4], chunk_size))
 	{
+		cout << "Error: received a malformed file address." << endl;
 		return;
 	}
 
 	// Convert the remaining data
 	string name = P2PCommon::trimWhitespace(request[2]);
-	int size = stoi(P2PCommon::trimWhitespace(request[3]));
-	string address_pair = P2PCommon::trimWhitespace(request[4]);
+	chunk_size = P2PFileTransfer::clampChunkSize(chunk_size);
+	string hash = P2PCommon::trimWhitespace(request[5]);
+	string piece_hashes = P2PCommon::fromHex(P2PCommon::trimWhitespace(request[6]));
+	string address_pair;
+
+	// The piece hashes must add up to the file's hash, one per chunk, or none of them can be trusted
+	if (hash.length() > 0)
+	{
+		if (piece_hashes.length() != P2PFileTransfer::countChunks(size, chunk_size) * P2PSha256::DIGEST_SIZE
+			|| P2PCommon::toHex(P2PMerkleTree::computeRoot(piece_hashes)) != hash)
+		{
+			cout << "Error: the piece hashes for \"" << name << "\" don't match the file's hash." << endl;
+			return;
+		}
+	}
+	else
+	{
+		cout << "Warning: \"" << name << "\" was shared without hashes, its pieces can't be verified." << endl;
+	}
 
 	// Push to our local cache, only if it's not already there
 	if (!hasDownloadFileItem(name, size))
 	{
-		// Keep a record of this file
+		// Keep a record of this file, using the chunk size the server proposed
 		FileItem file_item;
 		file_item.name = name;
 		file_item.size = size;
-		file_item.file_id = stoi(file_id);
+		file_item.chunk_size = chunk_size;
+		file_item.file_id = file_id;
+		file_item.hash = hash;
+		file_item.piece_hashes = piece_hashes;
+		file_item.completed = false;
+
+		// Set aside the space for the whole file before asking for any of it
+		P2PDownloadTarget * target = new P2PDownloadTarget(file_item);
+		if (!target->allocate())
+		{
+			target->release();
+			return;
+		}
+
+		pthread_mutex_lock(&download_mutex);
+		download_targets[file_item.file_id] = target;
+		pthread_mutex_unlock(&download_mutex);
 
 		download_file_list.push_back(file_item);
+		this->updateTransferTimer();
+
+		// An interrupted download may have had every chunk already
+		if (target->claimCompletion())
+		{
+			queueCompletedDownload(file_item.file_id);
+			return;
+		}
 	}
-	else
+
+	P2PDownloadTarget * target = acquireDownloadTarget(file_id);
+	if (target == NULL)
 	{
-		// Get the start and count from the missing pieces
-		FileItem file_item = getDownloadFileItem(name, size);
-		start = file_item.missing_pieces.front();
-		file_item.missing_pieces.erase(file_item.missing_pieces.begin());
-		count = file_item.missing_pieces.front();
-		file_item.missing_pieces.erase(file_item.missing_pieces.begin());
+		return;
 	}
 
-	// Estimate the number of chunks that will be needed
-	unsigned int num_chunks;
-	if (size % P2PFileTransfer::FILE_CHUNK_SIZE == 0)
-		num_chunks = size/P2PFileTransfer::FILE_CHUNK_SIZE;
-	else
-		num_chunks = size/P2PFileTransfer::FILE_CHUNK_SIZE + 1;
-
-	// Dole out the requests to each available address
-	int num_addresses = request.size() - 4;
-	int i = 0;
+	// We're asking again because the download stalled - anything outstanding isn't coming
+	P2PPieceScheduler * scheduler = target->getScheduler();
+	scheduler->abandonRequests();
 
+	int num_addresses = request.size() - 7;
 	cout << "Found " << num_addresses << " peers holding this file." << endl;
 
-	// Ensure that start is 1, minimum
-	if (start <= 0)
+	// Connect to every peer we aren't already downloading from at once - each starts on chunks as soon as it's connected
+	for (int i = 0; i < num_addresses; i++)
 	{
-		start = 1;
+		address_pair = P2PCommon::trimWhitespace(request[7+i]);
+
+		// Only a host and a port we could connect to
+		vector<string> address = P2PCommon::parseAddress(address_pair);
+		unsigned int port;
+		if (address.size() != 2 || address[0].length() == 0 || !P2PCommon::parseNumber(address[1], port) || port > 65535)
+		{
+			cout << "Error: received a malformed peer address." << endl;
+			continue;
+		}
+
+		if (!scheduler->hasPeer(address_pair))
+		{
+			connectToPeer(file_id, address_pair);
+		}
 	}
 
-	// Ensure that count has a valid value, and divide the count among the available peers
-	if (count <= 0)
+	// Peers still connected pick up what was abandoned
+	requestChunksFromAll(target);
+	target->release();
+}
+
+void P2PPeerNode::requestChunks(P2PDownloadTarget * target, int socket_id)
+{
+	// Find out what this peer should send next, if it's ready for more
+	vector<unsigned int> chunks;
+	if (!target->getScheduler()->assignChunks(socket_id, chunks))
 	{
-		count = num_chunks / num_addresses;
+		return;
 	}
-	else if (count > 0)
+
+	P2PSendQueue * queue = acquireSendQueue(socket_id);
+	if (queue == NULL)
 	{
-		count /= num_addresses;
+		return;
 	}
 
-	while (i < num_addresses)
+	// Ask for each run of consecutive chunks in one request - queued together, they go out in one write
+	bool b_sent = true;
+	unsigned int i = 0;
+	while (b_sent && i < chunks.size())
 	{
-		// Get the address pair
-		address_pair = P2PCommon::trimWhitespace(request[4+i]);
+		unsigned int count = 1;
+		while (i + count < chunks.size() && chunks[i + count] == chunks[i] + count)
+		{
+			count++;
+		}
 
-		// Parse the address
-		vector<string> address = P2PCommon::parseAddress(address_pair);
+		string file_transfer_request = composeFileRequest(target->getFileId(), target->getName(),
+			target->getSize(), target->getHash(), target->getChunkSize(), chunks[i], count);
+		b_sent = queue->pushMessage(file_transfer_request);
+
+		i += count;
+	}
 
-		// Make the connection
-		makeConnection(file_id, address[0], stoi(address[1]));
+	b_sent = b_sent && queue->flush() != P2PSendQueue::FLUSH_FAILED;
+	queue->release();
 
-		// Determine where we start and how many we dole out
-		start += i * count;
+	if (!b_sent)
+	{
+		// Its chunks go to the other peers once it's closed
+		queueSocketToClose(socket_id);
+	}
+}
 
-		// Send the file request
-		requestFileTransfer(file_id, stoi(file_id), name, size, start, count);
-	
-		// Move to the next address
-		i++;
+void P2PPeerNode::requestChunksFromAll(P2PDownloadTarget * target)
+{
+	vector<int> socket_ids = target->getScheduler()->getPeers();
+	vector<int>::iterator iter;
+	for (iter = socket_ids.begin(); iter != socket_ids.end(); ++iter)
+	{
+		requestChunks(target, *iter);
 	}
 }
 
-void P2PPeerNode::requestFileTransfer(string socket_name, int file_id, string name, int size, unsigned int start, unsigned int count)
+string P2PPeerNode::composeFileRequest(int file_id, string name, int size, string hash, unsigned int chunk_size, unsigned int start, unsigned int count)
 {
-	// Compose the file transfer request
-	string file_transfer_request = "fileRequest\r\n" + to_string(file_id)
+	// Compose the file transfer request - the hash lets the peer find the bytes under any name
+	return "fileRequest\r\n" + to_string(file_id)
 		+ "\r\n" + name + "\r\n" + to_string(size)
-		+ "\r\n" + to_string(start) + "\r\n" + to_string(count);
-	sendMessageToSocketName(socket_name, file_transfer_request);
+		+ "\r\n" + to_string(start) + "\r\n" + to_string(count)
+		+ "\r\n" + to_string(chunk_size) + "\r\n" + hash;
+}
+
+void P2PPeerNode::refetchChunk(P2PDownloadTarget * target, unsigned int chunk, int socket_id)
+{
+	// Nothing to ask for if the chunk number itself was bogus
+	if (chunk < 1 || chunk > target->getNumChunks())
+	{
+		return;
+	}
+
+	// Count it against the sender
+	pthread_mutex_lock(&socket_mutex);
+	int bad_chunks = ++bad_chunk_counts[socket_id];
+	pthread_mutex_unlock(&socket_mutex);
+
+	// The scheduler steers the chunk to another peer that has it, if there is one
+	P2PPieceScheduler * scheduler = target->getScheduler();
+	scheduler->chunkFailed(socket_id, chunk);
+
+	// Stop listening to a peer that keeps sending bad data
+	if (bad_chunks >= MAX_BAD_CHUNKS)
+	{
+		cout << "Error: dropping a peer that sent " << bad_chunks << " bad chunks of \"" << target->getName() << "\"." << endl;
+		scheduler->removePeer(socket_id);
+		queueSocketToClose(socket_id);
+	}
+
+	// Ask again - with no peers left, the monitor asks the server for more
+	requestChunksFromAll(target);
 }
 
-void * P2PPeerNode::initiateFileTransfer(void * arg)
+void P2PPeerNode::initiateFileTransfer(void * arg)
 {
 	// Revive the packet
 	FileDataRequest * request = static_cast<FileDataRequest *>(arg);
 
-	P2PFileTransfer file_transfer;
-	file_transfer.setBounds(request->start, request->count);
-	file_transfer.startTransferFile(request->file_item, request->socket_id);
+	request->transfer = new P2PFileTransfer;
+	request->transfer->setBounds(request->start, request->count);
+	if (!request->transfer->startTransferFile(request->file_item))
+	{
+		finishFileTransfer(request);
+		return;
+	}
+
+	continueFileTransfer(arg);
+}
+
+void P2PPeerNode::continueFileTransfer(void * arg)
+{
+	FileDataRequest * request = static_cast<FileDataRequest *>(arg);
+
+	// Send what the queue has room for - if the peer is slow to take it, the queue
+	// calls back when it's caught up, and this worker is free for other peers meanwhile
+	if (request->transfer->continueTransferFile(request->queue, &P2PPeerNode::resumeFileTransfer, arg))
+	{
+		return;
+	}
+
+	// Let the event loop close a socket we couldn't write to
+	if (request->queue->hasFailed())
+	{
+		request->node->queueSocketToClose(request->socket_id);
+	}
+
+	finishFileTransfer(request);
+}
+
+void P2PPeerNode::resumeFileTransfer(void * arg)
+{
+	FileDataRequest * request = static_cast<FileDataRequest *>(arg);
+
+	// Called by the queue as it flushes - the sending itself goes back to a worker
+	if (!request->node->send_pool->submit(&P2PPeerNode::continueFileTransfer, arg))
+	{
+		// Shutting down - make sure the queue is done with the file before it's closed
+		request->queue->close();
+		finishFileTransfer(request);
+	}
+}
 
-	// Finished - close the thread
-	pthread_exit(NULL);
+void P2PPeerNode::finishFileTransfer(FileDataRequest * request)
+{
+	delete request->transfer;
+	request->queue->release();
+	delete request;
 }
 
-void * P2PPeerNode::handleFileTransfer(void * arg)
+void P2PPeerNode::handleFileTransfer(void * arg)
 {
 	// Revive the packet
 	FileDataPacket * packet;
 	packet = (FileDataPacket *) arg;
 
+	// Ask again for anything that didn't check out, without waiting for the monitor to notice
 	P2PFileTransfer file_transfer;
-	file_transfer.handleIncomingFileTransfer(*packet);
+	if (!file_transfer.handleIncomingFileTransfer(*packet))
+	{
+		packet->node->refetchChunk(packet->target, packet->header.chunk, packet->socket_id);
+	}
+	else if (packet->target->claimCompletion())
+	{
+		// That was the last one - finish the download now, rather than when someone notices
+		packet->target->getScheduler()->chunkReceived(packet->socket_id, packet->header.chunk, packet->header.length);
+		packet->node->queueCompletedDownload(packet->target->getFileId());
+	}
+	else
+	{
+		// Give the peer its next batch if it's running low
+		packet->target->getScheduler()->chunkReceived(packet->socket_id, packet->header.chunk, packet->header.length);
+		packet->node->requestChunks(packet->target, packet->socket_id);
+	}
 
-	//delete[] (*packet).packet;
-	pthread_exit(NULL);
+	packet->target->release();
+	P2PReceiveBuffer::releaseBlock(packet->block);
+	delete packet;
 }
 
 void P2PPeerNode::addDownloadFileItems(vector<FileItem> files)
@@ -950,6 +1851,56 @@ FileItem P2PPeerNode::getDownloadFileItem(int file_id)
 	return getFileItem(download_file_list, file_id);
 }
 
+P2PDownloadTarget * P2PPeerNode::acquireDownloadTarget(unsigned int file_id)
+{
+	P2PDownloadTarget * target = NULL;
+
+	// Hand out a reference, so the target outlives the caller's use of it
+	pthread_mutex_lock(&download_mutex);
+	map<unsigned int, P2PDownloadTarget *>::iterator iter = download_targets.find(file_id);
+	if (iter != download_targets.end())
+	{
+		target = iter->second;
+		target->retain();
+	}
+	pthread_mutex_unlock(&download_mutex);
+
+	return target;
+}
+
+vector<P2PDownloadTarget *> P2PPeerNode::acquireDownloadTargets()
+{
+	vector<P2PDownloadTarget *> targets;
+
+	// Each one is retained - the caller releases them
+	pthread_mutex_lock(&download_mutex);
+	map<unsigned int, P2PDownloadTarget *>::iterator iter;
+	for (iter = download_targets.begin(); iter != download_targets.end(); ++iter)
+	{
+		iter->second->retain();
+		targets.push_back(iter->second);
+	}
+	pthread_mutex_unlock(&download_mutex);
+
+	return targets;
+}
+
+void P2PPeerNode::hashFileItems(vector<FileItem> & files)
+{
+	// One piece per chunk, with the chunk size the server will propose for it
+	vector<FileItem>::iterator iter;
+	for (iter = files.begin(); iter < files.end(); iter++)
+	{
+		(*iter).chunk_size = P2PFileTransfer::chooseChunkSize((*iter).size);
+	}
+
+	// A pool of its own - the event loop waits on the receive pool whenever it's full, so hashing
+	// there would hold up every transfer. Unbounded, since each task is only a file range to read.
+	P2PThreadPool * hash_pool = new P2PThreadPool(P2PThreadPool::defaultThreadCount(), 0);
+	P2PMerkleTree::hashFiles(files, hash_pool);
+	delete hash_pool;
+}
+
 void P2PPeerNode::addLocalFileItems(vector<FileItem> files)
 {
 	addFileItems(local_file_list, files);
@@ -965,6 +1916,22 @@ FileItem P2PPeerNode::getLocalFileItem(string name, int size)
 	return getFileItem(local_file_list, name, size);
 }
 
+FileItem P2PPeerNode::getLocalFileItemByHash(string hash)
+{
+	FileItem file_item;
+	vector<FileItem>::iterator iter;
+	for (iter = local_file_list.begin(); iter < local_file_list.end(); iter++)
+	{
+		if ((*iter).hash == hash)
+		{
+			file_item = (*iter);
+			break;
+		}
+	}
+
+	return file_item;
+}
+
 FileItem P2PPeerNode::getLocalFileItem(int file_id)
 {
 	return getFileItem(local_file_list, file_id);
@@ -2,24 +2,77 @@
 #define P2PPEERNODE_H
 
 #include "../common/P2PCommon.cpp"
+#include "../frame/P2PFrame.cpp"
+#include "../frame/P2PReceiveBuffer.cpp"
+#include "../checksum/P2PChecksum.cpp"
+#include "../threadpool/P2PThreadPool.cpp"
+#include "../resolver/P2PResolver.cpp"
+#include "../pool/P2PConnectionPool.cpp"
+#include "../cluster/P2PShardRing.cpp"
+#include "../hash/P2PSha256.cpp"
+#include "../hash/P2PMerkleTree.cpp"
+#include "../queue/P2PMessageQueue.cpp"
+#include "../queue/P2PSendQueue.cpp"
+#include "../filetransfer/P2PBitfield.cpp"
+#include "../scheduler/P2PPieceScheduler.cpp"
 #include "../filetransfer/P2PFileTransfer.cpp"
+#include "../filetransfer/P2PDownloadTarget.cpp"
 
 using namespace std;
 
+typedef struct {
+	vector<unsigned int> file_ids;
+	string address;
+	timeval started;
+} PendingConnection;
+
 class P2PPeerNode
 {
 	private:
 		void construct(int, int);
 		void initialize();
-		void resetSocketDescriptors();
+		void raiseDescriptorLimit();
+		void closeQueuedSockets();
 		void handleNewConnectionRequest();
-		void handleExistingConnections();
-		void handleRequest(int, char*);
-		void enqueueMessage(int, char*);
+		void handleExistingConnection(int, bool);
+		bool handleIncomingData(int, P2PReceiveBuffer *);
+		void handleRequest(int, P2PFrameHeader, const char *, P2PReceiveBuffer *);
+		void enqueueMessage(int, string);
+
+		// Event loop registration
+		bool registerSocket(int, string, string);
+		void wakeEventLoop();
+
+		// Writing to sockets
+		bool queueMessage(int, string);
+		void flushSendQueue(int);
+		P2PSendQueue * acquireSendQueue(int);
 
 		// Get File for transfer
 		void prepareFileTransferRequest(vector<string>);
-		void prepareFileTransferRequest(vector<string>, int, int);
+		string composeFileRequest(int, string, int, string, unsigned int, unsigned int, unsigned int);
+		void requestChunks(P2PDownloadTarget *, int);
+		void requestChunksFromAll(P2PDownloadTarget *);
+		void refetchChunk(P2PDownloadTarget *, unsigned int, int);
+		void dropPeerFromDownloads(int);
+		void expireRequests();
+
+		// Connecting to peers without holding up the event loop
+		void connectToPeer(unsigned int, string);
+		bool joinPendingConnection(unsigned int, string);
+		void attachPeer(unsigned int, int, string);
+		static void hostResolved(void *);
+		void startResolvedConnections();
+		void startConnection(PendingConnection, struct in_addr);
+		bool isPendingConnection(int);
+		void handleConnectionResult(int);
+		void expireConnections();
+
+		// Finishing downloads, and the timer that watches them
+		void queueCompletedDownload(unsigned int);
+		void finishCompletedDownloads();
+		void handleTransferTimer();
+		void updateTransferTimer();
 
 		// Stub functions
 		FileItem getFileItem(vector<FileItem>&, int);
@@ -29,10 +82,15 @@ class P2PPeerNode
 
 		FileItem getLocalFileItem(int);
 		FileItem getDownloadFileItem(int);
+		P2PDownloadTarget * acquireDownloadTarget(unsigned int);
+		vector<P2PDownloadTarget *> acquireDownloadTargets();
 
-		// Worker threads
-		static void * initiateFileTransfer(void *);
-		static void * handleFileTransfer(void *);
+		// Worker pool tasks
+		static void initiateFileTransfer(void *);
+		static void continueFileTransfer(void *);
+		static void resumeFileTransfer(void *);
+		static void finishFileTransfer(FileDataRequest *);
+		static void handleFileTransfer(void *);
 
 		// Own socket
 		void openPrimarySocket();
@@ -41,50 +99,93 @@ class P2PPeerNode
 		// Add a file to the server
 		void addFileToServer(FileItem);
 
+		// Trackers, one per shard of the catalog
+		P2PShardRing * shard_ring;
+		static string getTrackerName(unsigned int);
+
 		// Server limits and port
 		int PORT_NUMBER;
 		int MAX_CONNECTIONS;
-		int BUFFER_SIZE;
-		int INCOMING_MESSAGE_SIZE;
 
-		// Buffer
-		char * buffer;
+		// Received frames, per socket - only touched by the event loop
+		map<int, P2PReceiveBuffer *> receive_buffers;
 
 		// Message queue and file list
-		vector<P2PMessage> message_queue;
+		P2PMessageQueue * message_queue;
 		vector<FileItem> local_file_list;
 		vector<FileItem> download_file_list;
 
+		// Files being downloaded into, keyed by file ID
+		map<unsigned int, P2PDownloadTarget *> download_targets;
+		pthread_mutex_t download_mutex;
+
+		// Workers - one pool writes received chunks to disk, the other serves file requests
+		P2PThreadPool * receive_pool;
+		P2PThreadPool * send_pool;
+		int MAX_QUEUED_CHUNKS;
+		int NUM_SEND_WORKERS;
+
 		// Sockets
 		int primary_socket;
-		int * sockets;
-		int max_connection;
 
 		// Managing Sockets
 		timeval sockets_last_modified;
+		pthread_mutex_t socket_mutex;
 
-		// Available sockets
-		vector<P2PSocket> socket_vector;
+		// Available sockets, keyed by socket descriptor
+		map<int, P2PSocket> socket_map;
+
+		// What's waiting to be written to each socket
+		map<int, P2PSendQueue *> send_queues;
 		vector<int> sockets_to_close;
 
+		// Chunks each peer has sent that failed verification - too many and it's dropped
+		map<int, int> bad_chunk_counts;
+		int MAX_BAD_CHUNKS;
+
+		// Downloads whose last chunk has landed, waiting for the event loop - guarded by download_mutex
+		vector<unsigned int> completed_downloads;
+
+		// Time each download has gone without any peers
+		map<unsigned int, int> download_idle_time;
+		int TIMER_INTERVAL_MS;
+		int TRACKER_RETRY_MS;
+
+		// Peer connections still being made - connecting ones are guarded by socket_mutex,
+		// ones waiting on a host lookup are only touched by the event loop
+		P2PResolver * resolver;
+		map<int, PendingConnection> pending_connections;
+		vector<PendingConnection> resolving_connections;
+		int CONNECT_TIMEOUT_MS;
+
+		// Connections to peers, shared by every download from the same peer
+		P2PConnectionPool * connection_pool;
+		int MAX_PEER_CONNECTIONS;
+		int PEER_IDLE_TIMEOUT_MS;
+
 		// Settings
 		int port_offset;
 		int public_port;
 		unsigned int number_bind_tries;
 
-		// Socket descriptors used for select()
-		fd_set socket_descriptors;
+		// Event loop - epoll instance, an eventfd to interrupt epoll_wait(), and the transfer timer
+		int epoll_descriptor;
+		int wakeup_descriptor;
+		int timer_descriptor;
+		int MAX_EVENTS;
+		struct epoll_event * events;
 
 	public:
 		P2PPeerNode();
 		P2PPeerNode(int, int);
 		void start();
 		void listenForActivity();
-		void monitorTransfers();
 		void setBindMaxOffset(unsigned int);
 
 		// Add and remove new connections
 		int makeConnection(string, string, int);
+		int connectToTracker(unsigned int, string, int);
+		unsigned int getTrackerForFile(const FileItem &);
 		void closeSocket(int);
 		void closeSocketByName(string);
 		void queueSocketToClose(int);
@@ -107,11 +208,11 @@ class P2PPeerNode
 
 		// Send message to socket
 		void sendMessageToSocket(string, int);
-		void requestFileTransfer(string, int, string, int, unsigned int, unsigned int);
 
 		// Interact with message queue
 		P2PMessage popQueueMessage();
 		int countQueueMessages();
+		bool waitForQueueMessage(P2PMessage &, int);
 
 		// Handle download files
 		void addDownloadFileItems(vector<FileItem>);
@@ -119,9 +220,11 @@ class P2PPeerNode
 		FileItem getDownloadFileItem(string, int);
 
 		// Handle local files
+		void hashFileItems(vector<FileItem> &);
 		void addLocalFileItems(vector<FileItem>);
 		bool hasLocalFileItem(string, int);
 		FileItem getLocalFileItem(string, int);
+		FileItem getLocalFileItemByHash(string);
 };
 
 #endif
\ No newline at end of file
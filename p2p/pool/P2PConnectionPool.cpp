@@ -0,0 +1,148 @@
+/**
+ * Peer-to-peer connection pool class
+ */
+
+#include "P2PConnectionPool.hpp"
+
+P2PConnectionPool::P2PConnectionPool()
+{
+	pthread_mutex_init(&mutex, NULL);
+}
+
+P2PConnectionPool::~P2PConnectionPool()
+{
+	pthread_mutex_destroy(&mutex);
+}
+
+bool P2PConnectionPool::addConnection(int socket_id, string address)
+{
+	pthread_mutex_lock(&mutex);
+
+	// One connection per peer is all we need
+	if (sockets_by_address.find(address) != sockets_by_address.end())
+	{
+		pthread_mutex_unlock(&mutex);
+		return false;
+	}
+
+	PeerConnection & connection = connections[socket_id];
+	connection.address = address;
+	gettimeofday(&connection.last_used, NULL);
+	sockets_by_address[address] = socket_id;
+
+	pthread_mutex_unlock(&mutex);
+	return true;
+}
+
+bool P2PConnectionPool::removeConnection(int socket_id)
+{
+	pthread_mutex_lock(&mutex);
+	map<int, PeerConnection>::iterator iter = connections.find(socket_id);
+	if (iter == connections.end())
+	{
+		pthread_mutex_unlock(&mutex);
+		return false;
+	}
+
+	sockets_by_address.erase(iter->second.address);
+	connections.erase(iter);
+
+	pthread_mutex_unlock(&mutex);
+	return true;
+}
+
+int P2PConnectionPool::getSocket(string address)
+{
+	pthread_mutex_lock(&mutex);
+	unordered_map<string, int>::iterator iter = sockets_by_address.find(address);
+	int socket_id = (iter == sockets_by_address.end()) ? -1 : iter->second;
+	pthread_mutex_unlock(&mutex);
+
+	return socket_id;
+}
+
+bool P2PConnectionPool::openStream(int socket_id, unsigned int file_id)
+{
+	pthread_mutex_lock(&mutex);
+	map<int, PeerConnection>::iterator iter = connections.find(socket_id);
+	bool b_opened = (iter != connections.end() && iter->second.streams.insert(file_id).second);
+	if (b_opened)
+	{
+		gettimeofday(&iter->second.last_used, NULL);
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return b_opened;
+}
+
+bool P2PConnectionPool::closeStream(int socket_id, unsigned int file_id)
+{
+	pthread_mutex_lock(&mutex);
+	map<int, PeerConnection>::iterator iter = connections.find(socket_id);
+	bool b_closed = (iter != connections.end() && iter->second.streams.erase(file_id) > 0);
+	if (b_closed)
+	{
+		// Idle time counts from the last stream to finish
+		gettimeofday(&iter->second.last_used, NULL);
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return b_closed;
+}
+
+vector<int> P2PConnectionPool::getIdleSockets(unsigned int idle_timeout_ms)
+{
+	timeval now;
+	gettimeofday(&now, NULL);
+
+	vector<int> idle_sockets;
+
+	pthread_mutex_lock(&mutex);
+	map<int, PeerConnection>::iterator iter;
+	for (iter = connections.begin(); iter != connections.end(); ++iter)
+	{
+		if (!iter->second.streams.empty())
+		{
+			continue;
+		}
+
+		long idle_ms = (now.tv_sec - iter->second.last_used.tv_sec) * 1000 + (now.tv_usec - iter->second.last_used.tv_usec) / 1000;
+		if (idle_ms >= (long) idle_timeout_ms)
+		{
+			idle_sockets.push_back(iter->first);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return idle_sockets;
+}
+
+int P2PConnectionPool::getLeastRecentlyUsed()
+{
+	int socket_id = -1;
+	timeval oldest;
+
+	// Only idle connections can go - the others are carrying downloads
+	pthread_mutex_lock(&mutex);
+	map<int, PeerConnection>::iterator iter;
+	for (iter = connections.begin(); iter != connections.end(); ++iter)
+	{
+		if (iter->second.streams.empty() && (socket_id < 0 || timercmp(&iter->second.last_used, &oldest, <)))
+		{
+			socket_id = iter->first;
+			oldest = iter->second.last_used;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return socket_id;
+}
+
+unsigned int P2PConnectionPool::countConnections()
+{
+	pthread_mutex_lock(&mutex);
+	unsigned int count = connections.size();
+	pthread_mutex_unlock(&mutex);
+
+	return count;
+}
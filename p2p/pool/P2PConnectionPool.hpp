@@ -0,0 +1,45 @@
+#ifndef P2PCONNECTIONPOOL_H
+#define P2PCONNECTIONPOOL_H
+
+using namespace std;
+
+typedef struct {
+	string address;
+	set<unsigned int> streams;
+	timeval last_used;
+} PeerConnection;
+
+/**
+ * Keeps one connection per peer address, shared by every download that
+ * peer is serving us. Each download is a stream on the connection, named
+ * by its file ID - the same ID every chunk frame carries - so any number
+ * of transfers can be in flight over it at once.
+ * A connection with no streams left is idle, and is kept around for a
+ * while in case we want that peer again. When the pool is full, the one
+ * idle the longest makes way.
+ * Guarded by its own mutex.
+ */
+class P2PConnectionPool
+{
+	private:
+		unordered_map<string, int> sockets_by_address;
+		map<int, PeerConnection> connections;
+		pthread_mutex_t mutex;
+
+	public:
+		P2PConnectionPool();
+		~P2PConnectionPool();
+
+		bool addConnection(int, string);
+		bool removeConnection(int);
+		int getSocket(string);
+
+		bool openStream(int, unsigned int);
+		bool closeStream(int, unsigned int);
+
+		vector<int> getIdleSockets(unsigned int);
+		int getLeastRecentlyUsed();
+		unsigned int countConnections();
+};
+
+#endif
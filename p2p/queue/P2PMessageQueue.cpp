@@ -0,0 +1,124 @@
+/**
+ * Peer-to-peer message queue class
+ */
+
+#include "P2PMessageQueue.hpp"
+
+P2PMessageQueue::P2PMessageQueue()
+{
+	ring.resize(INITIAL_CAPACITY);
+	head = 0;
+	count = 0;
+
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&not_empty, NULL);
+}
+
+P2PMessageQueue::~P2PMessageQueue()
+{
+	pthread_cond_destroy(&not_empty);
+	pthread_mutex_destroy(&mutex);
+}
+
+void P2PMessageQueue::push(const P2PMessage & message)
+{
+	pthread_mutex_lock(&mutex);
+
+	if (count == ring.size())
+	{
+		this->grow();
+	}
+
+	ring[(head + count) % ring.size()] = message;
+	count++;
+
+	pthread_cond_signal(&not_empty);
+	pthread_mutex_unlock(&mutex);
+}
+
+bool P2PMessageQueue::tryPop(P2PMessage & message)
+{
+	pthread_mutex_lock(&mutex);
+
+	bool b_found = (count > 0);
+	if (b_found)
+	{
+		this->takeFront(message);
+	}
+
+	pthread_mutex_unlock(&mutex);
+	return b_found;
+}
+
+bool P2PMessageQueue::pop(P2PMessage & message, int timeout_ms)
+{
+	// Work out when to give up - a negative timeout waits forever
+	timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	if (timeout_ms > 0)
+	{
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	pthread_mutex_lock(&mutex);
+	while (count == 0 && timeout_ms != 0)
+	{
+		int result = (timeout_ms < 0)
+			? pthread_cond_wait(&not_empty, &mutex)
+			: pthread_cond_timedwait(&not_empty, &mutex, &deadline);
+
+		if (result == ETIMEDOUT)
+		{
+			break;
+		}
+	}
+
+	bool b_found = (count > 0);
+	if (b_found)
+	{
+		this->takeFront(message);
+	}
+
+	pthread_mutex_unlock(&mutex);
+	return b_found;
+}
+
+unsigned int P2PMessageQueue::size()
+{
+	pthread_mutex_lock(&mutex);
+	unsigned int num_messages = count;
+	pthread_mutex_unlock(&mutex);
+
+	return num_messages;
+}
+
+void P2PMessageQueue::grow()
+{
+	// Unwrap the ring into a buffer twice the size
+	vector<P2PMessage> bigger(ring.size() * 2);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		bigger[i].socket_id = ring[(head + i) % ring.size()].socket_id;
+		bigger[i].message.swap(ring[(head + i) % ring.size()].message);
+	}
+
+	ring.swap(bigger);
+	head = 0;
+}
+
+void P2PMessageQueue::takeFront(P2PMessage & message)
+{
+	// Move the text out rather than copy it, and leave the slot empty
+	message.socket_id = ring[head].socket_id;
+	message.message.swap(ring[head].message);
+	string().swap(ring[head].message);
+
+	head = (head + 1) % ring.size();
+	count--;
+}
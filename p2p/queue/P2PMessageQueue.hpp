@@ -0,0 +1,36 @@
+#ifndef P2PMESSAGEQUEUE_H
+#define P2PMESSAGEQUEUE_H
+
+using namespace std;
+
+/**
+ * Multi-producer, multi-consumer queue of messages, kept in a ring buffer
+ * that doubles when it fills. One short critical section per push or pop,
+ * and readers sleep on a condition variable instead of polling.
+ */
+class P2PMessageQueue
+{
+	private:
+		vector<P2PMessage> ring;
+		unsigned int head;
+		unsigned int count;
+
+		pthread_mutex_t mutex;
+		pthread_cond_t not_empty;
+
+		void grow();
+		void takeFront(P2PMessage &);
+
+	public:
+		P2PMessageQueue();
+		~P2PMessageQueue();
+
+		void push(const P2PMessage &);
+		bool tryPop(P2PMessage &);
+		bool pop(P2PMessage &, int);
+		unsigned int size();
+
+		static const unsigned int INITIAL_CAPACITY = 64;
+};
+
+#endif
@@ -0,0 +1,380 @@
+/**
+ * Peer-to-peer socket send queue class
+ */
+
+#include "P2PSendQueue.hpp"
+
+P2PSendQueue::P2PSendQueue(int socket)
+{
+	socket_id = socket;
+	bytes_queued = 0;
+	bytes_sent = 0;
+	b_use_sendfile = true;
+	b_closed = false;
+	b_failed = false;
+	references = 1;
+
+	pthread_mutex_init(&mutex, NULL);
+}
+
+P2PSendQueue::~P2PSendQueue()
+{
+	pthread_mutex_destroy(&mutex);
+}
+
+void P2PSendQueue::retain()
+{
+	pthread_mutex_lock(&mutex);
+	references++;
+	pthread_mutex_unlock(&mutex);
+}
+
+void P2PSendQueue::release()
+{
+	pthread_mutex_lock(&mutex);
+	bool b_last_reference = (--references == 0);
+	pthread_mutex_unlock(&mutex);
+
+	if (b_last_reference)
+	{
+		delete this;
+	}
+}
+
+bool P2PSendQueue::pushFrame(P2PFrameHeader header, const char * payload, unsigned int length)
+{
+	// Header and payload in one segment the queue owns
+	OutboundSegment segment;
+	segment.data.resize(P2PFrame::HEADER_SIZE + length);
+	header.length = length;
+	P2PFrame::packHeader(header, &segment.data[0]);
+	if (length > 0)
+	{
+		memcpy(&segment.data[P2PFrame::HEADER_SIZE], payload, length);
+	}
+
+	segment.memory = NULL;
+	segment.file_descriptor = -1;
+	segment.offset = 0;
+	segment.length = segment.data.length();
+
+	pthread_mutex_lock(&mutex);
+	bool b_open = !b_closed;
+	if (b_open)
+	{
+		this->pushSegment(segment);
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return b_open;
+}
+
+bool P2PSendQueue::pushMessage(string message)
+{
+	P2PFrameHeader header = P2PFrame::makeHeader(P2PFrame::TYPE_MESSAGE, message.length(), 0, 0, 0);
+	return this->pushFrame(header, message.c_str(), message.length());
+}
+
+bool P2PSendQueue::pushFileRegion(P2PFrameHeader header, int file_descriptor, const char * mapped_file, off_t offset, unsigned int length)
+{
+	// The header is ours - the payload stays in the file until it's written
+	OutboundSegment header_segment;
+	header_segment.data.resize(P2PFrame::HEADER_SIZE);
+	header.length = length;
+	P2PFrame::packHeader(header, &header_segment.data[0]);
+	header_segment.memory = NULL;
+	header_segment.file_descriptor = -1;
+	header_segment.offset = 0;
+	header_segment.length = P2PFrame::HEADER_SIZE;
+
+	// The mapping is there in case the socket can't take sendfile
+	OutboundSegment payload_segment;
+	payload_segment.memory = mapped_file;
+	payload_segment.file_descriptor = file_descriptor;
+	payload_segment.offset = offset;
+	payload_segment.length = length;
+
+	pthread_mutex_lock(&mutex);
+	bool b_open = !b_closed;
+	if (b_open)
+	{
+		this->pushSegment(header_segment);
+		if (length > 0)
+		{
+			this->pushSegment(payload_segment);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return b_open;
+}
+
+void P2PSendQueue::pushSegment(OutboundSegment & segment)
+{
+	bytes_queued += segment.length;
+
+	// Small frames ride along in the last segment, so a burst of them goes out in one write
+	if (segment.memory == NULL && segment.file_descriptor < 0 && !segments.empty())
+	{
+		OutboundSegment & last = segments.back();
+		if (last.memory == NULL && last.file_descriptor < 0 && last.length + segment.length <= MAX_COALESCED_BYTES)
+		{
+			last.data.append(segment.data);
+			last.length += segment.length;
+			return;
+		}
+	}
+
+	segments.push_back(OutboundSegment());
+	segments.back().data.swap(segment.data);
+	segments.back().memory = segment.memory;
+	segments.back().file_descriptor = segment.file_descriptor;
+	segments.back().offset = segment.offset;
+	segments.back().length = segment.length;
+}
+
+int P2PSendQueue::flush()
+{
+	pthread_mutex_lock(&mutex);
+
+	// Write until everything's gone, or the socket can't take any more
+	int result = FLUSH_DONE;
+	while (!b_closed && !b_failed && !segments.empty())
+	{
+		OutboundSegment & front = segments.front();
+		if (front.file_descriptor >= 0 && b_use_sendfile)
+		{
+			result = this->writeFileRegion();
+		}
+		else
+		{
+			result = this->writeBytes();
+		}
+
+		if (result != FLUSH_DONE)
+		{
+			break;
+		}
+	}
+
+	if (result == FLUSH_FAILED)
+	{
+		b_failed = true;
+	}
+	else if (b_closed || b_failed)
+	{
+		result = FLUSH_FAILED;
+	}
+
+	// Senders whose bytes have gone, or who were waiting for room
+	vector<SendWaiter> ready = this->takeReadyWaiters();
+	pthread_mutex_unlock(&mutex);
+
+	resumeWaiters(ready);
+	return result;
+}
+
+int P2PSendQueue::writeBytes()
+{
+	// Gather the bytes at the front into one write, stopping at a file region
+	struct iovec parts[MAX_BATCH_SEGMENTS];
+	unsigned int num_parts = 0;
+	int flags = MSG_NOSIGNAL;
+
+	deque<OutboundSegment>::iterator iter;
+	for (iter = segments.begin(); iter != segments.end() && num_parts < MAX_BATCH_SEGMENTS; ++iter)
+	{
+		if ((*iter).file_descriptor >= 0 && b_use_sendfile)
+		{
+			// Hold the segment for the payload that follows
+			flags |= MSG_MORE;
+			break;
+		}
+
+		if ((*iter).file_descriptor >= 0 && (*iter).memory == NULL)
+		{
+			// Nothing to fall back on for this region
+			break;
+		}
+
+		const char * bytes = ((*iter).memory != NULL) ? (*iter).memory : (*iter).data.data();
+		parts[num_parts].iov_base = (void *) (bytes + (*iter).offset);
+		parts[num_parts].iov_len = (*iter).length;
+		num_parts++;
+	}
+
+	if (num_parts == 0)
+	{
+		return FLUSH_FAILED;
+	}
+
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = parts;
+	message.msg_iovlen = num_parts;
+
+	ssize_t bytes_written = sendmsg(socket_id, &message, flags);
+	if (bytes_written < 0)
+	{
+		if (errno == EINTR) return FLUSH_DONE;
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return FLUSH_BLOCKED;
+		return FLUSH_FAILED;
+	}
+
+	this->markSent(bytes_written);
+	return FLUSH_DONE;
+}
+
+int P2PSendQueue::writeFileRegion()
+{
+	// Let the kernel move the payload from the page cache to the socket
+	OutboundSegment & front = segments.front();
+	ssize_t bytes_sent = sendfile(socket_id, front.file_descriptor, &front.offset, front.length);
+	if (bytes_sent < 0)
+	{
+		if (errno == EINTR) return FLUSH_DONE;
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return FLUSH_BLOCKED;
+
+		// Some files and sockets can't be spliced - write from the mapping instead
+		if ((errno == EINVAL || errno == ENOSYS) && front.memory != NULL)
+		{
+			b_use_sendfile = false;
+			return FLUSH_DONE;
+		}
+
+		return FLUSH_FAILED;
+	}
+	else if (bytes_sent == 0)
+	{
+		// The file shrank underneath us
+		return FLUSH_FAILED;
+	}
+
+	// sendfile moved the offset along - put it back, markSent moves every kind of segment the same way
+	front.offset -= bytes_sent;
+	this->markSent(bytes_sent);
+	return FLUSH_DONE;
+}
+
+void P2PSendQueue::markSent(size_t bytes_written)
+{
+	bytes_sent += bytes_written;
+
+	// Drop what's gone, and move into whatever was written part of
+	while (bytes_written > 0 && !segments.empty())
+	{
+		OutboundSegment & front = segments.front();
+		if (bytes_written >= front.length)
+		{
+			bytes_written -= front.length;
+			segments.pop_front();
+		}
+		else
+		{
+			front.offset += bytes_written;
+			front.length -= bytes_written;
+			bytes_written = 0;
+		}
+	}
+}
+
+bool P2PSendQueue::deferUntilSpace(void (*resume)(void *), void * arg)
+{
+	// Room opens up once enough has gone that what's left is under the limit
+	pthread_mutex_lock(&mutex);
+	bool b_deferred = (bytes_queued - bytes_sent >= MAX_QUEUED_BYTES);
+	if (b_deferred)
+	{
+		b_deferred = this->addWaiter(bytes_queued - MAX_QUEUED_BYTES + 1, resume, arg);
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return b_deferred;
+}
+
+bool P2PSendQueue::deferUntilSent(unsigned long long mark, void (*resume)(void *), void * arg)
+{
+	pthread_mutex_lock(&mutex);
+	bool b_deferred = this->addWaiter(mark, resume, arg);
+	pthread_mutex_unlock(&mutex);
+
+	return b_deferred;
+}
+
+bool P2PSendQueue::addWaiter(unsigned long long mark, void (*resume)(void *), void * arg)
+{
+	// Nothing to wait for if it's already gone - or if it never will
+	if (b_closed || b_failed || bytes_sent >= mark)
+	{
+		return false;
+	}
+
+	SendWaiter waiter;
+	waiter.mark = mark;
+	waiter.resume = resume;
+	waiter.arg = arg;
+	waiters.push_back(waiter);
+
+	return true;
+}
+
+vector<SendWaiter> P2PSendQueue::takeReadyWaiters()
+{
+	// Once the queue is done with, everyone's let go
+	vector<SendWaiter> ready;
+	vector<SendWaiter>::iterator iter = waiters.begin();
+	while (iter != waiters.end())
+	{
+		if (b_closed || b_failed || bytes_sent >= (*iter).mark)
+		{
+			ready.push_back(*iter);
+			iter = waiters.erase(iter);
+		}
+		else
+		{
+			iter++;
+		}
+	}
+
+	return ready;
+}
+
+void P2PSendQueue::resumeWaiters(vector<SendWaiter> & ready)
+{
+	// Outside the lock - they'll want to queue more
+	vector<SendWaiter>::iterator iter;
+	for (iter = ready.begin(); iter != ready.end(); iter++)
+	{
+		(*iter).resume((*iter).arg);
+	}
+}
+
+unsigned long long P2PSendQueue::getBytesQueued()
+{
+	pthread_mutex_lock(&mutex);
+	unsigned long long mark = bytes_queued;
+	pthread_mutex_unlock(&mutex);
+
+	return mark;
+}
+
+bool P2PSendQueue::hasFailed()
+{
+	pthread_mutex_lock(&mutex);
+	bool b_has_failed = b_failed;
+	pthread_mutex_unlock(&mutex);
+
+	return b_has_failed;
+}
+
+void P2PSendQueue::close()
+{
+	// Once this returns, nothing touches the socket or anything borrowed again
+	pthread_mutex_lock(&mutex);
+	b_closed = true;
+	segments.clear();
+	vector<SendWaiter> ready = this->takeReadyWaiters();
+	pthread_mutex_unlock(&mutex);
+
+	resumeWaiters(ready);
+}
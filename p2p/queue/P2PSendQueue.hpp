@@ -0,0 +1,92 @@
+#ifndef P2PSENDQUEUE_H
+#define P2PSENDQUEUE_H
+
+using namespace std;
+
+typedef struct {
+	string data;
+	const char * memory;
+	int file_descriptor;
+	off_t offset;
+	size_t length;
+} OutboundSegment;
+
+typedef struct {
+	unsigned long long mark;
+	void (*resume)(void *);
+	void * arg;
+} SendWaiter;
+
+/**
+ * Everything waiting to be written to one socket, in order. Frames are
+ * queued whole, so nothing sent from another thread can land in the
+ * middle of one, and a short write just leaves the rest at the front.
+ * Each segment is either bytes the queue owns (headers, messages), bytes
+ * borrowed from the sender (a mapped file), or a region of a file to hand
+ * to sendfile - the sender keeps borrowed bytes and files alive until
+ * they're gone.
+ * Whoever queues something tries to write it straight away. If the socket
+ * is full, the event loop carries on when it reports the socket writable.
+ * Senders never block on a slow peer: once MAX_QUEUED_BYTES are queued, or
+ * while they wait for their bytes to go, they leave a callback and return,
+ * and the flush that makes the progress calls them back.
+ * Shared between the node and the threads sending on it, so it's
+ * reference counted - the last one to release it frees it.
+ */
+class P2PSendQueue
+{
+	private:
+		int socket_id;
+		deque<OutboundSegment> segments;
+		unsigned long long bytes_queued;
+		unsigned long long bytes_sent;
+		bool b_use_sendfile;
+		bool b_closed;
+		bool b_failed;
+
+		// Senders to call back once this many bytes have been sent
+		vector<SendWaiter> waiters;
+
+		pthread_mutex_t mutex;
+		int references;
+
+		void pushSegment(OutboundSegment &);
+		int writeBytes();
+		int writeFileRegion();
+		void markSent(size_t);
+		bool addWaiter(unsigned long long, void (*)(void *), void *);
+		vector<SendWaiter> takeReadyWaiters();
+		static void resumeWaiters(vector<SendWaiter> &);
+
+	public:
+		P2PSendQueue(int);
+		~P2PSendQueue();
+
+		void retain();
+		void release();
+
+		bool pushFrame(P2PFrameHeader, const char *, unsigned int);
+		bool pushMessage(string);
+		bool pushFileRegion(P2PFrameHeader, int, const char *, off_t, unsigned int);
+
+		int flush();
+		bool deferUntilSpace(void (*)(void *), void *);
+		bool deferUntilSent(unsigned long long, void (*)(void *), void *);
+		unsigned long long getBytesQueued();
+		bool hasFailed();
+		void close();
+
+		// What a flush left behind
+		static const int FLUSH_DONE = 0;
+		static const int FLUSH_BLOCKED = 1;
+		static const int FLUSH_FAILED = 2;
+
+		// Senders hold off once this much is queued - enough for a chunk of any size to follow
+		static const unsigned int MAX_QUEUED_BYTES = 4 * 1024 * 1024;
+
+		// Segments gathered into one write, and how big a segment small frames are gathered into
+		static const unsigned int MAX_BATCH_SEGMENTS = 64;
+		static const unsigned int MAX_COALESCED_BYTES = 64 * 1024;
+};
+
+#endif
@@ -0,0 +1,139 @@
+/**
+ * Peer-to-peer host name resolver class
+ */
+
+#include "P2PResolver.hpp"
+
+P2PResolver::P2PResolver()
+{
+	pthread_mutex_init(&mutex, NULL);
+	pool = new P2PThreadPool(NUM_THREADS, 0);
+}
+
+P2PResolver::~P2PResolver()
+{
+	delete pool;
+	pthread_mutex_destroy(&mutex);
+}
+
+int P2PResolver::lookup(const string & host, struct in_addr & address)
+{
+	// Addresses given as numbers need no lookup at all
+	if (inet_pton(AF_INET, host.c_str(), &address) == 1)
+	{
+		return RESULT_FOUND;
+	}
+
+	timeval now;
+	gettimeofday(&now, NULL);
+
+	pthread_mutex_lock(&mutex);
+	int result = RESULT_UNKNOWN;
+	unordered_map<string, ResolvedHost>::iterator iter = cache.find(host);
+	if (iter != cache.end() && timercmp(&now, &iter->second.expires, <))
+	{
+		result = iter->second.b_valid ? RESULT_FOUND : RESULT_FAILED;
+		address = iter->second.address;
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return result;
+}
+
+int P2PResolver::resolve(const string & host, struct in_addr & address)
+{
+	int result = this->lookup(host, address);
+	if (result != RESULT_UNKNOWN)
+	{
+		return result;
+	}
+
+	// Only IPv4 - that's all the rest of the node speaks
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo * results = NULL;
+	bool b_valid = (getaddrinfo(host.c_str(), NULL, &hints, &results) == 0 && results != NULL);
+	if (b_valid)
+	{
+		address = ((struct sockaddr_in *) results->ai_addr)->sin_addr;
+	}
+
+	if (results != NULL)
+	{
+		freeaddrinfo(results);
+	}
+
+	this->store(host, b_valid, address);
+	return b_valid ? RESULT_FOUND : RESULT_FAILED;
+}
+
+void P2PResolver::resolveAsync(const string & host, void (*done)(void *), void * arg)
+{
+	// The task frees itself - the answer is left in the cache for the caller to look up
+	ResolveTask * task = new ResolveTask;
+	task->resolver = this;
+	task->host = host;
+	task->done = done;
+	task->arg = arg;
+
+	if (!pool->submit(&P2PResolver::resolveTask, (void *) task))
+	{
+		delete task;
+	}
+}
+
+void P2PResolver::resolveTask(void * arg)
+{
+	ResolveTask * task = static_cast<ResolveTask *>(arg);
+
+	struct in_addr address;
+	task->resolver->resolve(task->host, address);
+	task->done(task->arg);
+
+	delete task;
+}
+
+void P2PResolver::store(const string & host, bool b_valid, struct in_addr address)
+{
+	timeval now;
+	gettimeofday(&now, NULL);
+
+	unsigned int ttl_ms = b_valid ? FOUND_TTL_MS : FAILED_TTL_MS;
+	timeval ttl;
+	ttl.tv_sec = ttl_ms / 1000;
+	ttl.tv_usec = (ttl_ms % 1000) * 1000;
+
+	pthread_mutex_lock(&mutex);
+
+	// Make room by dropping whatever has expired - and if that's not enough, start over
+	if (cache.size() >= MAX_CACHED_HOSTS && cache.find(host) == cache.end())
+	{
+		unordered_map<string, ResolvedHost>::iterator iter = cache.begin();
+		while (iter != cache.end())
+		{
+			if (!timercmp(&now, &iter->second.expires, <))
+			{
+				iter = cache.erase(iter);
+			}
+			else
+			{
+				iter++;
+			}
+		}
+
+		if (cache.size() >= MAX_CACHED_HOSTS)
+		{
+			cache.clear();
+		}
+	}
+
+	ResolvedHost & entry = cache[host];
+	entry.address = address;
+	entry.b_valid = b_valid;
+	timeradd(&now, &ttl, &entry.expires);
+
+	pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,59 @@
+#ifndef P2PRESOLVER_H
+#define P2PRESOLVER_H
+
+using namespace std;
+
+class P2PResolver;
+
+typedef struct {
+	struct in_addr address;
+	bool b_valid;
+	timeval expires;
+} ResolvedHost;
+
+typedef struct {
+	P2PResolver * resolver;
+	string host;
+	void (*done)(void *);
+	void * arg;
+} ResolveTask;
+
+/**
+ * Turns host names into IPv4 addresses with getaddrinfo, on threads of its
+ * own so nothing waiting on the network blocks the caller. Answers are
+ * cached for a while - failures too, for less time - so peers asked for
+ * again and again are only looked up once.
+ */
+class P2PResolver
+{
+	private:
+		unordered_map<string, ResolvedHost> cache;
+		pthread_mutex_t mutex;
+		P2PThreadPool * pool;
+
+		void store(const string &, bool, struct in_addr);
+		static void resolveTask(void *);
+
+	public:
+		P2PResolver();
+		~P2PResolver();
+
+		int lookup(const string &, struct in_addr &);
+		int resolve(const string &, struct in_addr &);
+		void resolveAsync(const string &, void (*)(void *), void *);
+
+		// What a lookup found
+		static const int RESULT_FOUND = 0;
+		static const int RESULT_FAILED = 1;
+		static const int RESULT_UNKNOWN = 2;
+
+		// Threads blocking in getaddrinfo at once
+		static const unsigned int NUM_THREADS = 2;
+
+		// Cache limits - how long answers are trusted, and how many are kept
+		static const unsigned int FOUND_TTL_MS = 300000;
+		static const unsigned int FAILED_TTL_MS = 10000;
+		static const unsigned int MAX_CACHED_HOSTS = 256;
+};
+
+#endif
@@ -0,0 +1,427 @@
+/**
+ * Peer-to-peer piece scheduler class
+ */
+
+#include "P2PPieceScheduler.hpp"
+
+P2PPieceScheduler::P2PPieceScheduler(unsigned int chunks, unsigned int size)
+{
+	num_chunks = chunks;
+	chunk_size = size;
+	received = P2PBitfield(num_chunks);
+	availability.assign(num_chunks, 0);
+	requested.assign(num_chunks, 0);
+
+	pthread_mutex_init(&mutex, NULL);
+}
+
+P2PPieceScheduler::~P2PPieceScheduler()
+{
+	pthread_mutex_destroy(&mutex);
+}
+
+void P2PPieceScheduler::setReceived(const P2PBitfield & chunks_received)
+{
+	// Start from whatever a resumed download already has
+	pthread_mutex_lock(&mutex);
+	received = chunks_received;
+	pthread_mutex_unlock(&mutex);
+}
+
+bool P2PPieceScheduler::addPeer(int socket_id, string address)
+{
+	pthread_mutex_lock(&mutex);
+	if (peers.find(socket_id) != peers.end())
+	{
+		pthread_mutex_unlock(&mutex);
+		return false;
+	}
+
+	// Peers only announce complete files, so a new peer holds every chunk
+	PeerProgress & peer = peers[socket_id];
+	peer.address = address;
+	peer.available = P2PBitfield(num_chunks);
+	peer.available.fill();
+	peer.throughput = 0;
+	gettimeofday(&peer.last_activity, NULL);
+	peer.min_rtt = 0;
+	peer.smoothed_rtt = 0;
+	peer.rtt_variance = 0;
+	peer.timeouts = 0;
+
+	for (unsigned int i = 0; i < num_chunks; i++)
+	{
+		availability[i]++;
+	}
+
+	pthread_mutex_unlock(&mutex);
+	return true;
+}
+
+bool P2PPieceScheduler::removePeer(int socket_id)
+{
+	pthread_mutex_lock(&mutex);
+	map<int, PeerProgress>::iterator iter = peers.find(socket_id);
+	if (iter == peers.end())
+	{
+		pthread_mutex_unlock(&mutex);
+		return false;
+	}
+
+	// Whatever it still owed us is up for grabs again
+	PeerProgress & peer = iter->second;
+	for (unsigned int i = 0; i < peer.in_flight.size(); i++)
+	{
+		requested[peer.in_flight[i].chunk - 1]--;
+	}
+
+	for (unsigned int i = 0; i < num_chunks; i++)
+	{
+		if (peer.available.test(i))
+		{
+			availability[i]--;
+		}
+	}
+
+	peers.erase(iter);
+	pthread_mutex_unlock(&mutex);
+	return true;
+}
+
+bool P2PPieceScheduler::hasPeer(string address)
+{
+	bool b_found = false;
+
+	pthread_mutex_lock(&mutex);
+	map<int, PeerProgress>::iterator iter;
+	for (iter = peers.begin(); iter != peers.end(); ++iter)
+	{
+		if (iter->second.address == address)
+		{
+			b_found = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return b_found;
+}
+
+vector<int> P2PPieceScheduler::getPeers()
+{
+	vector<int> socket_ids;
+
+	pthread_mutex_lock(&mutex);
+	map<int, PeerProgress>::iterator iter;
+	for (iter = peers.begin(); iter != peers.end(); ++iter)
+	{
+		socket_ids.push_back(iter->first);
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return socket_ids;
+}
+
+bool P2PPieceScheduler::assignChunks(int socket_id, vector<unsigned int> & chunks)
+{
+	pthread_mutex_lock(&mutex);
+	map<int, PeerProgress>::iterator iter = peers.find(socket_id);
+	if (iter == peers.end())
+	{
+		pthread_mutex_unlock(&mutex);
+		return false;
+	}
+
+	// Top the window up once half of it has arrived, so requests go out a few chunks at a time
+	PeerProgress & peer = iter->second;
+	unsigned int window_size = getWindowSize(peer);
+	if (peer.in_flight.size() > window_size / 2)
+	{
+		pthread_mutex_unlock(&mutex);
+		return false;
+	}
+
+	// The clock starts on an idle peer when it's given work
+	timeval now;
+	gettimeofday(&now, NULL);
+	if (peer.in_flight.empty())
+	{
+		peer.last_activity = now;
+	}
+
+	unsigned int wanted = window_size - peer.in_flight.size();
+	unsigned int first_new = chunks.size();
+	pickChunks(peer, wanted, chunks);
+
+	// Everything is spoken for - race the slowest peers for the last few chunks
+	if (chunks.size() == first_new)
+	{
+		pickEndGameChunks(peer, wanted, chunks);
+	}
+
+	for (unsigned int i = first_new; i < chunks.size(); i++)
+	{
+		ChunkRequest request;
+		request.chunk = chunks[i];
+		request.requested_at = now;
+
+		requested[chunks[i] - 1]++;
+		peer.in_flight.push_back(request);
+	}
+
+	bool b_assigned = (chunks.size() > first_new);
+	pthread_mutex_unlock(&mutex);
+
+	// Ascending, so callers can send runs of chunks as ranges
+	sort(chunks.begin(), chunks.end());
+	return b_assigned;
+}
+
+void P2PPieceScheduler::chunkReceived(int socket_id, unsigned int chunk, unsigned int length)
+{
+	if (chunk < 1 || chunk > num_chunks)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&mutex);
+	received.set(chunk - 1);
+
+	map<int, PeerProgress>::iterator iter = peers.find(socket_id);
+	timeval requested_at;
+	if (iter != peers.end() && removeInFlight(iter->second, chunk, requested_at))
+	{
+		requested[chunk - 1]--;
+
+		// Smooth the throughput over the last several chunks
+		PeerProgress & peer = iter->second;
+		timeval now;
+		gettimeofday(&now, NULL);
+		double sample = length / max(secondsBetween(peer.last_activity, now), 0.0001);
+		peer.throughput = (peer.throughput == 0) ? sample : (0.75 * peer.throughput + 0.25 * sample);
+		peer.last_activity = now;
+		peer.timeouts = 0;
+
+		// The quickest answer is the link's round trip, the rest include the wait behind earlier chunks
+		double rtt = secondsBetween(requested_at, now);
+		if (peer.smoothed_rtt == 0)
+		{
+			peer.min_rtt = rtt;
+			peer.smoothed_rtt = rtt;
+			peer.rtt_variance = rtt / 2;
+		}
+		else
+		{
+			peer.min_rtt = min(peer.min_rtt, rtt);
+			peer.rtt_variance = 0.75 * peer.rtt_variance + 0.25 * fabs(peer.smoothed_rtt - rtt);
+			peer.smoothed_rtt = 0.875 * peer.smoothed_rtt + 0.125 * rtt;
+		}
+	}
+
+	pthread_mutex_unlock(&mutex);
+}
+
+void P2PPieceScheduler::chunkFailed(int socket_id, unsigned int chunk)
+{
+	if (chunk < 1 || chunk > num_chunks)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&mutex);
+	map<int, PeerProgress>::iterator iter = peers.find(socket_id);
+	timeval requested_at;
+	if (iter != peers.end() && removeInFlight(iter->second, chunk, requested_at))
+	{
+		requested[chunk - 1]--;
+
+		// Steer the chunk to someone else - unless nobody else has it
+		if (availability[chunk - 1] > 1 && iter->second.available.clear(chunk - 1))
+		{
+			availability[chunk - 1]--;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void P2PPieceScheduler::abandonRequests()
+{
+	// Forget everything that's been asked for, so it can all be handed out again
+	pthread_mutex_lock(&mutex);
+	map<int, PeerProgress>::iterator iter;
+	for (iter = peers.begin(); iter != peers.end(); ++iter)
+	{
+		iter->second.in_flight.clear();
+	}
+
+	requested.assign(num_chunks, 0);
+	pthread_mutex_unlock(&mutex);
+}
+
+unsigned int P2PPieceScheduler::expireRequests(vector<int> & slow_peers)
+{
+	unsigned int num_expired = 0;
+	timeval now;
+	gettimeofday(&now, NULL);
+
+	pthread_mutex_lock(&mutex);
+	map<int, PeerProgress>::iterator iter;
+	for (iter = peers.begin(); iter != peers.end(); ++iter)
+	{
+		// Take back whatever the peer has sat on for too long
+		PeerProgress & peer = iter->second;
+		double timeout = getRequestTimeout(peer);
+		vector<ChunkRequest>::iterator request_iter = peer.in_flight.begin();
+		bool b_expired = false;
+		while (request_iter != peer.in_flight.end())
+		{
+			if (secondsBetween((*request_iter).requested_at, now) > timeout)
+			{
+				requested[(*request_iter).chunk - 1]--;
+				request_iter = peer.in_flight.erase(request_iter);
+				b_expired = true;
+				num_expired++;
+			}
+			else
+			{
+				request_iter++;
+			}
+		}
+
+		// Back off - a smaller window, and a peer that keeps timing out is given up on
+		if (b_expired)
+		{
+			peer.throughput /= 2;
+			if (++peer.timeouts >= MAX_TIMEOUTS)
+			{
+				slow_peers.push_back(iter->first);
+			}
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return num_expired;
+}
+
+unsigned int P2PPieceScheduler::countPeers()
+{
+	pthread_mutex_lock(&mutex);
+	unsigned int count = peers.size();
+	pthread_mutex_unlock(&mutex);
+
+	return count;
+}
+
+double P2PPieceScheduler::getThroughput()
+{
+	double throughput = 0;
+
+	pthread_mutex_lock(&mutex);
+	map<int, PeerProgress>::iterator iter;
+	for (iter = peers.begin(); iter != peers.end(); ++iter)
+	{
+		throughput += iter->second.throughput;
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return throughput;
+}
+
+unsigned int P2PPieceScheduler::getWindowSize(PeerProgress & peer)
+{
+	// Enough to keep the link busy for a couple of round trips - a new peer starts small
+	double window_bytes = WINDOW_ROUND_TRIPS * peer.throughput * peer.min_rtt;
+	unsigned int window_size = (unsigned int) min(ceil(window_bytes / chunk_size), (double) MAX_WINDOW_CHUNKS);
+
+	return max(window_size, (unsigned int) MIN_WINDOW_CHUNKS);
+}
+
+double P2PPieceScheduler::getRequestTimeout(PeerProgress & peer)
+{
+	if (peer.smoothed_rtt == 0)
+	{
+		return INITIAL_REQUEST_TIMEOUT_MS / 1000.0;
+	}
+
+	double timeout = peer.smoothed_rtt + 4 * peer.rtt_variance;
+	return min(max(timeout, MIN_REQUEST_TIMEOUT_MS / 1000.0), MAX_REQUEST_TIMEOUT_MS / 1000.0);
+}
+
+double P2PPieceScheduler::secondsBetween(const timeval & start, const timeval & end)
+{
+	return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+}
+
+void P2PPieceScheduler::pickChunks(PeerProgress & peer, unsigned int wanted, vector<unsigned int> & chunks)
+{
+	// Everything this peer could send that nobody's been asked for, rarest first.
+	// Chunks that are just as rare stay in order, so they go out as ranges.
+	vector< pair<unsigned short, unsigned int> > candidates;
+	for (unsigned int i = 0; i < num_chunks; i++)
+	{
+		if (requested[i] == 0 && !received.test(i) && peer.available.test(i))
+		{
+			candidates.push_back(make_pair(availability[i], i + 1));
+		}
+	}
+
+	unsigned int num_picked = min(wanted, (unsigned int) candidates.size());
+	partial_sort(candidates.begin(), candidates.begin() + num_picked, candidates.end());
+
+	for (unsigned int i = 0; i < num_picked; i++)
+	{
+		chunks.push_back(candidates[i].second);
+	}
+}
+
+void P2PPieceScheduler::pickEndGameChunks(PeerProgress & peer, unsigned int wanted, vector<unsigned int> & chunks)
+{
+	// Chunks other peers are still working on, the least duplicated first
+	vector< pair<unsigned char, unsigned int> > candidates;
+	for (unsigned int i = 0; i < num_chunks; i++)
+	{
+		if (requested[i] > 0 && requested[i] < END_GAME_REQUESTS && !received.test(i) && peer.available.test(i)
+			&& !isInFlight(peer, i + 1))
+		{
+			candidates.push_back(make_pair(requested[i], i + 1));
+		}
+	}
+
+	unsigned int num_picked = min(wanted, (unsigned int) candidates.size());
+	partial_sort(candidates.begin(), candidates.begin() + num_picked, candidates.end());
+
+	for (unsigned int i = 0; i < num_picked; i++)
+	{
+		chunks.push_back(candidates[i].second);
+	}
+}
+
+bool P2PPieceScheduler::removeInFlight(PeerProgress & peer, unsigned int chunk, timeval & requested_at)
+{
+	vector<ChunkRequest>::iterator iter;
+	for (iter = peer.in_flight.begin(); iter != peer.in_flight.end(); ++iter)
+	{
+		if ((*iter).chunk == chunk)
+		{
+			requested_at = (*iter).requested_at;
+			peer.in_flight.erase(iter);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool P2PPieceScheduler::isInFlight(PeerProgress & peer, unsigned int chunk)
+{
+	vector<ChunkRequest>::iterator iter;
+	for (iter = peer.in_flight.begin(); iter != peer.in_flight.end(); ++iter)
+	{
+		if ((*iter).chunk == chunk)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,96 @@
+#ifndef P2PPIECESCHEDULER_H
+#define P2PPIECESCHEDULER_H
+
+using namespace std;
+
+typedef struct {
+	unsigned int chunk;
+	timeval requested_at;
+} ChunkRequest;
+
+typedef struct {
+	string address;
+	P2PBitfield available;
+	vector<ChunkRequest> in_flight;
+	double throughput;
+	timeval last_activity;
+
+	// Round trip estimates, in seconds - the lowest seen, and a smoothed mean and variance
+	double min_rtt;
+	double smoothed_rtt;
+	double rtt_variance;
+	unsigned int timeouts;
+} PeerProgress;
+
+/**
+ * Decides which chunks of a download to ask each peer for. Each peer has a
+ * window of outstanding chunk requests, sized to cover its round trip at
+ * the rate it's been sending, so fast and distant links stay full while a
+ * slow peer only ever holds up a few chunks. Requests that outlive the
+ * peer's usual round trip are taken back and handed out again.
+ * The chunks held by the fewest peers go first, and once every missing
+ * chunk has been asked for, idle peers double up on the ones still
+ * outstanding.
+ * Guarded by its own mutex - chunks are reported from the receive workers.
+ */
+class P2PPieceScheduler
+{
+	private:
+		unsigned int num_chunks;
+		unsigned int chunk_size;
+		P2PBitfield received;
+
+		// Per chunk: how many peers hold it, and how many it's been asked of
+		vector<unsigned short> availability;
+		vector<unsigned char> requested;
+
+		map<int, PeerProgress> peers;
+		pthread_mutex_t mutex;
+
+		unsigned int getWindowSize(PeerProgress &);
+		void pickChunks(PeerProgress &, unsigned int, vector<unsigned int> &);
+		void pickEndGameChunks(PeerProgress &, unsigned int, vector<unsigned int> &);
+		static bool removeInFlight(PeerProgress &, unsigned int, timeval &);
+		static bool isInFlight(PeerProgress &, unsigned int);
+		static double getRequestTimeout(PeerProgress &);
+		static double secondsBetween(const timeval &, const timeval &);
+
+	public:
+		P2PPieceScheduler(unsigned int, unsigned int);
+		~P2PPieceScheduler();
+
+		void setReceived(const P2PBitfield &);
+
+		bool addPeer(int, string);
+		bool removePeer(int);
+		bool hasPeer(string);
+		vector<int> getPeers();
+
+		bool assignChunks(int, vector<unsigned int> &);
+		void chunkReceived(int, unsigned int, unsigned int);
+		void chunkFailed(int, unsigned int);
+		void abandonRequests();
+		unsigned int expireRequests(vector<int> &);
+
+		unsigned int countPeers();
+		double getThroughput();
+
+		// Windows cover this many round trips at the peer's rate, within these bounds
+		static const unsigned int WINDOW_ROUND_TRIPS = 2;
+		static const unsigned int MIN_WINDOW_CHUNKS = 4;
+		static const unsigned int MAX_WINDOW_CHUNKS = 64;
+
+		// Requests time out after the smoothed round trip plus four deviations, within these bounds.
+		// Until a peer has sent anything, it gets the initial timeout.
+		static const unsigned int INITIAL_REQUEST_TIMEOUT_MS = 3000;
+		static const unsigned int MIN_REQUEST_TIMEOUT_MS = 1000;
+		static const unsigned int MAX_REQUEST_TIMEOUT_MS = 30000;
+
+		// Requests in a row a peer can let time out before it's given up on
+		static const unsigned int MAX_TIMEOUTS = 3;
+
+		// Peers asked for the same chunk at once, at most, in the end game
+		static const unsigned int END_GAME_REQUESTS = 2;
+};
+
+#endif
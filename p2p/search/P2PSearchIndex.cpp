@@ -0,0 +1,315 @@
+/**
+ * Peer-to-peer file name search index class
+ */
+
+#include "P2PSearchIndex.hpp"
+
+P2PSearchIndex::P2PSearchIndex() {}
+
+void P2PSearchIndex::addName(unsigned int file_id, const string & name)
+{
+	string lower_name = toLower(name);
+	if (lower_name.length() == 0)
+	{
+		return;
+	}
+
+	// Skip names we already have for this file
+	string & names = names_by_file[file_id];
+	vector<string> known_names = P2PCommon::splitString(names, '\n');
+	if (find(known_names.begin(), known_names.end(), lower_name) != known_names.end())
+	{
+		return;
+	}
+	names += (names.length() > 0 ? "\n" : "") + lower_name;
+
+	vector<string> tokens = tokenize(lower_name);
+	vector<string>::iterator token_iter;
+	for (token_iter = tokens.begin(); token_iter != tokens.end(); ++token_iter)
+	{
+		addPosting(files_by_token[*token_iter], file_id);
+	}
+
+	vector<unsigned int> name_trigrams = trigrams(lower_name);
+	vector<unsigned int>::iterator trigram_iter;
+	for (trigram_iter = name_trigrams.begin(); trigram_iter != name_trigrams.end(); ++trigram_iter)
+	{
+		addPosting(files_by_trigram[*trigram_iter], file_id);
+	}
+}
+
+void P2PSearchIndex::removeFile(unsigned int file_id)
+{
+	unordered_map<unsigned int, string>::iterator iter = names_by_file.find(file_id);
+	if (iter == names_by_file.end())
+	{
+		return;
+	}
+
+	// Take the file out of every posting its names put it in, and drop the postings left empty
+	vector<string> names = P2PCommon::splitString(iter->second, '\n');
+	vector<string>::iterator name_iter;
+	for (name_iter = names.begin(); name_iter != names.end(); ++name_iter)
+	{
+		vector<string> tokens = tokenize(*name_iter);
+		vector<string>::iterator token_iter;
+		for (token_iter = tokens.begin(); token_iter != tokens.end(); ++token_iter)
+		{
+			unordered_map<string, vector<unsigned int> >::iterator posting = files_by_token.find(*token_iter);
+			if (posting != files_by_token.end())
+			{
+				removePosting(posting->second, file_id);
+				if (posting->second.empty())
+				{
+					files_by_token.erase(posting);
+				}
+			}
+		}
+
+		vector<unsigned int> name_trigrams = trigrams(*name_iter);
+		vector<unsigned int>::iterator trigram_iter;
+		for (trigram_iter = name_trigrams.begin(); trigram_iter != name_trigrams.end(); ++trigram_iter)
+		{
+			unordered_map<unsigned int, vector<unsigned int> >::iterator posting = files_by_trigram.find(*trigram_iter);
+			if (posting != files_by_trigram.end())
+			{
+				removePosting(posting->second, file_id);
+				if (posting->second.empty())
+				{
+					files_by_trigram.erase(posting);
+				}
+			}
+		}
+	}
+
+	names_by_file.erase(iter);
+}
+
+vector<SearchMatch> P2PSearchIndex::search(const string & query)
+{
+	vector<SearchMatch> matches;
+
+	vector<string> words = tokenize(toLower(query));
+	if (words.empty())
+	{
+		return matches;
+	}
+
+	// Start from the word matching the fewest files
+	vector<unsigned int> scratch;
+	const vector<unsigned int> * candidates = NULL;
+	vector<string>::iterator word_iter;
+	for (word_iter = words.begin(); word_iter != words.end(); ++word_iter)
+	{
+		vector<unsigned int> word_scratch;
+		const vector<unsigned int> * word_candidates = getCandidates(*word_iter, word_scratch);
+		if (candidates == NULL || word_candidates->size() < candidates->size())
+		{
+			scratch.swap(word_scratch);
+			candidates = (word_candidates == &word_scratch) ? &scratch : word_candidates;
+		}
+
+		if (candidates->empty())
+		{
+			return matches;
+		}
+	}
+
+	// Every word has to match each candidate - score it by how well they do
+	vector<unsigned int>::const_iterator iter;
+	for (iter = candidates->begin(); iter != candidates->end(); ++iter)
+	{
+		const string & names = names_by_file.at(*iter);
+
+		unsigned int score = 0;
+		for (word_iter = words.begin(); word_iter != words.end(); ++word_iter)
+		{
+			unsigned int word_score = scoreWord(*word_iter, names);
+			if (word_score == 0)
+			{
+				score = 0;
+				break;
+			}
+
+			score += word_score;
+		}
+
+		if (score > 0)
+		{
+			SearchMatch match;
+			match.file_id = *iter;
+			match.score = score;
+			matches.push_back(match);
+		}
+	}
+
+	return matches;
+}
+
+const vector<unsigned int> * P2PSearchIndex::getCandidates(const string & word, vector<unsigned int> & scratch)
+{
+	// Words too short for a trigram have to match a whole word
+	if (word.length() < 3)
+	{
+		unordered_map<string, vector<unsigned int> >::iterator posting = files_by_token.find(word);
+		return (posting == files_by_token.end()) ? &scratch : &posting->second;
+	}
+
+	// Files holding every trigram of the word - a superset of the files holding the word
+	vector<const vector<unsigned int> *> postings;
+	vector<unsigned int> word_trigrams = trigrams(word);
+	vector<unsigned int>::iterator trigram_iter;
+	for (trigram_iter = word_trigrams.begin(); trigram_iter != word_trigrams.end(); ++trigram_iter)
+	{
+		unordered_map<unsigned int, vector<unsigned int> >::iterator posting = files_by_trigram.find(*trigram_iter);
+		if (posting == files_by_trigram.end())
+		{
+			return &scratch;
+		}
+
+		postings.push_back(&posting->second);
+	}
+
+	// Intersect from the shortest, looking each survivor up in the longer ones
+	const vector<unsigned int> * shortest = postings[0];
+	for (unsigned int i = 1; i < postings.size(); i++)
+	{
+		if (postings[i]->size() < shortest->size())
+		{
+			shortest = postings[i];
+		}
+	}
+
+	if (postings.size() == 1)
+	{
+		return shortest;
+	}
+
+	vector<unsigned int>::const_iterator iter;
+	for (iter = shortest->begin(); iter != shortest->end(); ++iter)
+	{
+		bool b_in_all = true;
+		for (unsigned int i = 0; i < postings.size() && b_in_all; i++)
+		{
+			b_in_all = (postings[i] == shortest || binary_search(postings[i]->begin(), postings[i]->end(), *iter));
+		}
+
+		if (b_in_all)
+		{
+			scratch.push_back(*iter);
+		}
+	}
+
+	return &scratch;
+}
+
+unsigned int P2PSearchIndex::scoreWord(const string & word, const string & names)
+{
+	// A whole word beats part of one
+	unsigned int score = 0;
+	size_t position = names.find(word);
+	while (position != string::npos)
+	{
+		size_t end = position + word.length();
+		bool b_starts_word = (position == 0 || !isalnum((unsigned char) names[position - 1]));
+		bool b_ends_word = (end == names.length() || !isalnum((unsigned char) names[end]));
+		if (b_starts_word && b_ends_word)
+		{
+			return SCORE_WORD;
+		}
+
+		score = SCORE_SUBSTRING;
+		position = names.find(word, position + 1);
+	}
+
+	// Too short to match part of a word
+	if (word.length() < 3)
+	{
+		return 0;
+	}
+
+	return score;
+}
+
+string P2PSearchIndex::toLower(const string & text)
+{
+	string lower_text = text;
+	for (unsigned int i = 0; i < lower_text.length(); i++)
+	{
+		lower_text[i] = tolower((unsigned char) lower_text[i]);
+	}
+
+	return lower_text;
+}
+
+vector<string> P2PSearchIndex::tokenize(const string & text)
+{
+	// Words are runs of letters and digits
+	vector<string> tokens;
+	size_t start = 0;
+	while (start < text.length())
+	{
+		while (start < text.length() && !isalnum((unsigned char) text[start]))
+		{
+			start++;
+		}
+
+		size_t end = start;
+		while (end < text.length() && isalnum((unsigned char) text[end]))
+		{
+			end++;
+		}
+
+		if (end > start)
+		{
+			tokens.push_back(text.substr(start, end - start));
+		}
+
+		start = end;
+	}
+
+	// Each word once
+	sort(tokens.begin(), tokens.end());
+	tokens.erase(unique(tokens.begin(), tokens.end()), tokens.end());
+
+	return tokens;
+}
+
+vector<unsigned int> P2PSearchIndex::trigrams(const string & text)
+{
+	vector<unsigned int> text_trigrams;
+	for (size_t i = 0; i + 3 <= text.length(); i++)
+	{
+		text_trigrams.push_back(((unsigned char) text[i] << 16) | ((unsigned char) text[i + 1] << 8) | (unsigned char) text[i + 2]);
+	}
+
+	sort(text_trigrams.begin(), text_trigrams.end());
+	text_trigrams.erase(unique(text_trigrams.begin(), text_trigrams.end()), text_trigrams.end());
+
+	return text_trigrams;
+}
+
+void P2PSearchIndex::addPosting(vector<unsigned int> & posting, unsigned int file_id)
+{
+	// New files have the highest IDs, so they nearly always go on the end
+	if (posting.empty() || posting.back() < file_id)
+	{
+		posting.push_back(file_id);
+		return;
+	}
+
+	vector<unsigned int>::iterator iter = lower_bound(posting.begin(), posting.end(), file_id);
+	if (iter == posting.end() || *iter != file_id)
+	{
+		posting.insert(iter, file_id);
+	}
+}
+
+void P2PSearchIndex::removePosting(vector<unsigned int> & posting, unsigned int file_id)
+{
+	vector<unsigned int>::iterator iter = lower_bound(posting.begin(), posting.end(), file_id);
+	if (iter != posting.end() && *iter == file_id)
+	{
+		posting.erase(iter);
+	}
+}
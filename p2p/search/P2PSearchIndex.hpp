@@ -0,0 +1,52 @@
+#ifndef P2PSEARCHINDEX_H
+#define P2PSEARCHINDEX_H
+
+using namespace std;
+
+typedef struct {
+	unsigned int file_id;
+	unsigned int score;
+} SearchMatch;
+
+/**
+ * Finds files by name. Names are lowercased and indexed twice: by the
+ * words in them (split on anything that isn't a letter or digit), and by
+ * every three-character run, so a query can match part of a word too.
+ * Each word of a query must match. The index with the fewest files for a
+ * word picks the candidates, and only those are checked against the rest
+ * of the query - so a search costs what its rarest word costs, not what
+ * the catalog does.
+ * Postings are kept sorted by file ID. Not thread safe - the catalog's
+ * lock covers it.
+ */
+class P2PSearchIndex
+{
+	private:
+		// Each file's names, lowercased, one per line
+		unordered_map<unsigned int, string> names_by_file;
+
+		unordered_map<string, vector<unsigned int> > files_by_token;
+		unordered_map<unsigned int, vector<unsigned int> > files_by_trigram;
+
+		static string toLower(const string &);
+		static vector<string> tokenize(const string &);
+		static vector<unsigned int> trigrams(const string &);
+		static void addPosting(vector<unsigned int> &, unsigned int);
+		static void removePosting(vector<unsigned int> &, unsigned int);
+
+		const vector<unsigned int> * getCandidates(const string &, vector<unsigned int> &);
+		static unsigned int scoreWord(const string &, const string &);
+
+	public:
+		P2PSearchIndex();
+
+		void addName(unsigned int, const string &);
+		void removeFile(unsigned int);
+		vector<SearchMatch> search(const string &);
+
+		// Points for a query word matching a whole word of a name, or just part of one
+		static const unsigned int SCORE_WORD = 2;
+		static const unsigned int SCORE_SUBSTRING = 1;
+};
+
+#endif
@@ -8,15 +8,51 @@
  * Public Methods
  */
 
+const string P2PServer::STATE_FOLDER = "P2PTrackerData";
+
 P2PServer::P2PServer()
 {
-	max_file_id = 0;
+	maintenance_pool = NULL;
+	b_snapshot_queued = false;
+	b_holding_restored_peers = false;
+	timerclear(&restored_at);
+	pthread_mutex_init(&maintenance_mutex, NULL);
 }
 
-void P2PServer::start()
+void P2PServer::start(int port, unsigned int shard)
 {
+	// This shard's files get IDs only it hands out
+	PORT_NUMBER = port;
+	catalog.setFileIdRange(P2PShardRing::getFirstFileId(shard), P2PShardRing::getLastFileId(shard));
+
+	// Pick up the catalog from before a restart - each server on this host keeps its own
+	timeval started, finished, elapsed;
+	gettimeofday(&started, NULL);
+	unsigned long long replayed_log_bytes = 0;
+	if (!catalog.restore(STATE_FOLDER + "/" + to_string(PORT_NUMBER), replayed_log_bytes))
+	{
+		cout << "Error: could not open the catalog journal - the catalog won't survive a restart." << endl;
+	}
+	gettimeofday(&finished, NULL);
+	timersub(&finished, &started, &elapsed);
+
+	if (catalog.countFiles() > 0)
+	{
+		cout << "Restored " << catalog.countFiles() << " files in " << (elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000) << " ms." << endl;
+		b_holding_restored_peers = true;
+		restored_at = finished;
+	}
+
+	// Index what was restored in the background, then fold the replayed journal into a new snapshot
+	maintenance_pool = new P2PThreadPool(1, 0);
+	maintenance_pool->submit(&P2PServer::indexFilesTask, (void *) this);
+	if (replayed_log_bytes > 0)
+	{
+		queueSnapshot();
+	}
+
 	// Open the socket and listen for connections
-	node = P2PPeerNode(27890, 512);
+	node = P2PPeerNode(PORT_NUMBER, 512);
 	node.setBindMaxOffset(1);
 	node.start();
 
@@ -43,31 +79,128 @@ void * P2PServer::startActivityListenerThread(void * arg)
 
 void P2PServer::runProgram()
 {
+	// Start the request workers
+	unsigned int num_shards = P2PThreadPool::defaultThreadCount();
+	for (unsigned int i = 0; i < num_shards; i++)
+	{
+		request_shards.push_back(new P2PThreadPool(1, 0));
+	}
+
 	bool b_program_active = true;
 	while (b_program_active)
 	{
-		// Handle updates
+		// Sleep until a message arrives - wake up now and then to notice peers leaving
+		P2PMessage message;
+		bool b_has_message = node.waitForQueueMessage(message, 1000);
+
+		// Handle updates before the message, so it never sees a departed peer's files
 		if (socketsModified())
 		{
 			// Update socket-dependent logic
 			updateFileList();
 		}
 
-		if (node.countQueueMessages() > 0)
+		if (b_has_message)
 		{
-			// Get the oldest message
-			P2PMessage message = node.popQueueMessage();
+			dispatchRequest(message);
+		}
 
-			// Handle message
-			handleRequest(message.socket_id, message.message);
+		// Restored peers that haven't shared again by now aren't coming back
+		if (b_holding_restored_peers)
+		{
+			timeval now, held;
+			gettimeofday(&now, NULL);
+			timersub(&now, &restored_at, &held);
+			if (held.tv_sec * 1000 + held.tv_usec / 1000 >= (long) RESTORED_PEER_GRACE_MS)
+			{
+				catalog.lockForWriting();
+				catalog.removeSocket(P2PFileCatalog::RESTORED_SOCKET);
+				catalog.unlock();
+				b_holding_restored_peers = false;
+			}
 		}
-		else
+
+		// Once the journal has grown enough, replace it with a snapshot
+		if (catalog.getJournalBytes() >= SNAPSHOT_JOURNAL_BYTES)
 		{
-			usleep(5000);
+			queueSnapshot();
 		}
 	}
 }
 
+void P2PServer::queueSnapshot()
+{
+	// One at a time
+	pthread_mutex_lock(&maintenance_mutex);
+	bool b_queue = !b_snapshot_queued;
+	b_snapshot_queued = true;
+	pthread_mutex_unlock(&maintenance_mutex);
+
+	if (b_queue && !maintenance_pool->submit(&P2PServer::snapshotTask, (void *) this))
+	{
+		pthread_mutex_lock(&maintenance_mutex);
+		b_snapshot_queued = false;
+		pthread_mutex_unlock(&maintenance_mutex);
+	}
+}
+
+void P2PServer::snapshotTask(void * arg)
+{
+	P2PServer * server = (P2PServer *) arg;
+
+	// Readers carry on meanwhile - only the copy into memory holds up changes, not the disk
+	unsigned int generation = 0;
+	server->catalog.lockForReading();
+	string snapshot = server->catalog.encodeSnapshot(generation);
+	server->catalog.unlock();
+
+	if (snapshot.length() > 0)
+	{
+		server->catalog.saveSnapshot(snapshot, generation);
+	}
+
+	pthread_mutex_lock(&server->maintenance_mutex);
+	server->b_snapshot_queued = false;
+	pthread_mutex_unlock(&server->maintenance_mutex);
+}
+
+void P2PServer::indexFilesTask(void * arg)
+{
+	P2PServer * server = (P2PServer *) arg;
+
+	// A batch per turn with the lock, so requests get in between
+	bool b_indexed = false;
+	while (!b_indexed)
+	{
+		server->catalog.lockForWriting();
+		b_indexed = server->catalog.indexFiles(INDEX_BATCH_SIZE);
+		server->catalog.unlock();
+	}
+}
+
+void P2PServer::dispatchRequest(P2PMessage message)
+{
+	// The worker frees the request
+	ServerRequest * request = new ServerRequest;
+	request->server = this;
+	request->message = message;
+
+	// Keep each client's requests in order by always using the same worker
+	P2PThreadPool * shard = request_shards[message.socket_id % request_shards.size()];
+	if (!shard->submit(&P2PServer::handleRequestTask, (void *)request))
+	{
+		delete request;
+	}
+}
+
+void P2PServer::handleRequestTask(void * arg)
+{
+	// Revive the request
+	ServerRequest * request = (ServerRequest *) arg;
+	request->server->handleRequest(request->message.socket_id, request->message.message);
+	delete request;
+}
+
 bool P2PServer::socketsModified()
 {
 	timeval node_sockets_lm = node.getSocketsLastModified();
@@ -79,42 +212,25 @@ void P2PServer::updateFileList()
 {
 	// Get all of the current sockets
 	vector<P2PSocket> sockets = node.getSockets();
-
-	// Prep work
-	bool b_socket_found;
-	vector<FileItem>::iterator file_iter;
-	vector<FileAddress>::iterator addr_iter;
+	unordered_map<int, bool> sockets_online;
 	vector<P2PSocket>::iterator sock_iter;
-
-	// For each file, ensure that the file's owners are online
-	for (file_iter = file_list.begin(); file_iter < file_list.end(); )
+	for (sock_iter = sockets.begin(); sock_iter < sockets.end(); sock_iter++)
 	{
-		b_socket_found = false;
+		sockets_online[(*sock_iter).socket_id] = true;
+	}
 
-		// Validate each address attached to each file
-		for (addr_iter = (*file_iter).addresses.begin(); addr_iter < (*file_iter).addresses.end(); )
+	// Drop the files of any sharing peer that's gone - the rest are untouched
+	catalog.lockForWriting();
+	vector<int> sharing_sockets = catalog.getSockets();
+	vector<int>::iterator iter;
+	for (iter = sharing_sockets.begin(); iter < sharing_sockets.end(); iter++)
+	{
+		if (sockets_online.find(*iter) == sockets_online.end() && *iter != P2PFileCatalog::RESTORED_SOCKET)
 		{
-			for (sock_iter = sockets.begin(); sock_iter < sockets.end(); sock_iter++)
-			{
-				if ((*sock_iter).socket_id == (*addr_iter).socket_id)
-				{
-					b_socket_found = true;
-					break;
-				}
-			}
-
-			if (b_socket_found)
-				addr_iter++;
-			else
-				(*file_iter).addresses.erase(addr_iter);
+			catalog.removeSocket(*iter);
 		}
-
-		// If a file has no more addresses attached to it, then remove it
-		if ((*file_iter).addresses.size() > 0)
-			file_iter++;
-		else
-			file_list.erase(file_iter);
 	}
+	catalog.unlock();
 
 	// Update the last modified time
 	sockets_last_modified = node.getSocketsLastModified();
@@ -137,21 +253,32 @@ void P2PServer::handleRequest(int socket, string request)
 		cerr << "Adding files" << endl;
 
 		string message = addFiles(socket, request_parsed);
-		write(socket, message.c_str(), message.length());
+		node.sendMessageToSocket(message, socket);
 	}
 	else if (request_parsed[0].compare("list") == 0)
 	{
 		cerr << "Listing files" << endl;
 
-		string files = listFiles();
-		write(socket, files.c_str(), files.length());
+		listFiles(socket, request_parsed);
+	}
+	else if (request_parsed[0].compare("search") == 0)
+	{
+		cerr << "Searching files" << endl;
+
+		searchFiles(socket, request_parsed);
+	}
+	else if (request_parsed[0].compare("changes") == 0)
+	{
+		cerr << "Syncing files" << endl;
+
+		syncFiles(socket, request_parsed);
 	}
 	else if (request_parsed[0].compare("getFile") == 0)
 	{
 		cerr << "Getting file" << endl;
 
 		string message = getFile(request_parsed);
-		write(socket, message.c_str(), message.length());
+		node.sendMessageToSocket(message, socket);
 	}
 	else
 	{
@@ -164,13 +291,16 @@ string P2PServer::addFiles(int socket, vector<string> files)
 	// Get the public address / port
 	vector<string> address = P2PCommon::parseAddress(files[1]);
 
-	// Get the socket's IP address
+	// Get the socket's IP address - inet_ntoa's buffer would be shared between the workers
 	struct sockaddr_in client_address = node.getClientAddressFromSocket(socket);
-	string client_public_address = inet_ntoa(client_address.sin_addr);
+	char client_public_address[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &client_address.sin_addr, client_public_address, sizeof(client_public_address));
 
-	int i = 0;
+	// Parse and check everything before taking the lock
+	vector<FileItem> new_files;
+	int num_rejected = 0;
 	vector<string>::iterator iter;
-	for (iter = files.begin() + 2; iter < files.end(); iter++, i++)
+	for (iter = files.begin() + 2; iter < files.end(); iter++)
 	{
 		stringstream line(*iter);
 		string segment;
@@ -187,180 +317,270 @@ string P2PServer::addFiles(int socket, vector<string> files)
 		file_address.public_address = client_public_address;
 		file_address.public_port = stoi(address[1]);
 
-		// If the file is new, add a new record
 		FileItem file_item;
-		if (hasFileItemWithNameSize(seglist[0], stoi(seglist[1])))
-		{
-			file_item = getFileItemWithNameSize(seglist[0], stoi(seglist[1]));
-		}
-		else
-		{
-			file_item.name = seglist[0];
-			file_item.size = stoi(seglist[1]);
-			file_item.file_id = ++max_file_id;
+		file_item.name = seglist[0];
+		file_item.size = stoi(seglist[1]);
+		file_item.addresses.push_back(file_address);
 
-			file_list.push_back(file_item);
+		// The file's hash and piece hashes, if the peer sent them
+		if (seglist.size() >= 5)
+		{
+			file_item.hash = P2PCommon::trimWhitespace(seglist[3]);
+			file_item.piece_hashes = P2PCommon::fromHex(P2PCommon::trimWhitespace(seglist[4]));
 		}
 
-		// Don't add the address if we already have it
-		if (!isAddressAttachedToFileItem(file_address, file_item))
+		// The hash decides which swarm the peer joins, so it must match the pieces it claims
+		if (file_item.hash.length() > 0)
 		{
-			// Add the address to the list
-			file_item.addresses.push_back(file_address);
-
-			// Update the file item record
-			updateFileItem(file_item);
+			unsigned int num_pieces = P2PFileTransfer::countChunks(file_item.size, P2PFileTransfer::chooseChunkSize(file_item.size));
+			if (file_item.piece_hashes.length() != num_pieces * P2PSha256::DIGEST_SIZE
+				|| P2PCommon::toHex(P2PMerkleTree::computeRoot(file_item.piece_hashes)) != file_item.hash)
+			{
+				num_rejected++;
+				continue;
+			}
 		}
-	}
 
-	return to_string(i) + " files successfully added to file listing.";
-}
+		new_files.push_back(file_item);
+	}
 
-void P2PServer::updateFileItem(FileItem file_item)
-{
-	vector<FileItem>::iterator iter;
-	for (iter = file_list.begin(); iter < file_list.end(); iter++)
+	// Find each file's record by content, or add a new one - the catalog skips addresses it already has
+	vector<FileItem>::iterator file_iter;
+	unsigned int num_added = 0;
+	catalog.lockForWriting();
+	for (file_iter = new_files.begin(); file_iter < new_files.end(); file_iter++)
 	{
-		if (file_item.file_id == (*iter).file_id)
+		// No file at all if this shard has handed out every ID it owns
+		FileItem * file_item = catalog.addFile(*file_iter);
+		if (file_item != NULL)
 		{
-			(*iter) = file_item;
-			break;
+			catalog.addAddress(file_item, (*file_iter).addresses[0]);
+			num_added++;
 		}
 	}
-}
+	unsigned long long journal_sequence = catalog.getJournalSequence();
+	catalog.unlock();
 
-string P2PServer::listFiles()
-{
-	if (file_list.size() == 0)
+	// Only acknowledge once the files are on disk - workers adding at the same time share the sync
+	if (!catalog.waitForJournal(journal_sequence))
 	{
-		return "\r\nThere are currently no files stored on the server.\r\n";
+		cout << "Error: could not save " << num_added << " added files to the journal." << endl;
+		return "Error: " + to_string(num_added) + " files were listed, but the server could not save them - they will be lost if it restarts.";
 	}
 
-	string files_message = "\r\nFile Listing:\r\n";
+	string message = to_string(num_added) + " files successfully added to file listing.";
+	if (num_rejected > 0)
+	{
+		message += " " + to_string(num_rejected) + " files were rejected, their hashes didn't check out.";
+	}
 
-	vector<FileItem>::iterator iter;
-	for (iter = file_list.begin(); iter < file_list.end(); iter++)
+	if (num_added < new_files.size())
 	{
-		files_message += "\t" + to_string((*iter).file_id) + ") " + (*iter).name + " - (" + to_string((*iter).size) + " B)" "\r\n";
+		cout << "Error: this server has run out of file IDs." << endl;
+		message += " " + to_string(new_files.size() - num_added) + " files were refused, this server has no file IDs left.";
 	}
 
-	return files_message;
+	return message;
 }
 
-string P2PServer::getFile(vector<string> request)
+void P2PServer::listFiles(int socket, vector<string> request)
 {
-	// Get the File Item info from the file ID
-	int file_id = stoi(request[1]);
-
-	// Validate that the file exists
-	if (!hasFileWithId(file_id))
+	// list, then optionally: the last file ID already seen, page size, name prefix, min size, max size
+	unsigned int cursor = parseNumber(request, 1, 0);
+	unsigned int limit = parseNumber(request, 2, LIST_PAGE_SIZE);
+	limit = max(1U, min(limit, (unsigned int) MAX_LIST_PAGE_SIZE));
+
+	FileFilter filter;
+	filter.name_prefix = (request.size() > 3) ? P2PCommon::trimWhitespace(request[3]) : "";
+	filter.min_size = parseNumber(request, 4, 0);
+	filter.max_size = parseNumber(request, 5, 0);
+
+	// Send the page in batches as they're read, only holding the lock for one at a time
+	unsigned int num_listed = 0;
+	while (num_listed < limit)
 	{
-		return "fileAddress\r\nNULL\r\nNULL\r\nNULL\r\nNULL";
-	}
+		string files_message = "fileList";
+		unsigned int batch_size = min(limit - num_listed, (unsigned int) LIST_BATCH_SIZE);
 
-	// Get the file item
-	FileItem file_item = getFileItem(file_id);
+		catalog.lockForReading();
+		vector<FileItem *> batch = catalog.listFiles(cursor, batch_size, filter, cursor);
+		vector<FileItem *>::iterator iter;
+		for (iter = batch.begin(); iter != batch.end(); iter++)
+		{
+			files_message += "\r\n" + describeFile(**iter);
+		}
+		catalog.unlock();
 
-	// Compile all of the public addresses
-	string address_list;
-	vector<FileAddress>::iterator iter;
-	for (iter = file_item.addresses.begin(); iter < file_item.addresses.end(); iter++)
-	{
-		address_list += "\r\n" + (*iter).public_address + ":" + to_string((*iter).public_port);
+		if (batch.size() > 0)
+		{
+			node.sendMessageToSocket(files_message, socket);
+			num_listed += batch.size();
+		}
+
+		// A short batch means the end of the catalog, or as far as one request may look - the client asks again for more.
+		// A full batch can still end the catalog, and the cursor goes back to 0 to say so.
+		if (batch.size() < batch_size || cursor == 0)
+		{
+			break;
+		}
 	}
 
-	// Report the disconnection
-	return "fileAddress\r\n" + to_string(file_id) + "\r\n"
-			+ file_item.name + "\r\n" + to_string(file_item.size)
-			+ address_list;
+	// Close the page off with where to pick up next - 0 when there's nothing more
+	node.sendMessageToSocket("fileListEnd\r\n" + to_string(cursor) + "\r\n" + to_string(num_listed), socket);
 }
 
-bool P2PServer::hasFileItemWithNameSize(string name, int size)
+void P2PServer::searchFiles(int socket, vector<string> request)
 {
-	vector<FileItem>::iterator iter;
-	for (iter = file_list.begin(); iter < file_list.end(); iter++)
+	// search, the query, then optionally how many results
+	string query = (request.size() > 1) ? P2PCommon::trimWhitespace(request[1]) : "";
+	unsigned int limit = parseNumber(request, 2, SEARCH_RESULTS);
+	limit = max(1U, min(limit, (unsigned int) MAX_SEARCH_RESULTS));
+
+	catalog.lockForReading();
+	vector<FileItem *> results = catalog.searchFiles(query, limit);
+	vector<string> files_messages;
+	for (unsigned int i = 0; i < results.size(); i += LIST_BATCH_SIZE)
 	{
-		if ((*iter).size == size && (*iter).name.compare(name) == 0)
+		string files_message = "fileList";
+		for (unsigned int j = i; j < results.size() && j < i + LIST_BATCH_SIZE; j++)
 		{
-			return true;
+			files_message += "\r\n" + describeFile(*results[j]);
 		}
+		files_messages.push_back(files_message);
 	}
+	catalog.unlock();
 
-	return false;
+	// Results come back like a listing, one page with nothing after it
+	for (unsigned int i = 0; i < files_messages.size(); i++)
+	{
+		node.sendMessageToSocket(files_messages[i], socket);
+	}
+
+	node.sendMessageToSocket("fileListEnd\r\n0\r\n" + to_string(results.size()), socket);
 }
 
-bool P2PServer::hasFileWithId(int file_id)
+void P2PServer::syncFiles(int socket, vector<string> request)
 {
-	vector<FileItem>::iterator iter;
-	for (iter = file_list.begin(); iter < file_list.end(); iter++)
+	// changes, then the catalog version the client already has - 0 when it has nothing
+	unsigned int since_version = parseNumber(request, 1, 0);
+
+	// Files added or changed are sent whole, prefixed with a '+' - removed ones are just a '-' and the ID
+	vector<string> changes_messages;
+	vector<unsigned int> changed_ids;
+	catalog.lockForReading();
+	unsigned int version = catalog.getVersion();
+	bool b_full_sync = (since_version == 0 || !catalog.getChangedFiles(since_version, changed_ids));
+	for (unsigned int i = 0; i < changed_ids.size(); i += LIST_BATCH_SIZE)
 	{
-		if ((*iter).file_id == file_id)
+		string changes_message = "catalogChanges";
+		for (unsigned int j = i; j < changed_ids.size() && j < i + LIST_BATCH_SIZE; j++)
 		{
-			return true;	
+			FileItem * file_item = catalog.getFile(changed_ids[j]);
+			changes_message += (file_item != NULL) ? "\r\n+" + describeFile(*file_item) : "\r\n-" + to_string(changed_ids[j]);
 		}
+		changes_messages.push_back(changes_message);
 	}
+	catalog.unlock();
 
-	return false;
-}
+	for (unsigned int i = 0; i < changes_messages.size(); i++)
+	{
+		node.sendMessageToSocket(changes_messages[i], socket);
+	}
 
-FileItem P2PServer::getFileItemWithNameSize(string name, int size)
-{
-	FileItem file_item;
-	vector<FileItem>::iterator iter;
-	for (iter = file_list.begin(); iter < file_list.end(); iter++)
+	// Too far behind - send everything, in batches so the lock is held for one at a time.
+	// Anything changed meanwhile is after the version sent, so the next sync picks it up.
+	if (b_full_sync)
 	{
-		if ((*iter).size == size && (*iter).name.compare(name) == 0)
+		FileFilter no_filter;
+		no_filter.min_size = 0;
+		no_filter.max_size = 0;
+
+		unsigned int cursor = 0;
+		do
 		{
-			file_item = (*iter);
-			break;
-		}
+			string changes_message = "catalogChanges";
+
+			catalog.lockForReading();
+			vector<FileItem *> batch = catalog.listFiles(cursor, LIST_BATCH_SIZE, no_filter, cursor);
+			for (unsigned int i = 0; i < batch.size(); i++)
+			{
+				changes_message += "\r\n+" + describeFile(*batch[i]);
+			}
+			catalog.unlock();
+
+			if (batch.size() > 0)
+			{
+				node.sendMessageToSocket(changes_message, socket);
+			}
+		} while (cursor != 0);
 	}
 
-	return file_item;
+	// Close off with the version the client now has, and whether to throw out what it had before
+	node.sendMessageToSocket("catalogVersion\r\n" + to_string(version) + "\r\n" + (b_full_sync ? "1" : "0"), socket);
 }
 
-FileItem P2PServer::getFileItem(int file_id)
+string P2PServer::describeFile(const FileItem & file_item)
 {
-	FileItem file_item;
-	vector<FileItem>::iterator iter;
-	for (iter = file_list.begin(); iter < file_list.end(); iter++)
+	// ID, name, size, peers sharing it, then the other names the same content is shared under
+	string description = to_string(file_item.file_id) + '\t' + file_item.name + '\t' + to_string(file_item.size)
+		+ '\t' + to_string(file_item.addresses.size());
+	for (unsigned int i = 0; i < file_item.aliases.size(); i++)
 	{
-		if ((*iter).file_id == file_id)
-		{
-			file_item = *iter;
-			break;
-		}
+		description += '\t' + file_item.aliases[i];
 	}
 
-	return file_item;
+	return description;
 }
 
-bool P2PServer::isAddressAttachedToFileItem(FileAddress file_address, FileItem file_item)
+unsigned int P2PServer::parseNumber(vector<string> & request, unsigned int index, unsigned int default_value)
 {
-	vector<FileAddress>::iterator iter;
-	for (iter = file_item.addresses.begin(); iter < file_item.addresses.end(); iter++)
+	// Missing or blank fields take the default
+	if (index >= request.size())
 	{
-		if ((*iter).public_address == file_address.public_address &&
-			(*iter).public_port == file_address.public_port)
-		{
-			return true;
-		}
+		return default_value;
 	}
 
-	return false;
+	string field = P2PCommon::trimWhitespace(request[index]);
+	if (field.length() == 0 || field.find_first_not_of("0123456789") != string::npos)
+	{
+		return default_value;
+	}
+
+	return strtoul(field.c_str(), NULL, 10);
 }
 
-bool P2PServer::isSocketAttachedToFileItem(int socket_id, FileItem file_item)
+string P2PServer::getFile(vector<string> request)
 {
+	// Get the File Item info from the file ID
+	int file_id = stoi(request[1]);
+
+	// Validate that the file exists
+	catalog.lockForReading();
+	FileItem * file_item = catalog.getFile(file_id);
+	if (file_item == NULL)
+	{
+		catalog.unlock();
+		return "fileAddress\r\nNULL\r\nNULL\r\nNULL\r\nNULL\r\nNULL\r\nNULL\r\nNULL";
+	}
+
+	// Compile all of the public addresses
+	string address_list;
 	vector<FileAddress>::iterator iter;
-	for (iter = file_item.addresses.begin(); iter < file_item.addresses.end(); iter++)
+	for (iter = file_item->addresses.begin(); iter < file_item->addresses.end(); iter++)
 	{
-		if ((*iter).socket_id == socket_id)
-		{
-			return true;
-		}
+		address_list += "\r\n" + (*iter).public_address + ":" + to_string((*iter).public_port);
 	}
 
-	return false;
-}
+	// Propose a chunk size to match the file - peers may clamp it
+	unsigned int chunk_size = P2PFileTransfer::chooseChunkSize(file_item->size);
 
+	// Report the disconnection
+	string message = "fileAddress\r\n" + to_string(file_id) + "\r\n"
+			+ file_item->name + "\r\n" + to_string(file_item->size) + "\r\n"
+			+ to_string(chunk_size) + "\r\n"
+			+ file_item->hash + "\r\n" + P2PCommon::toHex(file_item->piece_hashes)
+			+ address_list;
+	catalog.unlock();
+
+	return message;
+}
@@ -2,9 +2,19 @@
 #define P2PSERVER_H
 
 #include "../node/P2PPeerNode.cpp"
+#include "../search/P2PSearchIndex.cpp"
+#include "../journal/P2PJournal.cpp"
+#include "../catalog/P2PFileCatalog.cpp"
 
 using namespace std;
 
+class P2PServer;
+
+typedef struct {
+	P2PServer * server;
+	P2PMessage message;
+} ServerRequest;
+
 class P2PServer
 {
 	private:
@@ -12,38 +22,65 @@ class P2PServer
 		void runProgram();
 		void handleRequest(int, string);
 		string addFiles(int, vector<string>);
-		string listFiles();
+		void listFiles(int, vector<string>);
+		void searchFiles(int, vector<string>);
+		void syncFiles(int, vector<string>);
+		static string describeFile(const FileItem &);
+		static unsigned int parseNumber(vector<string> &, unsigned int, unsigned int);
 		void updateFileList();
 		bool socketsModified();
 		string getFile(vector<string>);
 
-		bool hasFileWithId(int);
-		FileItem getFileItem(int);
-
-		bool hasFileItemWithNameSize(string, int);
-		FileItem getFileItemWithNameSize(string, int);
-		void updateFileItem(FileItem);
-
-		bool isAddressAttachedToFileItem(FileAddress, FileItem);
-		bool isSocketAttachedToFileItem(int, FileItem);
-
 		// Server limits and port
 		int PORT_NUMBER;
 
+		// Files listed per page unless the client asks otherwise, the most it can ask for,
+		// and how many go in each frame of a page
+		static const unsigned int LIST_PAGE_SIZE = 100;
+		static const unsigned int MAX_LIST_PAGE_SIZE = 1000;
+		static const unsigned int LIST_BATCH_SIZE = 100;
+
+		// Search results returned unless the client asks otherwise, and the most it can ask for
+		static const unsigned int SEARCH_RESULTS = 20;
+		static const unsigned int MAX_SEARCH_RESULTS = 100;
+
 		// Thread worker functions
 		static void * startActivityListenerThread(void *);
+		static void handleRequestTask(void *);
+
+		// Request workers, one thread each - a socket's requests always go to the same one
+		vector<P2PThreadPool *> request_shards;
+		void dispatchRequest(P2PMessage);
 
 		// Keep track of the peer node
 		P2PPeerNode node;
 
-		// Keep a list of the files and active clients
-		vector<FileItem> file_list;
+		// Keep a catalog of the files and active clients
+		P2PFileCatalog catalog;
 		timeval sockets_last_modified;
-		int max_file_id;
+
+		// Saving and restoring the catalog - snapshots and indexing run on their own thread
+		static const string STATE_FOLDER;
+		P2PThreadPool * maintenance_pool;
+		pthread_mutex_t maintenance_mutex;
+		bool b_snapshot_queued;
+		void queueSnapshot();
+		static void snapshotTask(void *);
+		static void indexFilesTask(void *);
+
+		// Peers restored from before a restart, and when
+		bool b_holding_restored_peers;
+		timeval restored_at;
+
+		// Journal bytes before a snapshot replaces them, files indexed per turn with the lock,
+		// and how long restored peers have to share again before they're dropped
+		static const unsigned long long SNAPSHOT_JOURNAL_BYTES = 64ULL * 1024 * 1024;
+		static const unsigned int INDEX_BATCH_SIZE = 5000;
+		static const unsigned int RESTORED_PEER_GRACE_MS = 600000;
 
 	public:
 		P2PServer();
-		void start();
+		void start(int, unsigned int);
 };
 
 #endif
\ No newline at end of file
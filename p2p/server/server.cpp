@@ -7,9 +7,18 @@ int main(int argc, const char* argv[])
 	// Program welcome message
 	cout << "P2P Server - startup requested" << endl;
 
+	// Get any custom arguments - the port, then which shard of a tracker cluster this is
+	int port = (argc >= 2) ? atoi(argv[1]) : 27890;
+	unsigned int shard = (argc >= 3) ? strtoul(argv[2], NULL, 10) : 0;
+	if (port <= 0 || shard >= P2PShardRing::MAX_SHARDS)
+	{
+		cout << "Usage: server [port [shard]] - shards are numbered from 0 to " << (P2PShardRing::MAX_SHARDS - 1) << endl;
+		return 1;
+	}
+
 	// Start up the server
 	P2PServer server;
-	server.start();
+	server.start(port, shard);
 
 	return 0;
 }
@@ -0,0 +1,136 @@
+/**
+ * Peer-to-peer worker thread pool class
+ */
+
+#include "P2PThreadPool.hpp"
+
+P2PThreadPool::P2PThreadPool(unsigned int num_threads, unsigned int max_queued)
+{
+	// A limit of zero leaves the queue unbounded
+	max_queued_tasks = max_queued;
+	b_stopping = false;
+
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&task_available, NULL);
+	pthread_cond_init(&space_available, NULL);
+
+	for (unsigned int i = 0; i < num_threads; i++)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, &P2PThreadPool::runWorker, (void *) this) != 0)
+		{
+			perror("Error: could not spawn worker thread");
+			exit(1);
+		}
+
+		threads.push_back(thread);
+	}
+}
+
+P2PThreadPool::~P2PThreadPool()
+{
+	this->stop();
+
+	pthread_cond_destroy(&space_available);
+	pthread_cond_destroy(&task_available);
+	pthread_mutex_destroy(&mutex);
+}
+
+bool P2PThreadPool::submit(void (*function)(void *), void * arg)
+{
+	pthread_mutex_lock(&mutex);
+
+	// Hold the caller back while the queue is full, rather than buffer without limit
+	while (max_queued_tasks > 0 && tasks.size() >= max_queued_tasks && !b_stopping)
+	{
+		pthread_cond_wait(&space_available, &mutex);
+	}
+
+	if (b_stopping)
+	{
+		pthread_mutex_unlock(&mutex);
+		return false;
+	}
+
+	P2PTask task;
+	task.function = function;
+	task.arg = arg;
+	tasks.push_back(task);
+
+	pthread_cond_signal(&task_available);
+	pthread_mutex_unlock(&mutex);
+
+	return true;
+}
+
+void P2PThreadPool::stop()
+{
+	pthread_mutex_lock(&mutex);
+	b_stopping = true;
+	pthread_cond_broadcast(&task_available);
+	pthread_cond_broadcast(&space_available);
+	pthread_mutex_unlock(&mutex);
+
+	// Workers finish whatever is already queued before they exit
+	vector<pthread_t>::iterator iter;
+	for (iter = threads.begin(); iter < threads.end(); iter++)
+	{
+		pthread_join(*iter, NULL);
+	}
+
+	threads.clear();
+}
+
+unsigned int P2PThreadPool::countThreads()
+{
+	return threads.size();
+}
+
+unsigned int P2PThreadPool::countQueuedTasks()
+{
+	pthread_mutex_lock(&mutex);
+	unsigned int num_tasks = tasks.size();
+	pthread_mutex_unlock(&mutex);
+
+	return num_tasks;
+}
+
+unsigned int P2PThreadPool::defaultThreadCount()
+{
+	// One per core, within reason
+	long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_cores < 2) return 2;
+	if (num_cores > 16) return 16;
+	return num_cores;
+}
+
+void * P2PThreadPool::runWorker(void * arg)
+{
+	P2PThreadPool * pool = (P2PThreadPool *) arg;
+
+	while (true)
+	{
+		pthread_mutex_lock(&pool->mutex);
+		while (pool->tasks.empty() && !pool->b_stopping)
+		{
+			pthread_cond_wait(&pool->task_available, &pool->mutex);
+		}
+
+		if (pool->tasks.empty())
+		{
+			// Stopping, and nothing left to do
+			pthread_mutex_unlock(&pool->mutex);
+			break;
+		}
+
+		P2PTask task = pool->tasks.front();
+		pool->tasks.pop_front();
+		pthread_cond_signal(&pool->space_available);
+		pthread_mutex_unlock(&pool->mutex);
+
+		// Run the task outside the lock
+		task.function(task.arg);
+	}
+
+	pthread_exit(NULL);
+}
@@ -0,0 +1,38 @@
+#ifndef P2PTHREADPOOL_H
+#define P2PTHREADPOOL_H
+
+using namespace std;
+
+/**
+ * A fixed set of worker threads fed from a mutex-guarded queue.
+ * A task is a function and its argument - the function owns the
+ * argument and frees it when it's done.
+ */
+class P2PThreadPool
+{
+	private:
+		vector<pthread_t> threads;
+		deque<P2PTask> tasks;
+		unsigned int max_queued_tasks;
+		bool b_stopping;
+
+		pthread_mutex_t mutex;
+		pthread_cond_t task_available;
+		pthread_cond_t space_available;
+
+		static void * runWorker(void *);
+
+	public:
+		P2PThreadPool(unsigned int, unsigned int);
+		~P2PThreadPool();
+
+		bool submit(void (*)(void *), void *);
+		void stop();
+
+		unsigned int countThreads();
+		unsigned int countQueuedTasks();
+
+		static unsigned int defaultThreadCount();
+};
+
+#endif